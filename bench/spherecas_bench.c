@@ -0,0 +1,327 @@
+//
+//  spherecas_bench
+//
+//  Throughput benchmark for the spherecas library. Generates synthetic Sphere
+//  cassette data in memory for a set of scenarios (block count and sizes, the
+//  amount of garbage between blocks, false sync sequences inside payloads, bad
+//  checksums), then times spherecas_read_bytes over it with a range of chunk
+//  sizes, and reports MB/s and blocks/s for each.
+//
+//  Build from the top of the repo with:
+//
+//      cc -O2 -I. -DSPHERECAS_NO_GLOBAL_CALLBACK bench/spherecas_bench.c spherecas.c -o spherecas_bench
+//
+//  Copyright (c) Ben Zotto 2022.
+//  See LICENSE for licensing information.
+//
+
+#include <stdio.h>
+#include <getopt.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include "spherecas.h"
+
+// Each measurement is repeated until it has run for at least this long.
+#define MIN_SECONDS     0.25
+
+struct scenario {
+    const char *    name;
+    int             blocks;
+    int             min_size;           // Payload sizes are uniform in [min, max]
+    int             max_size;
+    double          garbage_ratio;      // Garbage bytes between blocks, per payload byte
+    int             false_syncs;        // 16 16 16 1B sequences planted in each payload
+    double          bad_checksums;      // Fraction of blocks with a corrupted checksum
+};
+
+static const struct scenario Scenarios[] = {
+    { "clean-small",     4000,    16,   512, 0.0,  0, 0.0  },
+    { "clean-large",      200, 16384, 65536, 0.0,  0, 0.0  },
+    { "leader-heavy",     400,   256,  4096, 4.0,  0, 0.0  },
+    { "garbage-heavy",    100,   256,  4096, 30.0, 0, 0.0  },
+    { "false-syncs",     1000,   512,  4096, 0.5,  4, 0.0  },
+    { "bad-checksums",   1000,   512,  4096, 0.5,  0, 0.25 },
+};
+
+// Chunk sizes to feed to read_bytes; 0 means the whole input in one call.
+static const size_t ChunkSizes[] = { 0, 0x10000, 4096, 256, 16 };
+
+struct tape {
+    uint8_t *       bytes;
+    size_t          size;
+    size_t          capacity;
+};
+
+struct counts {
+    int             blocks;
+};
+
+static uint64_t RandomState = 0x2545F4914F6CDD1DULL;
+
+static uint64_t random_next(void)
+{
+    // xorshift64*: plenty for making up tape data, and the same on every run.
+    RandomState ^= RandomState >> 12;
+    RandomState ^= RandomState << 25;
+    RandomState ^= RandomState >> 27;
+    return RandomState * 0x2545F4914F6CDD1DULL;
+}
+
+static int random_range(int min, int max)
+{
+    return min + (int)(random_next() % (uint64_t)(max - min + 1));
+}
+
+static void reserve(struct tape * tape, size_t count)
+{
+    if (tape->capacity - tape->size < count) {
+        while (tape->capacity - tape->size < count) {
+            tape->capacity = tape->capacity ? tape->capacity * 2 : 0x100000;
+        }
+        tape->bytes = realloc(tape->bytes, tape->capacity);
+        if (tape->bytes == NULL) {
+            printf("Out of memory generating tape\n");
+            exit(-1);
+        }
+    }
+}
+
+static void put(struct tape * tape, uint8_t byte)
+{
+    reserve(tape, 1);
+    tape->bytes[tape->size++] = byte;
+}
+
+// Garbage as it tends to look on real captures: mostly leader tone (sync bytes)
+// and random values, never quite forming a header.
+static void put_garbage(struct tape * tape, size_t count)
+{
+    for (size_t i = 0; i < count; i++) {
+        uint8_t byte = (uint8_t)random_next();
+        if (byte < 0x40) {
+            byte = 0x16;
+        } else if (byte == 0x1B) {
+            byte = 0x00;
+        }
+        put(tape, byte);
+    }
+}
+
+static void put_block(struct tape * tape, const struct scenario * scenario, int size)
+{
+    char name[2] = { 'A' + random_range(0, 25), '0' + random_range(0, 9) };
+    uint8_t payload[0x10000];
+
+    for (int i = 0; i < size; i++) {
+        payload[i] = (uint8_t)random_next();
+    }
+    for (int i = 0; i < scenario->false_syncs && size >= 4; i++) {
+        int at = random_range(0, size - 4);
+        memcpy(&payload[at], "\x16\x16\x16\x1B", 4);
+    }
+
+    reserve(tape, SPHERECAS_BLOCK_SIZE(size));
+    size_t written;
+    spherecas_write_block(&tape->bytes[tape->size], tape->capacity - tape->size,
+                          name, payload, size, 0, &written);
+    // Bad checksums are corrupted after the fact, in the checksum byte.
+    if ((random_next() % 10000) < (uint64_t)(scenario->bad_checksums * 10000)) {
+        tape->bytes[tape->size + 9 + size] ^= 0x01;
+    }
+    tape->size += written;
+}
+
+static void generate(struct tape * tape, const struct scenario * scenario)
+{
+    tape->size = 0;
+    for (int i = 0; i < scenario->blocks; i++) {
+        int size = random_range(scenario->min_size, scenario->max_size);
+        put_garbage(tape, (size_t)(size * scenario->garbage_ratio));
+        put_block(tape, scenario, size);
+    }
+    put_garbage(tape, 64);
+}
+
+static int count_block(struct spherecas_state * state,
+                       char block_name[],
+                       uint8_t * data,
+                       int length,
+                       enum spherecas_blocktype type,
+                       enum spherecas_error error)
+{
+    struct counts * counts = state->context;
+    (void)block_name;
+    (void)data;
+    (void)length;
+    (void)type;
+    (void)error;
+    counts->blocks++;
+    return SPHERECAS_CONTINUE;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Times one way of reading the tape. Returns seconds per pass.
+static double measure(const struct tape * tape, size_t chunk, unsigned options, int * blocks)
+{
+    int passes = 0;
+    double start = now(), elapsed;
+    do {
+        struct counts counts = { 0 };
+        struct spherecas_state state;
+        spherecas_begin_read_callback(&state, count_block, &counts);
+        spherecas_set_options(&state, options);
+        if (chunk == 0) {
+            spherecas_read_bytes(&state, tape->bytes, tape->size);
+        } else {
+            for (size_t at = 0; at < tape->size; at += chunk) {
+                size_t count = tape->size - at < chunk ? tape->size - at : chunk;
+                spherecas_read_bytes(&state, &tape->bytes[at], count);
+            }
+        }
+        spherecas_end_read(&state);
+        *blocks = counts.blocks;
+        passes++;
+        elapsed = now() - start;
+    } while (elapsed < MIN_SECONDS);
+    return elapsed / passes;
+}
+
+// The same, one byte at a time through read_byte, as a baseline.
+static double measure_bytewise(const struct tape * tape, int * blocks)
+{
+    int passes = 0;
+    double start = now(), elapsed;
+    do {
+        struct counts counts = { 0 };
+        struct spherecas_state state;
+        spherecas_begin_read_callback(&state, count_block, &counts);
+        for (size_t at = 0; at < tape->size; at++) {
+            spherecas_read_byte(&state, tape->bytes[at]);
+        }
+        spherecas_end_read(&state);
+        *blocks = counts.blocks;
+        passes++;
+        elapsed = now() - start;
+    } while (elapsed < MIN_SECONDS);
+    return elapsed / passes;
+}
+
+static void report(const char * method, size_t chunk, const struct tape * tape, double seconds, int blocks)
+{
+    char chunk_str[32];
+    if (chunk == 0) {
+        snprintf(chunk_str, sizeof(chunk_str), "all");
+    } else {
+        snprintf(chunk_str, sizeof(chunk_str), "%zu", chunk);
+    }
+    printf("  %-12s%-10s%12.1f%14.0f%10d\n", method, chunk_str,
+           tape->size / seconds / 1e6, blocks / seconds, blocks);
+}
+
+static void run_scenario(const struct scenario * scenario)
+{
+    struct tape tape = { 0 };
+    generate(&tape, scenario);
+    printf("\n%s: %d blocks of %d-%d bytes, garbage %.1fx, %d false sync(s) per block, %.0f%% bad checksums (%.1f MB)\n",
+           scenario->name, scenario->blocks, scenario->min_size, scenario->max_size,
+           scenario->garbage_ratio, scenario->false_syncs, scenario->bad_checksums * 100, tape.size / 1e6);
+    printf("  %-12s%-10s%12s%14s%10s\n", "METHOD", "CHUNK", "MB/s", "BLOCKS/s", "BLOCKS");
+
+    int blocks;
+    double seconds = measure_bytewise(&tape, &blocks);
+    report("read_byte", 1, &tape, seconds, blocks);
+    for (size_t i = 0; i < sizeof(ChunkSizes) / sizeof(ChunkSizes[0]); i++) {
+        seconds = measure(&tape, ChunkSizes[i], 0, &blocks);
+        report("copy", ChunkSizes[i], &tape, seconds, blocks);
+        seconds = measure(&tape, ChunkSizes[i], SPHERECAS_OPTION_ZERO_COPY, &blocks);
+        report("zero-copy", ChunkSizes[i], &tape, seconds, blocks);
+        seconds = measure(&tape, ChunkSizes[i], SPHERECAS_OPTION_ZERO_COPY | SPHERECAS_OPTION_FEATURES, &blocks);
+        report("features", ChunkSizes[i], &tape, seconds, blocks);
+    }
+    free(tape.bytes);
+}
+
+static void print_usage(const char * name)
+{
+    printf("usage: %s [scenario ...]\n", name);
+    printf("       %s -c -b blocks -s min_size -S max_size [-g garbage] [-f false_syncs] [-k bad_checksums]\n", name);
+    printf("\tWith no arguments, runs all of the built-in scenarios:\n");
+    for (size_t i = 0; i < sizeof(Scenarios) / sizeof(Scenarios[0]); i++) {
+        printf("\t\t%s\n", Scenarios[i].name);
+    }
+    printf("\t-c (--custom): Run one scenario described by the other options instead.\n");
+    printf("\t-g (--garbage): Garbage bytes between blocks, per payload byte.\n");
+    printf("\t-f (--false-syncs): False sync sequences planted in each payload.\n");
+    printf("\t-k (--bad-checksums): Fraction of blocks (0-1) with a bad checksum.\n");
+}
+
+int main(int argc, char ** argv)
+{
+    struct scenario custom = { "custom", 1000, 256, 4096, 0.5, 0, 0.0 };
+    int use_custom = 0;
+
+    for (;;) {
+        static struct option long_options[] = {
+            {"custom", no_argument, 0, 'c'},
+            {"blocks", required_argument, 0, 'b'},
+            {"min-size", required_argument, 0, 's'},
+            {"max-size", required_argument, 0, 'S'},
+            {"garbage", required_argument, 0, 'g'},
+            {"false-syncs", required_argument, 0, 'f'},
+            {"bad-checksums", required_argument, 0, 'k'},
+            {"help", no_argument, 0, 'h'},
+            {0, 0, 0, 0}
+        };
+        int option_index = 0;
+        int c = getopt_long(argc, argv, "cb:s:S:g:f:k:h", long_options, &option_index);
+        if (c == -1) break;
+        switch (c) {
+            case 'c': use_custom = 1; break;
+            case 'b': custom.blocks = atoi(optarg); break;
+            case 's': custom.min_size = atoi(optarg); break;
+            case 'S': custom.max_size = atoi(optarg); break;
+            case 'g': custom.garbage_ratio = atof(optarg); break;
+            case 'f': custom.false_syncs = atoi(optarg); break;
+            case 'k': custom.bad_checksums = atof(optarg); break;
+            default:
+                print_usage(argv[0]);
+                return -1;
+        }
+    }
+
+    if (use_custom) {
+        if (custom.blocks < 1 || custom.min_size < 1 || custom.max_size > 0x10000 ||
+            custom.min_size > custom.max_size) {
+            printf("Block sizes must be 1-65536 bytes, and there must be some blocks.\n");
+            return -1;
+        }
+        run_scenario(&custom);
+        return 0;
+    }
+
+    int ran = 0;
+    for (size_t i = 0; i < sizeof(Scenarios) / sizeof(Scenarios[0]); i++) {
+        int wanted = (optind == argc);
+        for (int arg = optind; arg < argc; arg++) {
+            if (strcmp(argv[arg], Scenarios[i].name) == 0) {
+                wanted = 1;
+            }
+        }
+        if (wanted) {
+            run_scenario(&Scenarios[i]);
+            ran++;
+        }
+    }
+    if (ran == 0) {
+        print_usage(argv[0]);
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,406 @@
+//
+//  container.c
+//
+//  Copyright (c) Ben Zotto 2022
+//  See LICENSE for licensing information.
+//
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "container.h"
+
+#define CONTAINER_MAGIC         "S2BCONT1"
+#define CONTAINER_END_MAGIC     "S2BCEND1"
+#define CONTAINER_FOOTER_SIZE   32
+#define CONTAINER_ENTRY_SIZE    24
+
+// How much of a container is read at a time, looking back for its last table
+#define FOOTER_SEARCH_CHUNK     (1024 * 1024)
+
+static void put_le(uint8_t * bytes, uint64_t value, int size)
+{
+    for (int i = 0; i < size; i++) {
+        bytes[i] = (uint8_t)(value >> (8 * i));
+    }
+}
+
+static uint64_t get_le(const uint8_t * bytes, int size)
+{
+    uint64_t value = 0;
+    for (int i = size - 1; i >= 0; i--) {
+        value = (value << 8) | bytes[i];
+    }
+    return value;
+}
+
+static int write_at(int fd, const uint8_t * bytes, size_t size, uint64_t offset)
+{
+    while (size > 0) {
+        ssize_t count = pwrite(fd, bytes, size, (off_t)offset);
+        if (count < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return 0;
+        }
+        bytes += count;
+        size -= (size_t)count;
+        offset += (uint64_t)count;
+    }
+    return 1;
+}
+
+static int read_at(int fd, uint8_t * bytes, size_t size, uint64_t offset)
+{
+    while (size > 0) {
+        ssize_t count = pread(fd, bytes, size, (off_t)offset);
+        if (count < 0 && errno == EINTR) {
+            continue;
+        }
+        if (count <= 0) {
+            return 0;
+        }
+        bytes += count;
+        size -= (size_t)count;
+        offset += (uint64_t)count;
+    }
+    return 1;
+}
+
+// Adds a tape name as is. Returns 0 if out of memory.
+static int push_tape(struct container * container, const char * name, size_t length)
+{
+    if (container->tape_count == container->tape_capacity) {
+        size_t capacity = (container->tape_capacity ? container->tape_capacity * 2 : 64);
+        char ** grown = realloc(container->tapes, capacity * sizeof(char *));
+        if (grown == NULL) {
+            return 0;
+        }
+        container->tapes = grown;
+        container->tape_capacity = capacity;
+    }
+    char * copy = strndup(name, length);
+    if (copy == NULL) {
+        return 0;
+    }
+    container->tapes[container->tape_count++] = copy;
+    return 1;
+}
+
+static int push_entry(struct container * container, const struct container_entry * entry)
+{
+    if (container->entry_count == container->entry_capacity) {
+        size_t capacity = (container->entry_capacity ? container->entry_capacity * 2 : 256);
+        struct container_entry * grown = realloc(container->entries, capacity * sizeof(struct container_entry));
+        if (grown == NULL) {
+            return 0;
+        }
+        container->entries = grown;
+        container->entry_capacity = capacity;
+    }
+    container->entries[container->entry_count++] = *entry;
+    return 1;
+}
+
+// Whether there's a footer that fits at `at` (with its table before it).
+static int footer_at(int fd, uint64_t at, uint8_t bytes[CONTAINER_FOOTER_SIZE])
+{
+    if (!read_at(fd, bytes, CONTAINER_FOOTER_SIZE, at) || memcmp(&bytes[24], CONTAINER_END_MAGIC, 8) != 0) {
+        return 0;
+    }
+    uint64_t table_offset = get_le(&bytes[0], 8);
+    uint32_t entry_count = (uint32_t)get_le(&bytes[12], 4);
+    uint64_t entries_offset = get_le(&bytes[16], 8);
+    return (table_offset >= sizeof(CONTAINER_MAGIC) - 1 && table_offset <= entries_offset && entries_offset <= at &&
+            at - entries_offset == (uint64_t)entry_count * CONTAINER_ENTRY_SIZE);
+}
+
+// Looks back from the end for the last footer there's a whole table before,
+// for a container with payloads added after its last table. Returns where it
+// is, or 0 if there's none.
+static uint64_t find_footer(int fd, uint64_t size, uint8_t bytes[CONTAINER_FOOTER_SIZE])
+{
+    uint8_t * chunk = malloc(FOOTER_SEARCH_CHUNK);
+    if (chunk == NULL) {
+        return 0;
+    }
+    // Chunks overlap by all but a byte of the magic, so none is missed.
+    uint64_t end = size, found = 0;
+    while (found == 0 && end >= sizeof(CONTAINER_MAGIC) - 1 + CONTAINER_FOOTER_SIZE) {
+        uint64_t start = (end > FOOTER_SEARCH_CHUNK ? end - FOOTER_SEARCH_CHUNK : 0);
+        if (!read_at(fd, chunk, (size_t)(end - start), start)) {
+            break;
+        }
+        for (size_t i = (size_t)(end - start) - 8 + 1; found == 0 && i-- > 0; ) {
+            uint64_t at = start + i - 24;
+            if (memcmp(&chunk[i], CONTAINER_END_MAGIC, 8) == 0 && start + i >= 24 &&
+                at >= sizeof(CONTAINER_MAGIC) - 1 && footer_at(fd, at, bytes)) {
+                found = at;
+            }
+        }
+        if (start == 0) {
+            break;
+        }
+        end = start + 8 - 1;
+    }
+    free(chunk);
+    return found;
+}
+
+// Reads the table of an existing container. Returns 0 if it isn't one (or its
+// table is damaged).
+static int load_table(struct container * container, uint64_t size)
+{
+    uint8_t bytes[CONTAINER_FOOTER_SIZE];
+    if (size < sizeof(CONTAINER_MAGIC) - 1 + CONTAINER_FOOTER_SIZE ||
+        !read_at(container->fd, bytes, 8, 0) || memcmp(bytes, CONTAINER_MAGIC, 8) != 0) {
+        return 0;
+    }
+    uint64_t table_end = size - CONTAINER_FOOTER_SIZE;
+    if (!footer_at(container->fd, table_end, bytes) &&
+        (table_end = find_footer(container->fd, size, bytes)) == 0) {
+        return 0;
+    }
+    uint64_t table_offset = get_le(&bytes[0], 8);
+    uint32_t tape_count = (uint32_t)get_le(&bytes[8], 4);
+    uint32_t entry_count = (uint32_t)get_le(&bytes[12], 4);
+    uint64_t entries_offset = get_le(&bytes[16], 8);
+
+    size_t table_size = (size_t)(table_end - table_offset);
+    uint8_t * table = malloc(table_size ? table_size : 1);
+    if (table == NULL || !read_at(container->fd, table, table_size, table_offset)) {
+        free(table);
+        return 0;
+    }
+    int ok = 1;
+    size_t at = 0, names_size = (size_t)(entries_offset - table_offset);
+    for (uint32_t i = 0; ok && i < tape_count; i++) {
+        if (at + 2 > names_size) {
+            ok = 0;
+            break;
+        }
+        size_t length = (size_t)get_le(&table[at], 2);
+        ok = (length <= names_size - at - 2 && push_tape(container, (const char *)&table[at + 2], length));
+        at += 2 + length;
+    }
+    for (uint32_t i = 0; ok && i < entry_count; i++) {
+        const uint8_t * bytes = &table[names_size + (size_t)i * CONTAINER_ENTRY_SIZE];
+        struct container_entry entry;
+        entry.offset = get_le(&bytes[0], 8);
+        entry.length = (uint32_t)get_le(&bytes[8], 4);
+        entry.tape = (uint32_t)get_le(&bytes[12], 4);
+        entry.block = (uint32_t)get_le(&bytes[16], 4);
+        entry.block_name[0] = (char)bytes[20];
+        entry.block_name[1] = (char)bytes[21];
+        entry.type = bytes[22];
+        entry.error = bytes[23];
+        // Its payload has to be among those before the table.
+        ok = (entry.tape < tape_count &&
+              (entry.offset == CONTAINER_NO_PAYLOAD ||
+               (entry.offset >= sizeof(CONTAINER_MAGIC) - 1 && entry.offset <= table_offset &&
+                entry.length <= table_offset - entry.offset)) &&
+              push_entry(container, &entry));
+    }
+    free(table);
+    // New payloads go after the old table, which is left as it is.
+    container->end = size;
+    return ok;
+}
+
+int container_open(struct container * container, const char * file_name)
+{
+    memset(container, 0, sizeof(struct container));
+    container->fd = open(file_name, O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+    if (container->fd < 0) {
+        return 0;
+    }
+    struct stat st;
+    int ok = (fstat(container->fd, &st) == 0);
+    if (ok && st.st_size == 0) {
+        ok = write_at(container->fd, (const uint8_t *)CONTAINER_MAGIC, 8, 0);
+        container->end = 8;
+    } else if (ok) {
+        ok = load_table(container, (uint64_t)st.st_size);
+    }
+    if (!ok) {
+        close(container->fd);
+        for (size_t i = 0; i < container->tape_count; i++) {
+            free(container->tapes[i]);
+        }
+        free(container->tapes);
+        free(container->entries);
+        return 0;
+    }
+    pthread_mutex_init(&container->lock, NULL);
+    pthread_cond_init(&container->written, NULL);
+    return 1;
+}
+
+uint32_t container_add_tape(struct container * container, const char * name)
+{
+    size_t length = strlen(name);
+    if (length > UINT16_MAX || container->tape_count >= UINT32_MAX - 1) {
+        return UINT32_MAX;
+    }
+    pthread_mutex_lock(&container->lock);
+    uint32_t tape = (uint32_t)container->tape_count;
+    if (!push_tape(container, name, length)) {
+        tape = UINT32_MAX;
+    }
+    pthread_mutex_unlock(&container->lock);
+    return tape;
+}
+
+int container_add_block(struct container * container,
+                        uint32_t tape,
+                        uint32_t block,
+                        const char block_name[2],
+                        const uint8_t * data,
+                        uint32_t length,
+                        uint8_t type,
+                        uint8_t error)
+{
+    struct container_entry entry;
+    entry.offset = CONTAINER_NO_PAYLOAD;
+    entry.length = length;
+    entry.tape = tape;
+    entry.block = block;
+    entry.block_name[0] = block_name[0];
+    entry.block_name[1] = block_name[1];
+    entry.type = type;
+    entry.error = error;
+
+    // Room is made for the payload while the lock is held; it's written after.
+    pthread_mutex_lock(&container->lock);
+    if (data != NULL) {
+        entry.offset = container->end;
+        container->end += length;
+    }
+    size_t index = container->entry_count;
+    int ok = push_entry(container, &entry);
+    if (!ok) {
+        container->failed = 1;
+    } else if (data != NULL) {
+        container->writing++;
+    }
+    pthread_mutex_unlock(&container->lock);
+
+    if (ok && data != NULL) {
+        int written = write_at(container->fd, data, length, entry.offset);
+        pthread_mutex_lock(&container->lock);
+        if (!written) {
+            // Still listed, but as having no payload.
+            container->entries[index].offset = CONTAINER_NO_PAYLOAD;
+            container->failed = 1;
+            ok = 0;
+        }
+        if (--container->writing == 0) {
+            pthread_cond_broadcast(&container->written);
+        }
+        pthread_mutex_unlock(&container->lock);
+    }
+    return ok;
+}
+
+static int compare_entries(const void * a, const void * b)
+{
+    const struct container_entry * x = a, * y = b;
+    if (x->tape != y->tape) {
+        return (x->tape < y->tape ? -1 : 1);
+    }
+    if (x->block != y->block) {
+        return (x->block < y->block ? -1 : 1);
+    }
+    return 0;
+}
+
+// Writes the table of everything so far at the end of the payloads, setting
+// `size` to its size. (Called with the lock held, and no payloads being
+// written.) Returns 0 on failure.
+static int write_table(struct container * container, size_t * size)
+{
+    int ok = (container->entry_count <= UINT32_MAX);
+    qsort(container->entries, container->entry_count, sizeof(struct container_entry), compare_entries);
+
+    size_t names_size = 0;
+    for (size_t i = 0; i < container->tape_count; i++) {
+        names_size += 2 + strlen(container->tapes[i]);
+    }
+    size_t table_size = names_size + container->entry_count * CONTAINER_ENTRY_SIZE + CONTAINER_FOOTER_SIZE;
+    uint8_t * table = (ok ? malloc(table_size) : NULL);
+    if (table != NULL) {
+        size_t at = 0;
+        for (size_t i = 0; i < container->tape_count; i++) {
+            size_t length = strlen(container->tapes[i]);
+            put_le(&table[at], length, 2);
+            memcpy(&table[at + 2], container->tapes[i], length);
+            at += 2 + length;
+        }
+        for (size_t i = 0; i < container->entry_count; i++) {
+            const struct container_entry * entry = &container->entries[i];
+            uint8_t * bytes = &table[at];
+            put_le(&bytes[0], entry->offset, 8);
+            put_le(&bytes[8], entry->length, 4);
+            put_le(&bytes[12], entry->tape, 4);
+            put_le(&bytes[16], entry->block, 4);
+            bytes[20] = (uint8_t)entry->block_name[0];
+            bytes[21] = (uint8_t)entry->block_name[1];
+            bytes[22] = entry->type;
+            bytes[23] = entry->error;
+            at += CONTAINER_ENTRY_SIZE;
+        }
+        uint8_t * footer = &table[at];
+        put_le(&footer[0], container->end, 8);
+        put_le(&footer[8], container->tape_count, 4);
+        put_le(&footer[12], container->entry_count, 4);
+        put_le(&footer[16], container->end + names_size, 8);
+        memcpy(&footer[24], CONTAINER_END_MAGIC, 8);
+        ok = write_at(container->fd, table, table_size, container->end);
+    } else {
+        ok = 0;
+    }
+    free(table);
+    *size = table_size;
+    return ok;
+}
+
+int container_commit(struct container * container)
+{
+    pthread_mutex_lock(&container->lock);
+    while (container->writing > 0) {
+        pthread_cond_wait(&container->written, &container->lock);
+    }
+    size_t size;
+    int ok = write_table(container, &size);
+    if (ok) {
+        // Payloads from now on go after it, as they would after an old table.
+        container->end += size;
+    }
+    ok = ok && !container->failed;
+    pthread_mutex_unlock(&container->lock);
+    return ok;
+}
+
+int container_close(struct container * container)
+{
+    // The table is written even after a failure, so that the container can
+    // still be read.
+    size_t size;
+    int ok = write_table(container, &size) && !container->failed;
+    if (close(container->fd) != 0) {
+        ok = 0;
+    }
+
+    for (size_t i = 0; i < container->tape_count; i++) {
+        free(container->tapes[i]);
+    }
+    free(container->tapes);
+    free(container->entries);
+    pthread_cond_destroy(&container->written);
+    pthread_mutex_destroy(&container->lock);
+    return ok;
+}
@@ -0,0 +1,93 @@
+//
+//  container.h
+//
+//  Copyright (c) Ben Zotto 2022
+//  See LICENSE for licensing information.
+//
+//  Container files: the blocks of any number of tapes in a single file, instead
+//  of a file per block. Payloads are appended as they're found, and a table of
+//  them is written at the end, so that a reader can map the file and go
+//  straight to any block. A container is only ever appended to: adding more
+//  tapes to one writes their payloads after its old table, and then a new
+//  table of everything; the last table is the one that counts.
+//
+//  All numbers are little endian:
+//     - Magic "S2BCONT1", at the start of the file
+//     - Payloads
+//     - The table: for each tape, its name's length (2 bytes) and name; then
+//       the entries, sorted by tape and block number: payload offset (8; all
+//       ones if there's no payload), length (4), tape (4), block number (4,
+//       from 1), name (2), type (1; 0 text, 1 object), error (1; see
+//       enum spherecas_error)
+//     - The footer, the file's last 32 bytes: table offset (8), tape count
+//       (4), entry count (4), offset of the entries (8), magic "S2BCEND1"
+//
+//  A container that's still being added to (or whose writer was stopped short)
+//  can have payloads after its last table. Then the last footer with a whole
+//  table in front of it counts, and the payloads after it are ignored.
+//
+
+#ifndef CONTAINER_H
+#define CONTAINER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#define CONTAINER_NO_PAYLOAD    UINT64_MAX
+
+struct container_entry {
+    uint64_t        offset;
+    uint32_t        length;
+    uint32_t        tape;
+    uint32_t        block;
+    char            block_name[2];
+    uint8_t         type;
+    uint8_t         error;
+};
+
+struct container {
+    int             fd;
+    pthread_mutex_t lock;
+    uint64_t        end;            // Where the next payload goes
+    char **         tapes;
+    size_t          tape_count;
+    size_t          tape_capacity;
+    struct container_entry * entries;
+    size_t          entry_count;
+    size_t          entry_capacity;
+    int             failed;         // Something couldn't be written (or kept)
+    size_t          writing;        // Payloads being written right now
+    pthread_cond_t  written;        // ...signalled when that's none
+};
+
+// Opens a container to add to, creating it if there's no such file. Returns 0
+// on failure, which includes a file that isn't a container.
+int container_open(struct container * container, const char * file_name);
+
+// Adds a tape, by name, and returns its number. Returns UINT32_MAX on failure.
+uint32_t container_add_tape(struct container * container, const char * name);
+
+// Appends a block of a tape (`data` may be NULL if the block has none). May be
+// called from any number of threads. Returns 0 on failure.
+int container_add_block(struct container * container,
+                        uint32_t tape,
+                        uint32_t block,
+                        const char block_name[2],
+                        const uint8_t * data,
+                        uint32_t length,
+                        uint8_t type,
+                        uint8_t error);
+
+// Writes a table of everything added so far, so that the container can be read
+// as it is before it's closed; anything added later goes after it. Waits for
+// payloads being written to be done, and may be called from any thread. (Each
+// call adds a whole table to the file, so it's one to make now and then, not
+// after every block.) Returns 0 on failure.
+int container_commit(struct container * container);
+
+// Writes the table and closes the container. Returns 0 if it, or anything
+// added to it, couldn't be written.
+int container_close(struct container * container);
+
+#endif
@@ -0,0 +1,195 @@
+//
+//  decompress.c
+//
+//  Copyright (c) Ben Zotto 2022
+//  See LICENSE for licensing information.
+//
+
+#include <stdlib.h>
+#include <string.h>
+#include "decompress.h"
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+enum compression detect_compression(const uint8_t * bytes, size_t size)
+{
+    if (size >= 2 && bytes[0] == 0x1F && bytes[1] == 0x8B) {
+        return COMPRESSION_GZIP;
+    }
+    if (size >= 4 && bytes[0] == 0x28 && bytes[1] == 0xB5 && bytes[2] == 0x2F && bytes[3] == 0xFD) {
+        return COMPRESSION_ZSTD;
+    }
+    return COMPRESSION_NONE;
+}
+
+const char * compression_name(enum compression kind)
+{
+    if (kind == COMPRESSION_GZIP) {
+        return "gzip";
+    } else if (kind == COMPRESSION_ZSTD) {
+        return "zstd";
+    }
+    return "uncompressed";
+}
+
+int compression_supported(enum compression kind)
+{
+#ifdef HAVE_ZLIB
+    if (kind == COMPRESSION_GZIP) {
+        return 1;
+    }
+#endif
+#ifdef HAVE_ZSTD
+    if (kind == COMPRESSION_ZSTD) {
+        return 1;
+    }
+#endif
+    return (kind == COMPRESSION_NONE);
+}
+
+int decompressor_begin(struct decompressor * decompressor, enum compression kind)
+{
+    decompressor->kind = kind;
+    decompressor->stream = NULL;
+    decompressor->complete = 0;
+#ifdef HAVE_ZLIB
+    if (kind == COMPRESSION_GZIP) {
+        z_stream * stream = calloc(1, sizeof(z_stream));
+        // (15 + 16: a gzip wrapper, with a window of any size.)
+        if (stream == NULL || inflateInit2(stream, 15 + 16) != Z_OK) {
+            free(stream);
+            return 0;
+        }
+        decompressor->stream = stream;
+        return 1;
+    }
+#endif
+#ifdef HAVE_ZSTD
+    if (kind == COMPRESSION_ZSTD) {
+        decompressor->stream = ZSTD_createDStream();
+        return (decompressor->stream != NULL);
+    }
+#endif
+    return 0;
+}
+
+void decompressor_end(struct decompressor * decompressor)
+{
+#ifdef HAVE_ZLIB
+    if (decompressor->kind == COMPRESSION_GZIP && decompressor->stream != NULL) {
+        inflateEnd(decompressor->stream);
+        free(decompressor->stream);
+    }
+#endif
+#ifdef HAVE_ZSTD
+    if (decompressor->kind == COMPRESSION_ZSTD && decompressor->stream != NULL) {
+        ZSTD_freeDStream(decompressor->stream);
+    }
+#endif
+    decompressor->stream = NULL;
+}
+
+#ifdef HAVE_ZLIB
+static enum decompress_result run_gzip(struct decompressor * decompressor,
+                                       const uint8_t ** input,
+                                       size_t * input_size,
+                                       uint8_t * output,
+                                       size_t output_size,
+                                       size_t * produced)
+{
+    z_stream * stream = decompressor->stream;
+    *produced = 0;
+    // (Output can still be pending even with no input left.)
+    for (;;) {
+        if (decompressor->complete) {
+            if (*input_size == 0) {
+                break;
+            }
+            // Files of several gzip members join up as one.
+            if (inflateReset(stream) != Z_OK) {
+                return DECOMPRESS_BAD_DATA;
+            }
+            decompressor->complete = 0;
+        }
+        // (zlib's counts are only unsigned ints.)
+        uInt in = (*input_size > UINT32_MAX ? UINT32_MAX : (uInt)*input_size);
+        uInt out = (output_size > UINT32_MAX ? UINT32_MAX : (uInt)output_size);
+        stream->next_in = (Bytef *)*input;
+        stream->avail_in = in;
+        stream->next_out = output;
+        stream->avail_out = out;
+        int result = inflate(stream, Z_NO_FLUSH);
+        *input += in - stream->avail_in;
+        *input_size -= in - stream->avail_in;
+        *produced = out - stream->avail_out;
+        if (result == Z_STREAM_END) {
+            decompressor->complete = 1;
+        } else if (result == Z_MEM_ERROR) {
+            return DECOMPRESS_NO_MEMORY;
+        } else if (result != Z_OK && result != Z_BUF_ERROR) {
+            return DECOMPRESS_BAD_DATA;
+        }
+        if (*produced > 0 || result == Z_BUF_ERROR || (*input_size == 0 && !decompressor->complete)) {
+            break;
+        }
+    }
+    return DECOMPRESS_OK;
+}
+#endif
+
+#ifdef HAVE_ZSTD
+static enum decompress_result run_zstd(struct decompressor * decompressor,
+                                       const uint8_t ** input,
+                                       size_t * input_size,
+                                       uint8_t * output,
+                                       size_t output_size,
+                                       size_t * produced)
+{
+    ZSTD_inBuffer in = { *input, *input_size, 0 };
+    ZSTD_outBuffer out = { output, output_size, 0 };
+    // Output may still be pending even with no input left.
+    do {
+        size_t result = ZSTD_decompressStream(decompressor->stream, &out, &in);
+        if (ZSTD_isError(result)) {
+            return (ZSTD_getErrorCode(result) == ZSTD_error_memory_allocation ?
+                    DECOMPRESS_NO_MEMORY : DECOMPRESS_BAD_DATA);
+        }
+        // (Zero means a frame has been decoded and flushed in full.)
+        decompressor->complete = (result == 0);
+    } while (out.pos == 0 && in.pos < in.size);
+    *input += in.pos;
+    *input_size -= in.pos;
+    *produced = out.pos;
+    return DECOMPRESS_OK;
+}
+#endif
+
+enum decompress_result decompressor_run(struct decompressor * decompressor,
+                                        const uint8_t ** input,
+                                        size_t * input_size,
+                                        uint8_t * output,
+                                        size_t output_size,
+                                        size_t * produced)
+{
+    *produced = 0;
+#ifdef HAVE_ZLIB
+    if (decompressor->kind == COMPRESSION_GZIP) {
+        return run_gzip(decompressor, input, input_size, output, output_size, produced);
+    }
+#endif
+#ifdef HAVE_ZSTD
+    if (decompressor->kind == COMPRESSION_ZSTD) {
+        return run_zstd(decompressor, input, input_size, output, output_size, produced);
+    }
+#endif
+    (void)decompressor;
+    (void)input;
+    (void)input_size;
+    (void)output;
+    (void)output_size;
+    return DECOMPRESS_BAD_DATA;
+}
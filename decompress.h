@@ -0,0 +1,63 @@
+//
+//  decompress.h
+//
+//  Copyright (c) Ben Zotto 2022
+//  See LICENSE for licensing information.
+//
+//  Streaming decompression of compressed inputs, which are recognized by their
+//  magic bytes. Formats are only supported if built with their libraries:
+//     - gzip (and zlib): -DHAVE_ZLIB, linking with -lz
+//     - zstd: -DHAVE_ZSTD, linking with -lzstd
+//  Either way, a compressed input is recognized, so that it can at least be
+//  turned down with a clear message.
+//
+
+#ifndef DECOMPRESS_H
+#define DECOMPRESS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Enough of the start of an input to tell whether it's compressed
+#define COMPRESSION_MAGIC_SIZE  4
+
+enum compression {
+    COMPRESSION_NONE,
+    COMPRESSION_GZIP,
+    COMPRESSION_ZSTD
+};
+
+enum decompress_result {
+    DECOMPRESS_OK,
+    DECOMPRESS_BAD_DATA,
+    DECOMPRESS_NO_MEMORY
+};
+
+struct decompressor {
+    enum compression kind;
+    void *          stream;         // The library's own state
+    int             complete;       // At the end of a stream (though another may follow)
+};
+
+enum compression detect_compression(const uint8_t * bytes, size_t size);
+const char * compression_name(enum compression kind);
+
+// Whether this build can decompress the kind.
+int compression_supported(enum compression kind);
+
+// Returns 0 on failure.
+int decompressor_begin(struct decompressor * decompressor, enum compression kind);
+void decompressor_end(struct decompressor * decompressor);
+
+// Decompresses from `*input` (advancing it past whatever was used) into
+// `output`, setting `*produced`. Produces nothing only if it needs more input.
+// At the end of the input, `complete` says whether it all made sense; if not,
+// it was cut short.
+enum decompress_result decompressor_run(struct decompressor * decompressor,
+                                        const uint8_t ** input,
+                                        size_t * input_size,
+                                        uint8_t * output,
+                                        size_t output_size,
+                                        size_t * produced);
+
+#endif
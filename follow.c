@@ -0,0 +1,193 @@
+//
+//  follow.c
+//
+//  Copyright (c) Ben Zotto 2022
+//  See LICENSE for licensing information.
+//
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include "follow.h"
+
+// How much of the file is read at once
+#define FOLLOW_CHUNK_SIZE   0x10000
+
+static int load_checkpoint(const struct follow_reader * reader,
+                           const char * file_name,
+                           const struct stat * st,
+                           struct spherecas_state * state);
+static int save_checkpoint(const struct follow_reader * reader,
+                           const char * file_name,
+                           const struct stat * st,
+                           const struct spherecas_state * state);
+
+int follow_read(const struct follow_reader * reader, struct spherecas_stats * stats, uint64_t * bytes_read)
+{
+    memset(stats, 0, sizeof(struct spherecas_stats));
+    *bytes_read = 0;
+    const struct stat * st = &reader->st;
+    size_t name_size = strlen(reader->file_name) + sizeof(".checkpoint");
+    char * checkpoint_file = malloc(name_size);
+    uint8_t * chunk = malloc(FOLLOW_CHUNK_SIZE);
+    if (checkpoint_file == NULL || chunk == NULL) {
+        fprintf(reader->out, "Unable to allocate work buffer\n");
+        free(checkpoint_file);
+        free(chunk);
+        return 0;
+    }
+    snprintf(checkpoint_file, name_size, "%s.checkpoint", reader->file_name);
+
+    struct spherecas_state read_state;
+    reader->begin(reader->context, &read_state);
+    uint64_t offset = 0;
+    if (load_checkpoint(reader, checkpoint_file, st, &read_state)) {
+        offset = read_state.stream_offset;
+        fprintf(reader->out, "(Picking up from %s, at byte %llu)\n", checkpoint_file, (unsigned long long)offset);
+    }
+
+    int ok = 1;
+    int saved = 1;
+    int reported = *reader->blocks_counted;
+    while (!*reader->stopped && reader->more_wanted(reader->context)) {
+        ssize_t count = pread(reader->fd, chunk, FOLLOW_CHUNK_SIZE, (off_t)offset);
+        if (count < 0 && errno == EINTR) {
+            continue;
+        }
+        if (count < 0) {
+            fprintf(reader->out, "Error reading %s\n", reader->file_name);
+            ok = 0;
+            break;
+        }
+        if (count == 0) {
+            // Caught up. Save progress while waiting for more.
+            if (!saved) {
+                saved = save_checkpoint(reader, checkpoint_file, st, &read_state);
+            }
+            struct stat now_st;
+            if (fstat(reader->fd, &now_st) == 0 && (uint64_t)now_st.st_size < offset) {
+                fprintf(reader->out, "%s got shorter; stopping\n", reader->file_name);
+                ok = 0;
+                break;
+            }
+            struct timespec pause = { 0, FOLLOW_POLL_NS };
+            nanosleep(&pause, NULL);
+            continue;
+        }
+        offset += spherecas_read_bytes(&read_state, chunk, (size_t)count);
+        saved = 0;
+        if (*reader->blocks_counted != reported) {
+            // Blocks are out as soon as their checksums are in.
+            reported = *reader->blocks_counted;
+            fflush(reader->out);
+            saved = save_checkpoint(reader, checkpoint_file, st, &read_state);
+        }
+    }
+    if (!saved && !save_checkpoint(reader, checkpoint_file, st, &read_state)) {
+        fprintf(reader->out, "Unable to save %s\n", checkpoint_file);
+    }
+
+    *bytes_read = read_state.stream_offset;
+    spherecas_get_stats(&read_state, stats);
+    spherecas_end_read(&read_state);
+    free(chunk);
+    free(checkpoint_file);
+    return ok;
+}
+
+// Restores a checkpoint, if there's one for this file; returns 0 if not (with
+// the parser set up afresh).
+static int load_checkpoint(const struct follow_reader * reader,
+                           const char * file_name,
+                           const struct stat * st,
+                           struct spherecas_state * state)
+{
+    FILE * file = fopen(file_name, "rb");
+    if (file == NULL) {
+        return 0;
+    }
+    uint8_t header[36];
+    uint8_t * checkpoint = NULL;
+    int ok = (fread(header, 1, sizeof(header), file) == sizeof(header) && memcmp(header, FOLLOW_MAGIC, 8) == 0);
+    uint64_t fields[5] = { 0 };
+    static const int sizes[5] = { 8, 8, 4, 4, 4 };
+    for (int i = 0, at = 8; ok && i < 5; at += sizes[i], i++) {
+        for (int b = sizes[i] - 1; b >= 0; b--) {
+            fields[i] = (fields[i] << 8) | header[at + b];
+        }
+    }
+    if (!ok || fields[0] != (uint64_t)st->st_dev || fields[1] != (uint64_t)st->st_ino ||
+        fields[4] > SPHERECAS_CHECKPOINT_SIZE(0x10000)) {
+        if (ok) {
+            fprintf(reader->out, "(%s is for some other file; starting from the beginning)\n", file_name);
+        }
+        fclose(file);
+        return 0;
+    }
+    size_t size = (size_t)fields[4];
+    checkpoint = malloc(size ? size : 1);
+    ok = (checkpoint != NULL && fread(checkpoint, 1, size, file) == size &&
+          spherecas_restore_checkpoint(state, checkpoint, size));
+    fclose(file);
+    free(checkpoint);
+    if (ok && state->stream_offset > (uint64_t)st->st_size) {
+        // The file's been cut back (or replaced, in place) since.
+        ok = 0;
+    }
+    if (!ok) {
+        fprintf(reader->out, "(%s can't be used; starting from the beginning)\n", file_name);
+        spherecas_end_read(state);
+        reader->begin(reader->context, state);
+        return 0;
+    }
+    *reader->blocks_counted = (int)fields[2];
+    *reader->blocks_reported = (int)fields[3];
+    return 1;
+}
+
+// Saves a checkpoint, with every block reported so far written out first.
+// Returns 0 on failure.
+static int save_checkpoint(const struct follow_reader * reader,
+                           const char * file_name,
+                           const struct stat * st,
+                           const struct spherecas_state * state)
+{
+    reader->flush(reader->context);
+    size_t size = spherecas_checkpoint_size(state);
+    uint8_t * bytes = malloc(36 + size);
+    if (bytes == NULL) {
+        return 0;
+    }
+    memcpy(bytes, FOLLOW_MAGIC, 8);
+    uint64_t fields[5] = { (uint64_t)st->st_dev, (uint64_t)st->st_ino,
+                           (uint64_t)*reader->blocks_counted, (uint64_t)*reader->blocks_reported, size };
+    static const int sizes[5] = { 8, 8, 4, 4, 4 };
+    for (int i = 0, at = 8; i < 5; at += sizes[i], i++) {
+        for (int b = 0; b < sizes[i]; b++) {
+            bytes[at + b] = (uint8_t)(fields[i] >> (8 * b));
+        }
+    }
+    spherecas_save_checkpoint(state, &bytes[36], size);
+
+    // Written to the side and renamed into place, like a sidecar.
+    size_t temp_size = strlen(file_name) + 8;
+    char * temp_name = malloc(temp_size);
+    int ok = (temp_name != NULL);
+    if (ok) {
+        snprintf(temp_name, temp_size, "%s.tmp", file_name);
+        FILE * file = fopen(temp_name, "wb");
+        ok = (file != NULL && fwrite(bytes, 1, 36 + size, file) == 36 + size);
+        if (file != NULL && fclose(file) != 0) {
+            ok = 0;
+        }
+        ok = ok && (rename(temp_name, file_name) == 0);
+        if (!ok) {
+            remove(temp_name);
+        }
+    }
+    free(temp_name);
+    free(bytes);
+    return ok;
+}
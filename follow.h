@@ -0,0 +1,56 @@
+//
+//  follow.h
+//
+//  Copyright (c) Ben Zotto 2022
+//  See LICENSE for licensing information.
+//
+//  Following a tape file that's still being written (--follow): reading what's
+//  there, then whatever is added to it, so that each block is reported as soon
+//  as it's complete. The parser's progress is saved in a checkpoint file next
+//  to the tape (<tape>.checkpoint), once the blocks found so far have been
+//  written out, so that a later run picks up from there instead of reading the
+//  whole file again. A checkpoint file is the parser's checkpoint, tagged with
+//  which file it's for (device and inode, little endian) and how many blocks
+//  had been seen:
+//     - Magic "S2BFOLW1"
+//     - Device (8), inode (8), blocks counted (4), blocks reported (4),
+//       checkpoint size (4), the checkpoint
+//
+
+#ifndef FOLLOW_H
+#define FOLLOW_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include "spherecas.h"
+
+// How often a followed tape file is checked for more, when it isn't growing.
+#define FOLLOW_POLL_NS      250000000
+#define FOLLOW_MAGIC        "S2BFOLW1"
+
+struct follow_reader {
+    const char *    file_name;      // The tape file (a regular one),
+    int             fd;             // ...open for reading,
+    struct stat     st;             // ...as it was to begin with
+    FILE *          out;            // Messages go here
+    volatile sig_atomic_t * stopped; // Set (by a signal handler) to stop
+    // Sets up a parser, whose callback reports the blocks.
+    void            (*begin)(void * context, struct spherecas_state * state);
+    // Whether there are more blocks to read for (not every one asked for is in yet).
+    int             (*more_wanted)(void * context);
+    // Writes out every block reported so far, before a checkpoint is saved.
+    void            (*flush)(void * context);
+    void *          context;
+    int *           blocks_counted; // Kept up by the callback, and in the checkpoint
+    int *           blocks_reported;
+};
+
+// Follows a tape file until `*stopped` is set or no more blocks are wanted, or
+// the file gets shorter. Sets `stats` to the parser's counters and `bytes_read`
+// to how far it got (both 0 if it couldn't start). Prints a message, and
+// returns 0, on failure.
+int follow_read(const struct follow_reader * reader, struct spherecas_stats * stats, uint64_t * bytes_read);
+
+#endif
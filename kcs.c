@@ -0,0 +1,365 @@
+//
+//  kcs.c
+//
+//  Copyright (c) Ben Zotto 2022
+//  See LICENSE for licensing information.
+//
+
+#include <string.h>
+#include "kcs.h"
+
+#define ONE_SAMPLE      ((uint64_t)1 << KCS_TIME_FRACTION_BITS)
+
+static uint16_t get_le16(const uint8_t * bytes)
+{
+    return (uint16_t)(bytes[0] | (bytes[1] << 8));
+}
+
+static uint32_t get_le32(const uint8_t * bytes)
+{
+    return ((uint32_t)bytes[0] | ((uint32_t)bytes[1] << 8) |
+            ((uint32_t)bytes[2] << 16) | ((uint32_t)bytes[3] << 24));
+}
+
+// Demodulator
+
+void kcs_demod_begin(struct kcs_demod * demod, uint32_t sample_rate, kcs_run_callback callback, void * context)
+{
+    memset(demod, 0, sizeof(struct kcs_demod));
+    uint64_t rate = (uint64_t)sample_rate << KCS_TIME_FRACTION_BITS;
+    uint64_t mark_half = rate / (2 * KCS_MARK_HZ);
+    uint64_t space_half = rate / (2 * KCS_SPACE_HZ);
+    demod->min_half = mark_half / 3;
+    demod->split_half = (mark_half + space_half) / 2;
+    demod->max_half = space_half * 2;
+    demod->positive = 1;
+    demod->run_level = 1;
+    demod->callback = callback;
+    demod->context = context;
+}
+
+// Called with each zero crossing (at sample `index` of the block, so between it
+// and the sample before). Measures the half cycle that it ends, and reports a
+// tone run when the tone changes.
+static void demod_crossing(struct kcs_demod * demod, const int16_t * samples, size_t index)
+{
+    int before = (index > 0 ? samples[index - 1] : demod->previous);
+    int after = samples[index];
+    int positive = (after >= 0);
+    if (positive == demod->positive) {
+        return;     // Back across after a crossing that was ignored
+    }
+
+    // Times here are a sample late (sample 0 is at 1), which saves a special
+    // case for a crossing before the very first sample.
+    uint64_t time = ((demod->sample_count + index) << KCS_TIME_FRACTION_BITS) +
+                    (uint64_t)((before * (int)ONE_SAMPLE) / (before - after));
+    uint64_t half = time - demod->last_crossing;
+    if (half < demod->min_half) {
+        return;
+    }
+
+    int level = (half < demod->split_half || half > demod->max_half);
+    if (level != demod->run_level) {
+        if (demod->last_crossing > demod->run_start) {
+            demod->callback(demod->context, demod->run_level, demod->last_crossing - demod->run_start);
+        }
+        demod->run_level = level;
+        demod->run_start = demod->last_crossing;
+    }
+    demod->positive = positive;
+    demod->last_crossing = time;
+}
+
+void kcs_demod_samples(struct kcs_demod * demod, const int16_t * restrict samples, size_t count)
+{
+    if (count == 0) {
+        return;
+    }
+
+    // First mark every sign change, with no branches, so that the compiler can
+    // vectorize it. (The top bit of the XOR of two samples is set if their signs
+    // differ.) The tail is padded out to a whole word.
+    uint8_t * restrict crossings = demod->crossings;
+    crossings[0] = (uint8_t)((uint16_t)(demod->previous ^ samples[0]) >> 15);
+    for (size_t i = 1; i < count; i++) {
+        crossings[i] = (uint8_t)((uint16_t)(samples[i - 1] ^ samples[i]) >> 15);
+    }
+    size_t padded = (count + 7) & ~(size_t)7;
+    memset(&crossings[count], 0, padded - count);
+
+    // Crossings are a handful per hundred samples, so most words have none.
+    for (size_t i = 0; i < padded; i += 8) {
+        uint64_t word;
+        memcpy(&word, &crossings[i], sizeof(word));
+        if (word == 0) {
+            continue;
+        }
+        for (size_t j = i; j < i + 8; j++) {
+            if (crossings[j]) {
+                demod_crossing(demod, samples, j);
+            }
+        }
+    }
+
+    demod->previous = samples[count - 1];
+    demod->sample_count += count;
+}
+
+void kcs_demod_end(struct kcs_demod * demod)
+{
+    // Whatever follows the last crossing isn't a tone; treat it as idle.
+    uint64_t end = (demod->sample_count + 1) << KCS_TIME_FRACTION_BITS;
+    if (demod->run_level != 1 && demod->last_crossing > demod->run_start) {
+        demod->callback(demod->context, demod->run_level, demod->last_crossing - demod->run_start);
+        demod->run_level = 1;
+        demod->run_start = demod->last_crossing;
+    }
+    if (end > demod->run_start) {
+        demod->callback(demod->context, demod->run_level, end - demod->run_start);
+    }
+    demod->run_start = end;
+}
+
+// Framer
+
+void kcs_framer_begin(struct kcs_framer * framer, uint32_t sample_rate, kcs_byte_callback callback, void * context)
+{
+    memset(framer, 0, sizeof(struct kcs_framer));
+    framer->bit_time = ((uint64_t)sample_rate << KCS_TIME_FRACTION_BITS) / KCS_BAUD_RATE;
+    framer->callback = callback;
+    framer->context = context;
+}
+
+void kcs_framer_run(struct kcs_framer * framer, int level, uint64_t duration)
+{
+    uint64_t end = framer->time + duration;
+
+    // A frame starts on the edge of a start bit (only).
+    if (!framer->in_frame && level == 0) {
+        framer->in_frame = 1;
+        framer->bit_index = 0;
+        framer->shift = 0;
+        framer->next_sample = framer->time + framer->bit_time / 2;
+    }
+
+    while (framer->in_frame && framer->next_sample < end) {
+        if (framer->bit_index == 0) {
+            if (level != 0) {
+                framer->in_frame = 0;       // Too short for a start bit
+                break;
+            }
+        } else if (framer->bit_index <= 8) {
+            framer->shift |= (unsigned)level << (framer->bit_index - 1);
+        } else {
+            // The first stop bit. (The second is just idle time before the
+            // next start bit.)
+            if (level) {
+                framer->bytes++;
+                framer->callback(framer->context, (uint8_t)framer->shift);
+            } else {
+                framer->framing_errors++;
+            }
+            framer->in_frame = 0;
+            break;
+        }
+        framer->bit_index++;
+        framer->next_sample += framer->bit_time;
+    }
+    framer->time = end;
+}
+
+// WAV decoder
+
+enum kcs_wav_result kcs_parse_wav_header(const uint8_t * bytes,
+                                         size_t size,
+                                         struct kcs_format * format,
+                                         size_t * data_offset,
+                                         uint32_t * data_size)
+{
+    if (memcmp(bytes, "RIFF", size < 4 ? size : 4) != 0 ||
+        (size >= 12 && memcmp(&bytes[8], "WAVE", 4) != 0)) {
+        return KCS_WAV_NOT_WAV;
+    }
+
+    int have_format = 0;
+    size_t offset = 12;
+    while (offset + 8 <= size) {
+        const uint8_t * chunk = &bytes[offset];
+        uint32_t chunk_size = get_le32(&chunk[4]);
+        if (memcmp(chunk, "fmt ", 4) == 0) {
+            if (chunk_size < 16) {
+                return KCS_WAV_UNSUPPORTED;
+            }
+            if (offset + 8 + chunk_size > size) {
+                break;
+            }
+            uint16_t tag = get_le16(&chunk[8]);
+            if (tag == 0xFFFE && chunk_size >= 40) {
+                tag = get_le16(&chunk[32]);     // WAVE_FORMAT_EXTENSIBLE's subformat
+            }
+            format->channels = get_le16(&chunk[10]);
+            format->sample_rate = get_le32(&chunk[12]);
+            format->frame_size = get_le16(&chunk[20]);
+            format->bits_per_sample = get_le16(&chunk[22]);
+            if (tag != 1 ||
+                (format->channels != 1 && format->channels != 2) ||
+                (format->bits_per_sample != 8 && format->bits_per_sample != 16) ||
+                format->frame_size != format->channels * format->bits_per_sample / 8u ||
+                format->sample_rate < 4 * KCS_MARK_HZ) {
+                return KCS_WAV_UNSUPPORTED;
+            }
+            have_format = 1;
+        } else if (memcmp(chunk, "data", 4) == 0) {
+            if (!have_format) {
+                return KCS_WAV_UNSUPPORTED;
+            }
+            *data_offset = offset + 8;
+            *data_size = chunk_size;
+            return KCS_WAV_OK;
+        }
+        offset += 8 + (size_t)chunk_size + (chunk_size & 1);
+    }
+    return KCS_WAV_NEED_MORE;
+}
+
+void kcs_convert_samples(const struct kcs_format * format,
+                         const uint8_t * restrict pcm,
+                         int16_t * restrict samples,
+                         size_t count)
+{
+    // One loop per format, each simple enough to vectorize.
+    if (format->bits_per_sample == 16 && format->channels == 1) {
+        for (size_t i = 0; i < count; i++) {
+            samples[i] = (int16_t)get_le16(&pcm[2 * i]);
+        }
+    } else if (format->bits_per_sample == 16) {
+        for (size_t i = 0; i < count; i++) {
+            int left = (int16_t)get_le16(&pcm[4 * i]);
+            int right = (int16_t)get_le16(&pcm[4 * i + 2]);
+            samples[i] = (int16_t)((left + right) >> 1);
+        }
+    } else if (format->channels == 1) {
+        for (size_t i = 0; i < count; i++) {
+            samples[i] = (int16_t)((pcm[i] - 128) * 256);
+        }
+    } else {
+        for (size_t i = 0; i < count; i++) {
+            samples[i] = (int16_t)((pcm[2 * i] + pcm[2 * i + 1] - 256) * 128);
+        }
+    }
+}
+
+static void framer_run(void * context, int level, uint64_t duration)
+{
+    kcs_framer_run(context, level, duration);
+}
+
+void kcs_begin_decode(struct kcs_decoder * decoder, kcs_byte_callback callback, void * context)
+{
+    memset(decoder, 0, sizeof(struct kcs_decoder));
+    decoder->header_result = KCS_WAV_NEED_MORE;
+    // The rest is set up once the sample rate is known.
+    decoder->framer.callback = callback;
+    decoder->framer.context = context;
+}
+
+void kcs_begin_decode_runs(struct kcs_decoder * decoder, kcs_run_callback callback, void * context)
+{
+    kcs_begin_decode(decoder, NULL, NULL);
+    decoder->run_callback = callback;
+    decoder->run_context = context;
+}
+
+// Runs sample data through the demodulator, a block of samples at a time,
+// keeping hold of any sample that's split across calls.
+static void decode_pcm(struct kcs_decoder * decoder, const uint8_t * pcm, size_t size)
+{
+    size_t frame_size = decoder->format.frame_size;
+    if (decoder->position + size > decoder->data_end) {
+        size = (decoder->position < decoder->data_end ? (size_t)(decoder->data_end - decoder->position) : 0);
+    }
+    decoder->position += size;
+
+    if (decoder->partial_size > 0) {
+        size_t count = frame_size - decoder->partial_size;
+        if (count > size) {
+            count = size;
+        }
+        memcpy(&decoder->partial[decoder->partial_size], pcm, count);
+        decoder->partial_size += count;
+        pcm += count;
+        size -= count;
+        if (decoder->partial_size < frame_size) {
+            return;
+        }
+        kcs_convert_samples(&decoder->format, decoder->partial, decoder->samples, 1);
+        kcs_demod_samples(&decoder->demod, decoder->samples, 1);
+        decoder->partial_size = 0;
+    }
+
+    size_t frames = size / frame_size;
+    while (frames > 0) {
+        size_t count = (frames < KCS_SAMPLE_BLOCK ? frames : KCS_SAMPLE_BLOCK);
+        kcs_convert_samples(&decoder->format, pcm, decoder->samples, count);
+        kcs_demod_samples(&decoder->demod, decoder->samples, count);
+        pcm += count * frame_size;
+        size -= count * frame_size;
+        frames -= count;
+    }
+    memcpy(decoder->partial, pcm, size);
+    decoder->partial_size = size;
+}
+
+enum kcs_wav_result kcs_decode_bytes(struct kcs_decoder * decoder, const uint8_t * bytes, size_t size)
+{
+    if (decoder->header_result == KCS_WAV_OK) {
+        decode_pcm(decoder, bytes, size);
+        return KCS_WAV_OK;
+    }
+    if (decoder->header_result != KCS_WAV_NEED_MORE) {
+        return decoder->header_result;
+    }
+
+    // Collect the start of the file until the header can be read.
+    size_t copied = sizeof(decoder->header) - decoder->header_size;
+    if (copied > size) {
+        copied = size;
+    }
+    memcpy(&decoder->header[decoder->header_size], bytes, copied);
+    decoder->header_size += copied;
+
+    uint32_t data_size;
+    decoder->header_result = kcs_parse_wav_header(decoder->header, decoder->header_size,
+                                                  &decoder->format, &decoder->data_offset, &data_size);
+    if (decoder->header_result == KCS_WAV_NEED_MORE && decoder->header_size == sizeof(decoder->header)) {
+        decoder->header_result = KCS_WAV_UNSUPPORTED;
+    }
+    if (decoder->header_result != KCS_WAV_OK) {
+        return decoder->header_result;
+    }
+
+    if (decoder->run_callback != NULL) {
+        kcs_demod_begin(&decoder->demod, decoder->format.sample_rate, decoder->run_callback, decoder->run_context);
+    } else {
+        kcs_demod_begin(&decoder->demod, decoder->format.sample_rate, framer_run, &decoder->framer);
+        kcs_framer_begin(&decoder->framer, decoder->format.sample_rate,
+                         decoder->framer.callback, decoder->framer.context);
+    }
+    decoder->data_end = (uint64_t)decoder->data_offset + data_size;
+
+    // Whatever came after the header so far is sample data.
+    decoder->position = decoder->data_offset;
+    if (decoder->data_offset < decoder->header_size) {
+        decode_pcm(decoder, &decoder->header[decoder->data_offset], decoder->header_size - decoder->data_offset);
+    }
+    decode_pcm(decoder, &bytes[copied], size - copied);
+    return KCS_WAV_OK;
+}
+
+void kcs_end_decode(struct kcs_decoder * decoder)
+{
+    if (decoder->header_result == KCS_WAV_OK) {
+        kcs_demod_end(&decoder->demod);
+    }
+}
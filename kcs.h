@@ -0,0 +1,148 @@
+//
+//  kcs.h
+//
+//  Copyright (c) Ben Zotto 2022
+//  See LICENSE for licensing information.
+//
+//  This module demodulates Kansas City Standard cassette audio (the 300bps
+//  physical format that Sphere tapes use) into the raw byte stream that the
+//  spherecas library parses, straight from PCM samples, without an intermediate
+//  byte file.
+//
+//  Format details:
+//
+//  Each bit is 1/300 second of tone: four cycles of 1200 Hz for a 0, or eight
+//  cycles of 2400 Hz for a 1. The line idles at 1 (the 2400 Hz "mark" tone).
+//  Bytes are framed as for a serial line: one start bit (0), eight data bits,
+//  least significant first, and two stop bits (1).
+//
+//  Decoding is in two stages, which can be used separately:
+//     - The demodulator finds zero crossings in the signal and measures the time
+//       between them, classifying each half cycle as 1200 or 2400 Hz. It reports
+//       "tone runs": how long the signal stayed on one tone.
+//     - The framer times the tone runs into bits and the bits into bytes, the way
+//       a UART would (sampling each bit in the middle).
+//  Times are kept in samples with KCS_TIME_FRACTION_BITS of fraction, as the
+//  zero crossings are interpolated between samples.
+//
+//  The decoder ties the two together behind a WAV file reader: set it up with
+//  kcs_begin_decode, pass it the file's bytes (in whatever chunks are handy) with
+//  kcs_decode_bytes, then call kcs_end_decode. Your byte callback is invoked for
+//  every byte decoded. (Or, set it up with kcs_begin_decode_runs to get the tone
+//  runs instead, to frame elsewhere, e.g. on another thread.)
+//
+
+#ifndef KCS_H
+#define KCS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define KCS_BAUD_RATE               300
+#define KCS_SPACE_HZ                1200        // Tone for a 0 bit
+#define KCS_MARK_HZ                 2400        // Tone for a 1 bit
+#define KCS_TIME_FRACTION_BITS      8
+
+// Samples are converted and searched for zero crossings this many at a time.
+#define KCS_SAMPLE_BLOCK            1024
+
+// Audio format, as read from a WAV header. Only integer PCM is supported, 8-bit
+// (unsigned) or 16-bit (signed), mono or stereo (which is mixed down to mono).
+struct kcs_format {
+    uint32_t        sample_rate;
+    uint16_t        channels;
+    uint16_t        bits_per_sample;
+    uint32_t        frame_size;             // Bytes per sample, all channels
+};
+
+// Demodulator
+
+typedef void (*kcs_run_callback)(void * context, int level, uint64_t duration);
+
+struct kcs_demod {
+    uint64_t        min_half;               // Crossings sooner than this are noise
+    uint64_t        split_half;             // Half cycles shorter than this are mark tone
+    uint64_t        max_half;               // ...and longer than this, no tone at all
+    uint64_t        sample_count;           // Samples seen so far
+    uint64_t        last_crossing;          // Time of the last accepted zero crossing
+    uint64_t        run_start;              // Time the current tone run started
+    int16_t         previous;               // Last sample of the previous block
+    int             positive;               // Side of zero since the last accepted crossing
+    int             run_level;
+    kcs_run_callback callback;
+    void *          context;
+    uint8_t         crossings[KCS_SAMPLE_BLOCK];
+};
+
+void kcs_demod_begin(struct kcs_demod * demod, uint32_t sample_rate, kcs_run_callback callback, void * context);
+// At most KCS_SAMPLE_BLOCK samples at a time.
+void kcs_demod_samples(struct kcs_demod * demod, const int16_t * samples, size_t count);
+// Reports the tone run in progress.
+void kcs_demod_end(struct kcs_demod * demod);
+
+// Framer
+
+typedef void (*kcs_byte_callback)(void * context, uint8_t byte);
+
+struct kcs_framer {
+    uint64_t        bit_time;
+    uint64_t        time;                   // Time at the start of the next tone run
+    uint64_t        next_sample;            // Time to sample the next bit of a frame
+    int             in_frame;
+    int             bit_index;              // 0 is the start bit
+    unsigned        shift;
+    size_t          bytes;                  // Bytes framed
+    size_t          framing_errors;         // Frames without a stop bit (dropped)
+    kcs_byte_callback callback;
+    void *          context;
+};
+
+void kcs_framer_begin(struct kcs_framer * framer, uint32_t sample_rate, kcs_byte_callback callback, void * context);
+void kcs_framer_run(struct kcs_framer * framer, int level, uint64_t duration);
+
+// WAV decoder
+
+enum kcs_wav_result {
+    KCS_WAV_OK,
+    KCS_WAV_NEED_MORE,                  // The header isn't all there yet
+    KCS_WAV_NOT_WAV,
+    KCS_WAV_UNSUPPORTED                 // A WAV file, but not a format we can decode
+};
+
+// Reads a WAV header from the start of a file. On success, sets the format and
+// the offset and length of the sample data (the length may be 0xFFFFFFFF, or
+// otherwise larger than the file, for a stream whose length wasn't known).
+enum kcs_wav_result kcs_parse_wav_header(const uint8_t * bytes,
+                                         size_t size,
+                                         struct kcs_format * format,
+                                         size_t * data_offset,
+                                         uint32_t * data_size);
+
+struct kcs_decoder {
+    struct kcs_format format;
+    enum kcs_wav_result header_result;
+    size_t          position;               // Offset in the file of the next byte
+    size_t          data_offset;
+    uint64_t        data_end;
+    uint8_t         header[4096];           // A header that comes in pieces is collected here
+    size_t          header_size;
+    uint8_t         partial[4];             // ...as is a sample split between chunks
+    size_t          partial_size;
+    struct kcs_demod demod;
+    struct kcs_framer framer;
+    kcs_run_callback run_callback;          // Set if runs are wanted instead of bytes
+    void *          run_context;
+    int16_t         samples[KCS_SAMPLE_BLOCK];
+};
+
+void kcs_begin_decode(struct kcs_decoder * decoder, kcs_byte_callback callback, void * context);
+void kcs_begin_decode_runs(struct kcs_decoder * decoder, kcs_run_callback callback, void * context);
+// Returns KCS_WAV_NEED_MORE until the header has been read, KCS_WAV_OK after, or
+// the error if the header is no good (in which case nothing more is decoded).
+enum kcs_wav_result kcs_decode_bytes(struct kcs_decoder * decoder, const uint8_t * bytes, size_t size);
+void kcs_end_decode(struct kcs_decoder * decoder);
+
+// Converts `count` sample frames of PCM to 16-bit mono.
+void kcs_convert_samples(const struct kcs_format * format, const uint8_t * pcm, int16_t * samples, size_t count);
+
+#endif
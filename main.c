@@ -26,30 +26,406 @@
 //   expected to provide the load address (and request the block by name).
 //
 //   This utility will accept a raw Sphere cassette dump (ie, after conversion
-//   from an audio signal) and emit its consitutent blocks as individual binary
-//   files.
+//   from an audio signal), or a WAV recording of the tape itself, and emit its
+//   consitutent blocks as individual binary files.
 //
 //  Copyright (c) Ben Zotto 2022.
 //  See LICENSE for licensing information.
 //
 
+#ifdef __linux__
+#define _GNU_SOURCE     // For pthread_setaffinity_np
+#endif
+
 #include <stdio.h>
 #include <getopt.h>
 #include <string.h>
 #include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "spherecas.h"
+#include "kcs.h"
+#include "ring.h"
+#include "sidecar.h"
+#include "store.h"
+#include "writer.h"
+#include "container.h"
+#include "decompress.h"
+#include "serial.h"
+#include "follow.h"
+#include "vote.h"
+#include "repair.h"
+#include "spool.h"
+
+// Inputs that can't be mapped are streamed through a buffer of this size.
+#define STREAM_CHUNK_SIZE   0x10000
+
+// Bytes demodulated from audio are passed on to the parser in batches this big.
+#define AUDIO_BATCH_SIZE    4096
+
+// A repair is made (--repair) only if it's at least this likely, i.e. more
+// likely than all of the other corrections that fit the checksum together.
+#define REPAIR_MIN_CONFIDENCE   0.5
+
+// The largest payload a block can have (a 16-bit length, plus one).
+#define MAX_PAYLOAD_SIZE    0x10000
+
+// Capacities of the rings between pipeline stages, and how many tone runs or
+// bytes a stage collects before passing them on.
+#define PIPE_RAW_ITEMS      (16 * STREAM_CHUNK_SIZE)
+#define PIPE_RUN_ITEMS      0x4000
+#define PIPE_BYTE_ITEMS     0x10000
+#define PIPE_BLOCK_ITEMS    16
+#define PIPE_BATCH          256
+
+// An open input: either mapped in whole (`bytes` is set) or to be streamed
+// from `fd` (pipes, devices, standard input, and anything compressed).
+struct input_data {
+    int             fd;
+    const uint8_t * bytes;
+    size_t          size;
+    uint64_t        bytes_read;     // How much of it has been read so far
+    int             regular_file;   // If so, the sidecar key:
+    struct sidecar_key key;
+    uint8_t         peek[COMPRESSION_MAGIC_SIZE];   // Read from a stream to check for compression
+    size_t          peek_size;
+    struct decompressor * decompressor;             // Set if it's compressed
+    uint8_t *       packed;         // Compressed bytes, as read
+    const uint8_t * packed_next;    // ...the next of them to decompress
+    size_t          packed_left;
+    int             packed_eof;
+};
+
+// A run of block names asked for, e.g. B0-B3 (a single name is a run of one).
+// Names count up as 16-bit values, first character high, as SYS-2 did.
+struct name_range {
+    uint16_t        first;
+    uint16_t        last;
+};
+
+// Settings that apply to every input.
+struct run_options {
+    int             list_only;
+    int             scan_threads;   // Index mapped inputs in parallel with this many threads
+    int             show_shadowed;  // Also report intact blocks that a serial read can't see
+    int             recover;        // Don't let bad headers hide later blocks
+    int             audio;          // Inputs are WAV recordings, to be demodulated
+    int             pipeline;       // Run each stage of reading on its own thread
+    int             pin_threads;    // ...each on its own CPU
+    int             show_stats;
+    int             save_index;     // Write a sidecar of the blocks found
+    int             ignore_index;   // ...and don't read one
+    int             follow;         // Keep reading the input as it grows
+    int             serial;         // The input is a serial device, read from live
+    long            baud;           // ...at this speed (0: as it's set already)
+    int             vote;           // The inputs are captures of one tape, to be voted on:
+    char **         captures;
+    size_t          capture_count;
+    int             repair;         // Try to repair blocks that fail their checksums
+    size_t          repair_budget;  // ...trying this many positions at most
+    int             classify;       // List what each block seems to hold
+    int             watch;          // The inputs are spool directories, to be watched (a daemon)
+    struct block_store * store;     // Put payloads in this store instead of files of their own
+    struct container * container;   // ...or in this container
+    struct block_writer * writer;   // ...or have them written to files by this
+    struct name_range * wanted;     // Only these blocks (all blocks if none)
+    size_t          wanted_count;
+    size_t          wanted_names;   // Total names in all of the ranges
+};
+
+// One input tape, and everything its read callback needs.
+struct tape_job {
+    const char *    input_file_name;
+    const struct run_options * options;
+    char *          filename_base;
+    int             block_index;    // Counts every block, reported or not
+    int             blocks_reported;
+    uint8_t *       wanted_found;   // Per wanted name: received intact yet?
+    size_t          wanted_left;
+    FILE *          out;            // Listing goes here (stdout, or a buffer in batch mode)
+    char *          out_text;
+    size_t          out_size;
+    int             ok;
+    int             done;
+    int             have_stats;     // Set once the parser's counters are in `stats`
+    struct spherecas_stats stats;
+    size_t          framing_errors; // Audio bytes dropped by the framer
+    int             recording;      // Collecting blocks for a sidecar:
+    struct sidecar_entry * entries;
+    size_t          entry_count;
+    size_t          entry_capacity;
+    int             entries_failed; // (ran out of memory)
+    FILE *          stored;         // The tape's list of what's where in the store
+    uint32_t        container_tape; // The tape's number in the container
+    struct warm_state * warm;       // A daemon worker's parser and buffers, to use
+    uint64_t        bytes_read;     // How much of the input was read,
+    double          seconds;        // ...and how long it took
+};
+
+// A daemon worker's parser and buffers, reused for every tape it reads, so none
+// of them is set up again each time. The payload buffer is big enough for any
+// block, so the parser never has to allocate one.
+struct warm_state {
+    struct spherecas_state state;
+    uint8_t         payload[MAX_PAYLOAD_SIZE];
+    uint8_t         chunk[STREAM_CHUNK_SIZE];   // For a streamed input
+};
+
+// The inputs of a batch, handed out to worker threads in order.
+struct job_queue {
+    struct tape_job * jobs;
+    size_t          count;
+    size_t          next;
+    pthread_mutex_t lock;
+    pthread_cond_t  finished;
+};
+
+// One thread's share of a parallel index scan.
+struct scan_range {
+    const uint8_t * data;
+    size_t          size;
+    size_t          begin;
+    size_t          end;
+    struct spherecas_candidate * found;
+    size_t          count;
+    size_t          capacity;
+    int             failed;
+};
+
+// Where bytes demodulated from audio are collected for the parser.
+struct audio_sink {
+    struct spherecas_state * state;
+    uint8_t         bytes[AUDIO_BATCH_SIZE];
+    size_t          count;
+    int             stopped;        // The parser wants nothing more
+};
+
+// A tape being read by a pipeline of threads (--pipeline), one per stage, joined
+// by rings. For audio, the stages are read -> demodulate -> frame -> parse ->
+// output, and for tape bytes just read -> parse -> output. Output is done on
+// the job's own thread.
+struct pipeline {
+    struct tape_job * job;
+    struct input_data * input;
+    struct ring     raw;            // Input bytes, for the demodulator (audio only)
+    struct ring     runs;           // Tone runs, for the framer (audio only)
+    struct ring     bytes;          // Tape bytes, for the parser
+    struct ring     blocks;         // Blocks found, for output
+    atomic_int      cancel;         // Set to wind every stage up early
+    uint32_t        sample_rate;    // Set by the demodulator before its first run
+    int             read_failed;
+    int             out_of_memory;
+    enum kcs_wav_result wav_result;
+    struct spherecas_stats stats;   // The parser's, when it's done
+    size_t          framing_errors;
+};
+
+struct tone_run {
+    uint64_t        duration;
+    int             level;
+};
 
-// Global information accessed by the read callback function.
-static int ListOnly = 0;
-static int CurrentBlockIndex = 0;
-static char * FilenameBase = NULL;
+// A block found by the parse stage. The output stage owns `data` from then on.
+// Skipped blocks are sent along too, so that the block count stays right.
+struct block_message {
+    char            block_name[2];
+    int             skipped;
+    uint8_t *       data;
+    uint64_t        offset;
+    int             length;
+    enum spherecas_blocktype type;
+    enum spherecas_error error;
+    uint8_t         checksum;       // As on the tape
+    enum spherecas_content content; // (With --classify)
+};
 
-// Fwd declaration
+// Tone runs or bytes collected by a stage, to be passed on in one go.
+struct run_batch {
+    struct pipeline * pipe;
+    const struct kcs_decoder * decoder;
+    size_t          count;
+    struct tone_run runs[PIPE_BATCH];
+};
+
+struct byte_batch {
+    struct pipeline * pipe;
+    size_t          count;
+    uint8_t         bytes[PIPE_BATCH];
+};
+
+// Set by an interrupt (SIGINT or SIGTERM), to stop reading (--follow, --serial)
+// or watching (--watch).
+static volatile sig_atomic_t reading_stopped;
+
+// Fwd declarations
+static void process_tape(struct tape_job * job);
+static int scan_parallel(struct tape_job * job, const struct input_data * input);
+static void * scan_worker(void * arg);
+static void add_candidate(void * context, const struct spherecas_candidate * candidate);
+static void * batch_worker(void * arg);
+static int run_batch(struct tape_job * jobs, size_t count, int threads);
+static int run_inputs(struct run_options * options, char ** names, size_t count, int threads);
+static int watch_spool(struct run_options * options,
+                       char * const directories[],
+                       size_t count,
+                       int threads,
+                       const char * socket_path);
+static void spool_read(void * context, const char * path, void * warm, FILE * out, struct spool_tape * tape);
+static int spool_done(void * context, const char * path);
+static int read_manifest(const char * file_name, char *** names, size_t * count);
+static int parse_block_selection(const char * arg, struct run_options * options);
+static long wanted_slot(const struct run_options * options, const char block_name[]);
+static int block_filter(struct spherecas_state * state, const char block_name[], uint32_t length);
+static unsigned parser_options(const struct tape_job * job);
+static enum spherecas_content block_content(const struct spherecas_state * state);
+static const char * content_string(enum spherecas_content content);
+static int block_read(struct spherecas_state * state,
+                      char block_name[],
+                      uint8_t * data,
+                      int length,
+                      enum spherecas_blocktype type,
+                      enum spherecas_error error);
+static int report_block(struct tape_job * job,
+                        const char block_name[],
+                        const uint8_t * data,
+                        int length,
+                        enum spherecas_blocktype type,
+                        enum spherecas_content content,
+                        enum spherecas_error error,
+                        int shadowed);
+static int report_repairable(struct tape_job * job,
+                             const char block_name[],
+                             const uint8_t * data,
+                             uint64_t offset,
+                             int length,
+                             enum spherecas_blocktype type,
+                             enum spherecas_content content,
+                             enum spherecas_error error,
+                             int shadowed,
+                             uint8_t checksum);
+static uint8_t * repair_payload(struct tape_job * job,
+                                const char block_name[],
+                                const uint8_t * data,
+                                uint32_t length,
+                                uint8_t checksum,
+                                const uint8_t * const others[],
+                                size_t other_count,
+                                enum spherecas_blocktype * type);
+static void store_block(struct tape_job * job,
+                        const char block_name[],
+                        const uint8_t * data,
+                        int length,
+                        const char * type_str,
+                        const char * error_str);
+static void record_block(struct tape_job * job,
+                         const char block_name[],
+                         const uint8_t * data,
+                         uint64_t offset,
+                         int length,
+                         enum spherecas_blocktype type,
+                         enum spherecas_error error,
+                         int shadowed);
+static int replay_sidecar(struct tape_job * job,
+                          const struct input_data * input,
+                          const char * file_name,
+                          const struct sidecar_entry * entries,
+                          size_t count);
+static const char * error_string(enum spherecas_error error);
+static int open_input(const char * file_name, struct input_data * input, int device, FILE * out);
+static int parse_input(const char * file_name,
+                       struct input_data * input,
+                       struct spherecas_state * state,
+                       FILE * out,
+                       uint8_t * chunk);
+static int parse_audio(const char * file_name,
+                       struct input_data * input,
+                       struct spherecas_state * state,
+                       FILE * out,
+                       size_t * framing_errors);
+static void audio_byte(void * context, uint8_t byte);
+static void flush_audio(struct audio_sink * sink);
+static int check_audio_result(const char * file_name, enum kcs_wav_result result, FILE * out);
+static int run_pipeline(struct tape_job * job, struct input_data * input);
+static void * pipe_read(void * arg);
+static void * pipe_demod(void * arg);
+static void pipe_run(void * context, int level, uint64_t duration);
+static void flush_runs(struct run_batch * batch);
+static void * pipe_frame(void * arg);
+static void pipe_byte(void * context, uint8_t byte);
+static void flush_bytes(struct byte_batch * batch);
+static void * pipe_parse(void * arg);
+static int pipe_filter(struct spherecas_state * state, const char block_name[], uint32_t length);
+static int pipe_block(struct spherecas_state * state,
+                      char block_name[],
+                      uint8_t * data,
+                      int length,
+                      enum spherecas_blocktype type,
+                      enum spherecas_error error);
+static void pipe_output(struct pipeline * pipe);
+static void pin_thread(pthread_t thread, int index);
+static ssize_t read_input(struct input_data * input, uint8_t * buffer, size_t size);
+static int open_decompression(const char * file_name, struct input_data * input, FILE * out);
+static int follow_input(struct tape_job * job, struct input_data * input);
+static void follow_begin(void * context, struct spherecas_state * state);
+static int more_blocks_wanted(void * context);
+static void follow_flush(void * context);
+static void stop_reading(int signal_number);
+static int serial_input(struct tape_job * job, struct input_data * input);
+static int vote_input(struct tape_job * job, struct input_data * input);
+static ssize_t vote_read(void * context, uint8_t * buffer, size_t size);
+static int vote_wanted(void * context, const char block_name[2]);
+static int vote_report(struct tape_job * job, const struct vote_result * block);
+static void close_input(struct input_data * input);
+static void print_stats(const struct tape_job * job, const struct input_data * input, double seconds);
+static double now(void);
 static char * remove_path_extension(const char * str);
 
 void print_usage(const char * name) {
-    printf("usage: %s [-l] input_file\n", name);
+    printf("usage: %s [-l] [-j jobs] input_file ...\n", name);
+    printf("       %s [-l] [-j jobs] -m manifest_file\n", name);
+    printf("       %s [-l] --stdin\n", name);
+    printf("       %s --watch [--stats-socket socket] [-j jobs] {-l | --store dir | --container file} directory ...\n", name);
     printf("\t-l (--list): Only list the blocks found in input (ignores other options).\n");
+    printf("\t-  (--stdin): Read the input from standard input (also: an input_file of \"-\").\n");
+    printf("\t-m (--manifest): Read the input file names from manifest_file, one per line.\n");
+    printf("\t-j (--jobs): Number of inputs to process at once (default: one per CPU).\n");
+    printf("\t-p (--parallel): Scan each input file with this many threads.\n");
+    printf("\t   (--shadowed): Also report intact blocks hidden behind a bad header.\n");
+    printf("\t-r (--recover): Look for blocks again right after any bad header.\n");
+    printf("\t-b (--block): Only these blocks, e.g. MA or B0-B3 (may be a list, or repeated).\n");
+    printf("\t-w (--wav): Inputs are WAV recordings of tapes (8 or 16-bit PCM), not bytes.\n");
+    printf("\t   (--pipeline): Run each stage of reading a tape on a thread of its own.\n");
+    printf("\t   (--pin): The same, with each of those threads pinned to a CPU (Linux only).\n");
+    printf("\t   (--stats): Print the parser's counters and the time taken for each input.\n");
+    printf("\t   (--save-index): Save the blocks found to an index file (input_file.index),\n");
+    printf("\t                   which later runs use instead of scanning the input again.\n");
+    printf("\t   (--no-index): Don't use an index file, even if there's one.\n");
+    printf("\t   (--store): Keep each distinct block once, in this directory, named by its\n");
+    printf("\t              hash (listing what's where in input_file.stored).\n");
+    printf("\t   (--container): Add the blocks of every input to this one file, instead.\n");
+    printf("\t   (--follow): Keep reading a tape file as it's written, until interrupted; a\n");
+    printf("\t               later run picks up where it left off (input_file.checkpoint).\n");
+    printf("\t   (--serial): The input is a serial port, to be read from live until interrupted,\n");
+    printf("\t               reporting on each block as it comes in.\n");
+    printf("\t   (--baud): Set the serial port to this speed first.\n");
+    printf("\t   (--vote): The inputs are captures of one tape, read together; blocks that\n");
+    printf("\t             none of them has intact are rebuilt by majority vote.\n");
+    printf("\t   (--repair[=N]): Try to repair blocks that fail their checksums by correcting\n");
+    printf("\t                   one byte (trying at most N positions; default: all).\n");
+    printf("\t   (--classify): Also list what each block seems to hold: text, BASIC source,\n");
+    printf("\t                 object code or data.\n");
+    printf("\t   (--watch): Run as a daemon, reading each capture written (or moved) into the\n");
+    printf("\t              directories, with -j workers, until interrupted (Linux only).\n");
+    printf("\t   (--stats-socket): With --watch, send the daemon's counters to whatever\n");
+    printf("\t                     connects to this local socket.\n");
 }
 
 int main(int argc, char **argv) {
@@ -59,20 +435,151 @@ int main(int argc, char **argv) {
         return -1;
     }
 
-    const char * input_file_name = NULL;
+    struct run_options options = { 0 };
+    int use_stdin = 0;
+    const char * manifest_file_name = NULL;
+    int threads = 0;
+    const char * store_directory = NULL;
+    const char * container_file_name = NULL;
+    const char * stats_socket = NULL;
     
     // Parse command line options.
     for (;;) {
         static struct option long_options[] = {
             {"list", no_argument, 0, 'l'},
+            {"stdin", no_argument, 0, 's'},
+            {"manifest", required_argument, 0, 'm'},
+            {"jobs", required_argument, 0, 'j'},
+            {"parallel", required_argument, 0, 'p'},
+            {"shadowed", no_argument, 0, 'S'},
+            {"recover", no_argument, 0, 'r'},
+            {"block", required_argument, 0, 'b'},
+            {"wav", no_argument, 0, 'w'},
+            {"pipeline", no_argument, 0, 'P'},
+            {"pin", no_argument, 0, 'C'},
+            {"stats", no_argument, 0, 'T'},
+            {"save-index", no_argument, 0, 'I'},
+            {"no-index", no_argument, 0, 'N'},
+            {"store", required_argument, 0, 'O'},
+            {"container", required_argument, 0, 'K'},
+            {"follow", no_argument, 0, 'F'},
+            {"serial", no_argument, 0, 'D'},
+            {"baud", required_argument, 0, 'B'},
+            {"vote", no_argument, 0, 'V'},
+            {"repair", optional_argument, 0, 'R'},
+            {"classify", no_argument, 0, 'A'},
+            {"watch", no_argument, 0, 'W'},
+            {"stats-socket", required_argument, 0, 'U'},
             {0, 0, 0, 0}
         };
         int option_index = 0;
-        int c = getopt_long (argc, argv, "l", long_options, &option_index);
+        int c = getopt_long (argc, argv, "lm:j:p:rb:w", long_options, &option_index);
         if (c == -1) break;
         switch (c) {
             case 'l':
-                ListOnly = 1;
+                options.list_only = 1;
+                break;
+            case 's':
+                use_stdin = 1;
+                break;
+            case 'm':
+                manifest_file_name = optarg;
+                break;
+            case 'j':
+                threads = atoi(optarg);
+                if (threads < 1) {
+                    print_usage(argv[0]);
+                    return -1;
+                }
+                break;
+            case 'p':
+                options.scan_threads = atoi(optarg);
+                if (options.scan_threads < 1) {
+                    print_usage(argv[0]);
+                    return -1;
+                }
+                break;
+            case 'S':
+                options.show_shadowed = 1;
+                break;
+            case 'r':
+                options.recover = 1;
+                break;
+            case 'b':
+                if (!parse_block_selection(optarg, &options)) {
+                    print_usage(argv[0]);
+                    return -1;
+                }
+                break;
+            case 'w':
+                options.audio = 1;
+                break;
+            case 'P':
+                options.pipeline = 1;
+                break;
+            case 'T':
+                options.show_stats = 1;
+                break;
+            case 'I':
+                options.save_index = 1;
+                break;
+            case 'N':
+                options.ignore_index = 1;
+                break;
+            case 'O':
+                store_directory = optarg;
+                break;
+            case 'K':
+                container_file_name = optarg;
+                break;
+            case 'F':
+                options.follow = 1;
+                break;
+            case 'D':
+                options.serial = 1;
+                break;
+            case 'V':
+                options.vote = 1;
+                break;
+            case 'R':
+                options.repair = 1;
+                options.repair_budget = REPAIR_DEFAULT_BUDGET;
+                if (optarg != NULL) {
+                    char * end;
+                    options.repair_budget = strtoul(optarg, &end, 10);
+                    if (*optarg < '0' || *optarg > '9' || *end != '\0') {
+                        options.repair_budget = 0;
+                    }
+                }
+                if (options.repair_budget < 1) {
+                    print_usage(argv[0]);
+                    return -1;
+                }
+                break;
+            case 'A':
+                options.classify = 1;
+                break;
+            case 'W':
+                options.watch = 1;
+                break;
+            case 'U':
+                stats_socket = optarg;
+                break;
+            case 'B':
+                options.baud = atol(optarg);
+                if (!serial_speed_supported(options.baud)) {
+                    printf("Unsupported serial speed %s\n", optarg);
+                    return -1;
+                }
+                break;
+            case 'C':
+#ifdef __linux__
+                options.pipeline = 1;
+                options.pin_threads = 1;
+#else
+                printf("(Threads can't be pinned on this system; ignoring --pin)\n");
+                options.pipeline = 1;
+#endif
                 break;
             default:
             case '?':
@@ -81,98 +588,1997 @@ int main(int argc, char **argv) {
         }
     }
 
-    // Require exactly one input file name
-    if (optind != argc - 1) {
+    // Gather up the input file names: from the command line, from a manifest,
+    // or just the stdin option.
+    char ** names = NULL;
+    size_t count = 0;
+    if (use_stdin) {
+        if (optind != argc || manifest_file_name != NULL) {
+            print_usage(argv[0]);
+            return -1;
+        }
+        static char * stdin_name = "-";
+        names = &stdin_name;
+        count = 1;
+    } else if (manifest_file_name != NULL) {
+        if (optind != argc) {
+            print_usage(argv[0]);
+            return -1;
+        }
+        if (!read_manifest(manifest_file_name, &names, &count)) {
+            return -1;
+        }
+    } else {
+        if (optind == argc) {
+            print_usage(argv[0]);
+            return -1;
+        }
+        names = &argv[optind];
+        count = argc - optind;
+    }
+    
+    if (store_directory != NULL && container_file_name != NULL) {
+        print_usage(argv[0]);
+        return -1;
+    }
+    if (options.follow && (count != 1 || strcmp(names[0], "-") == 0 || options.audio || options.pipeline ||
+                           options.scan_threads > 1 || options.recover || options.show_shadowed ||
+                           options.save_index)) {
+        printf("--follow reads one tape file, serially (so not with -w, -p, -r, --shadowed,\n");
+        printf("--pipeline or --save-index)\n");
+        return -1;
+    }
+    if (options.baud != 0 && !options.serial) {
+        print_usage(argv[0]);
+        return -1;
+    }
+    if (options.serial && (count != 1 || strcmp(names[0], "-") == 0 || options.audio || options.pipeline ||
+                           options.scan_threads > 1 || options.recover || options.show_shadowed ||
+                           options.save_index || options.follow)) {
+        printf("--serial reads one serial device, serially (so not with -w, -p, -r, --shadowed,\n");
+        printf("--pipeline, --save-index or --follow)\n");
+        return -1;
+    }
+    if (options.vote && (count < 2 || count > VOTE_MAX_COPIES || options.audio || options.pipeline ||
+                         options.scan_threads > 1 || options.recover || options.show_shadowed ||
+                         options.save_index || options.follow || options.serial)) {
+        printf("--vote reads 2 to %d captures of a tape (not with -w, -p, -r, --shadowed,\n", VOTE_MAX_COPIES);
+        printf("--pipeline, --save-index, --follow or --serial)\n");
+        return -1;
+    }
+    if (options.vote) {
+        options.captures = names;
+        options.capture_count = count;
+    }
+    if (stats_socket != NULL && !options.watch) {
         print_usage(argv[0]);
         return -1;
     }
+    if (options.watch && (use_stdin || manifest_file_name != NULL || options.follow || options.serial || options.vote ||
+                          (store_directory == NULL && container_file_name == NULL && !options.list_only))) {
+        printf("--watch reads the captures in the directories given, to a store or container (or\n");
+        printf("just lists them); not with --stdin, -m, --follow, --serial or --vote\n");
+        return -1;
+    }
+    
+    // One store, or container, shared by every input (and every worker thread).
+    struct block_store store;
+    if (store_directory != NULL && !options.list_only) {
+        if (!store_open(&store, store_directory)) {
+            printf("Unable to open the block store %s\n", store_directory);
+            return -1;
+        }
+        options.store = &store;
+    }
+    struct container container;
+    if (container_file_name != NULL && !options.list_only) {
+        if (!container_open(&container, container_file_name)) {
+            printf("Unable to open the container %s\n", container_file_name);
+            return -1;
+        }
+        options.container = &container;
+    }
+    // Otherwise, each block goes to a file of its own, written in the background.
+    struct block_writer writer;
+    if (options.store == NULL && options.container == NULL && !options.list_only) {
+        if (!writer_start(&writer)) {
+            printf("Unable to start writing output files\n");
+            return -1;
+        }
+        options.writer = &writer;
+    }
     
-    input_file_name = argv[optind];
-    FilenameBase = remove_path_extension(input_file_name);
+    if (threads == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = (cpus > 0 ? (int)cpus : 1);
+    }
+    int ok;
+    if (options.watch) {
+        // A daemon: the inputs are directories, and it reads what turns up in them.
+        ok = watch_spool(&options, names, count, threads, stats_socket);
+    } else {
+        ok = run_inputs(&options, names, count, threads);
+    }
+    
+    if (options.writer != NULL) {
+        if (writer_finish(&writer) > 0) {
+            printf("\nUnable to write %zu output file(s):\n", writer.failure_count);
+            for (size_t i = 0; i < writer.failure_count; i++) {
+                const char * path = writer.failures[i].path;
+                printf("\t%s: %s\n", path ? path : "(unknown)", strerror(writer.failures[i].error));
+            }
+            ok = 0;
+        }
+        writer_destroy(&writer);
+    }
+    if (options.container != NULL) {
+        size_t blocks = container.entry_count, tapes = container.tape_count;
+        if (container_close(&container)) {
+            printf("\n(Container %s now holds %zu block(s) of %zu tape(s))\n", container_file_name, blocks, tapes);
+        } else {
+            printf("\nUnable to write the container %s\n", container_file_name);
+            ok = 0;
+        }
+    }
+    if (options.store != NULL) {
+        printf("\n(Block store %s: %zu block(s) added, %zu already there)\n",
+               store.directory, store.written, store.duplicates);
+        store_close(&store);
+    }
+    free(options.wanted);
+    if (manifest_file_name != NULL) {
+        for (size_t i = 0; i < count; i++) {
+            free(names[i]);
+        }
+        free(names);
+    }
+    return ok ? 0 : -1;
+}
+
+// Reads one tape and reports on it, to the job's output stream.
+static void process_tape(struct tape_job * job)
+{
+    if (strcmp(job->input_file_name, "-") == 0) {
+        job->filename_base = strdup("stdin");
+    } else if (job->options->serial) {
+        // Blocks from /dev/ttyUSB0 are named for ttyUSB0, here.
+        const char * slash = strrchr(job->input_file_name, '/');
+        job->filename_base = strdup(slash != NULL ? slash + 1 : job->input_file_name);
+    } else {
+        job->filename_base = remove_path_extension(job->input_file_name);
+    }
     
     // Open the input file.
-    FILE * file = fopen(input_file_name, "rb");
-    if (!file) {
-        printf("Unable to open %s\n", input_file_name);
-        return -1;
+    double start = now();
+    struct input_data input;
+    if (!open_input(job->input_file_name, &input, job->options->serial, job->out)) {
+        free(job->filename_base);
+        job->ok = 0;
+        return;
+    }
+    if (input.decompressor != NULL && strcmp(job->input_file_name, "-") != 0) {
+        // tape.raw.gz is named for tape, as tape.raw would be.
+        char * base = remove_path_extension(job->filename_base);
+        if (base != NULL) {
+            free(job->filename_base);
+            job->filename_base = base;
+        }
     }
     
-    if (fseek(file, 0 , SEEK_END) != 0) {
-        printf("Error reading %s\n", input_file_name);
-        return -1;
+    job->wanted_left = job->options->wanted_names;
+    if (job->wanted_left > 0 && (job->wanted_found = calloc(job->wanted_left, 1)) == NULL) {
+        fprintf(job->out, "Unable to allocate work buffer\n");
+        close_input(&input);
+        free(job->filename_base);
+        job->ok = 0;
+        return;
+    }
+        
+    if (job->options->store != NULL) {
+        size_t name_size = strlen(job->filename_base) + sizeof(".stored");
+        char * stored_name = malloc(name_size);
+        if (stored_name != NULL) {
+            snprintf(stored_name, name_size, "%s.stored", job->filename_base);
+            job->stored = fopen(stored_name, "w");
+        }
+        if (job->stored == NULL) {
+            fprintf(job->out, "Unable to open %s.stored for writing\n", job->filename_base);
+            free(stored_name);
+            close_input(&input);
+            free(job->wanted_found);
+            free(job->filename_base);
+            job->ok = 0;
+            return;
+        }
+        fprintf(job->stored, "# Blocks of %s in the store %s\n", job->input_file_name, job->options->store->directory);
+        fprintf(job->stored, "# BLOCK\tNAME\tLENGTH\tTYPE\tERROR\tFILE\n");
+        free(stored_name);
+    }
+    
+    fprintf(job->out, "\n%-10s%-10s%-10s%-10s%-10s%s\n", "BLOCK", "NAME", "LENGTH", "TYPE", "ERROR",
+            (job->options->classify ? "CONTENT" : ""));
+    fprintf(job->out, "-----     ----      ------    ----      -----%s\n", (job->options->classify ? "     -------" : ""));
+    
+    // A sidecar from an earlier run (of a tape file, in the same mode) says
+    // where all of the blocks are, so there's no need to scan at all. Saving
+    // one takes a complete read of a tape file.
+    char * sidecar_file = NULL;
+    int replayed = 0;
+    if (input.regular_file && !job->options->audio && !job->options->follow && !job->options->vote) {
+        input.key.mode = (job->options->recover ? 1 : 0) | (job->options->show_shadowed ? 2 : 0);
+        sidecar_file = sidecar_name(job->input_file_name);
+    }
+    if (sidecar_file != NULL && input.bytes != NULL && !job->options->ignore_index) {
+        struct sidecar_entry * entries;
+        size_t entry_count;
+        if (sidecar_read(sidecar_file, &input.key, &entries, &entry_count)) {
+            replayed = replay_sidecar(job, &input, sidecar_file, entries, entry_count);
+            free(entries);
+        }
+    }
+    if (job->options->save_index && !replayed) {
+        if (sidecar_file != NULL && job->options->wanted_count == 0) {
+            job->recording = 1;
+        } else {
+            fprintf(job->out, "(An index can only be saved for a whole tape file; not saving one)\n");
+        }
+    }
+    
+    // With the whole input mapped, it can be indexed (in parallel, if asked)
+    // instead of being run through in one go.
+    int use_index = (job->options->scan_threads > 1 || job->options->show_shadowed || job->options->recover);
+    if (!replayed && use_index && (input.bytes == NULL || job->options->audio)) {
+        fprintf(job->out, "(%s can't be indexed; reading it normally)\n", job->input_file_name);
+    }
+    if (replayed) {
+        job->ok = 1;
+    } else if (job->options->follow) {
+        job->ok = follow_input(job, &input);
+    } else if (job->options->serial) {
+        job->ok = serial_input(job, &input);
+    } else if (job->options->vote) {
+        job->ok = vote_input(job, &input);
+    } else if (use_index && input.bytes != NULL && !job->options->audio) {
+        job->ok = scan_parallel(job, &input);
+    } else if (job->options->pipeline) {
+        job->ok = run_pipeline(job, &input);
+    } else {
+        // Set up the input parsing state machine (a daemon worker's own, if
+        // it has one) and run the input through it.
+        struct spherecas_state own_state;
+        struct spherecas_state * read_state = (job->warm != NULL ? &job->warm->state : &own_state);
+        spherecas_begin_read_callback(read_state, block_read, job);
+        if (job->warm != NULL) {
+            spherecas_set_data_buffer(read_state, job->warm->payload, sizeof(job->warm->payload));
+        }
+        spherecas_set_options(read_state, parser_options(job));
+        if (job->options->wanted_count > 0) {
+            spherecas_set_filter(read_state, block_filter);
+        }
+        if (job->options->audio) {
+            job->ok = parse_audio(job->input_file_name, &input, read_state, job->out, &job->framing_errors);
+        } else {
+            job->ok = parse_input(job->input_file_name, &input, read_state, job->out,
+                                  (job->warm != NULL ? job->warm->chunk : NULL));
+        }
+        spherecas_get_stats(read_state, &job->stats);
+        job->have_stats = 1;
+        spherecas_end_read(read_state);
+    }
+    double seconds = now() - start;
+    job->bytes_read = (job->have_stats ? input.bytes_read : input.size);
+    job->seconds = seconds;
+    
+    if (job->recording && job->ok) {
+        if (!job->entries_failed &&
+            sidecar_write(sidecar_file, &input.key, job->entries, job->entry_count)) {
+            fprintf(job->out, "(Block index saved to %s)\n", sidecar_file);
+        } else {
+            fprintf(job->out, "Unable to save block index %s\n", sidecar_file);
+        }
+    }
+    free(job->entries);
+    free(sidecar_file);
+    
+    if (job->ok) {
+        fprintf(job->out, "\nDone. %d block(s) found.\n", job->blocks_reported);
+        if (job->options->wanted_count > 0 && job->wanted_left == 0) {
+            fprintf(job->out, "(Stopped after finding all of the requested blocks.)\n");
+        }
+        if (job->options->show_stats) {
+            print_stats(job, &input, seconds);
+        }
+    }
+    if (job->stored != NULL && fclose(job->stored) != 0) {
+        fprintf(job->out, "Unable to finish writing %s.stored\n", job->filename_base);
+        job->ok = 0;
+    }
+    close_input(&input);
+    free(job->wanted_found);
+    free(job->filename_base);
+}
+
+// Worker thread: takes the next tape in the batch until there are none left.
+// Each tape's listing is collected in memory so it can be printed in order.
+static void * batch_worker(void * arg)
+{
+    struct job_queue * queue = arg;
+    for (;;) {
+        pthread_mutex_lock(&queue->lock);
+        size_t index = queue->next;
+        if (index < queue->count) {
+            queue->next++;
+        }
+        pthread_mutex_unlock(&queue->lock);
+        if (index >= queue->count) {
+            return NULL;
+        }
+        
+        struct tape_job * job = &queue->jobs[index];
+        job->out = open_memstream(&job->out_text, &job->out_size);
+        if (job->out != NULL) {
+            fprintf(job->out, "\n%s:\n", job->input_file_name);
+            process_tape(job);
+            fclose(job->out);
+        }
+        
+        pthread_mutex_lock(&queue->lock);
+        job->done = 1;
+        pthread_cond_broadcast(&queue->finished);
+        pthread_mutex_unlock(&queue->lock);
     }
+}
 
-    long file_size = ftell(file);
+// Processes all of the tapes on a pool of worker threads, printing each one's
+// listing in the original order as soon as it (and all before it) are done.
+// Returns 0 if any of them failed.
+static int run_batch(struct tape_job * jobs, size_t count, int threads)
+{
+    struct job_queue queue;
+    queue.jobs = jobs;
+    queue.count = count;
+    queue.next = 0;
+    pthread_mutex_init(&queue.lock, NULL);
+    pthread_cond_init(&queue.finished, NULL);
+    
+    if ((size_t)threads > count) {
+        threads = (int)count;
+    }
+    pthread_t * workers = malloc(threads * sizeof(pthread_t));
+    int started = 0;
+    while (workers != NULL && started < threads) {
+        if (pthread_create(&workers[started], NULL, batch_worker, &queue) != 0) {
+            break;
+        }
+        started++;
+    }
+    if (started == 0) {
+        // No threads to be had; do it all here instead.
+        batch_worker(&queue);
+    }
+    
+    int ok = 1;
+    for (size_t i = 0; i < count; i++) {
+        pthread_mutex_lock(&queue.lock);
+        while (!jobs[i].done) {
+            pthread_cond_wait(&queue.finished, &queue.lock);
+        }
+        pthread_mutex_unlock(&queue.lock);
+        
+        if (jobs[i].out_text != NULL) {
+            fwrite(jobs[i].out_text, 1, jobs[i].out_size, stdout);
+            free(jobs[i].out_text);
+        } else {
+            printf("\n%s: Unable to collect output\n", jobs[i].input_file_name);
+            jobs[i].ok = 0;
+        }
+        if (!jobs[i].ok) {
+            ok = 0;
+        }
+    }
+    
+    for (int i = 0; i < started; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    free(workers);
+    pthread_cond_destroy(&queue.finished);
+    pthread_mutex_destroy(&queue.lock);
+    return ok;
+}
 
-    unsigned char * data = malloc(file_size);
-    if (data == NULL) {
-        printf("File too large to allocate work buffer");
-        fclose(file);
-        return -1;
+// Reads the inputs: one tape as it goes, or a batch on a pool of worker threads.
+// Returns 0 if any of them failed.
+static int run_inputs(struct run_options * options, char ** names, size_t count, int threads)
+{
+    // The captures in a vote make one tape, named for the first of them.
+    size_t job_count = (options->vote ? 1 : count);
+    struct tape_job * jobs = calloc(job_count, sizeof(struct tape_job));
+    if (jobs == NULL) {
+        printf("Too many inputs\n");
+        return 0;
+    }
+    for (size_t i = 0; i < job_count; i++) {
+        jobs[i].input_file_name = names[i];
+        jobs[i].options = options;
+        if (options->container != NULL) {
+            jobs[i].container_tape = container_add_tape(options->container, names[i]);
+            if (jobs[i].container_tape == UINT32_MAX) {
+                printf("Unable to add %s to the container\n", names[i]);
+                free(jobs);
+                return 0;
+            }
+        }
     }
     
-    if (fseek(file, 0 , SEEK_SET) != 0) {
-        printf("Error reading %s\n", input_file_name);
-        free(data);
-        fclose(file);
-        return -1;
+    int ok;
+    if (job_count == 1) {
+        // Just the one tape; report on it as it goes.
+        jobs[0].out = stdout;
+        process_tape(&jobs[0]);
+        ok = jobs[0].ok;
+    } else {
+        ok = run_batch(jobs, job_count, threads);
     }
+    free(jobs);
+    return ok;
+}
+
+// Runs as a daemon (--watch): reads every capture that's completed in (or moved
+// into) the directories, on a pool of worker threads, until interrupted (see
+// spool.h). Those already there to begin with are read too, unless they've
+// been read into the store or container already. Returns 0 if it couldn't be
+// started, or a capture couldn't be read.
+static int watch_spool(struct run_options * options,
+                       char * const directories[],
+                       size_t count,
+                       int threads,
+                       const char * socket_path)
+{
+    // Interrupting stops the daemon. (The handler is left in place after that,
+    // so that interrupting it again while it winds up doesn't cut short
+    // writing out what it's read.)
+    struct sigaction stop;
+    memset(&stop, 0, sizeof(stop));
+    stop.sa_handler = stop_reading;
+    sigemptyset(&stop.sa_mask);
+    reading_stopped = 0;
+    sigaction(SIGINT, &stop, NULL);
+    sigaction(SIGTERM, &stop, NULL);
     
-    unsigned long bytes_read = fread(data, 1, file_size, file);
-    fclose(file);
-    if (bytes_read != file_size) {
-        printf("Error reading %s\n", input_file_name);
-        free(data);
-        return -1;
+    struct spool_reader reader;
+    memset(&reader, 0, sizeof(reader));
+    reader.read = spool_read;
+    reader.done = spool_done;
+    reader.context = options;
+    reader.warm_size = sizeof(struct warm_state);
+    reader.container = options->container;
+    reader.store = options->store;
+    return spool_run(&reader, directories, count, threads, socket_path, &reading_stopped);
+}
+
+// Spool callback: reads a capture as a tape of its own, with the worker's warm
+// parser and buffers.
+static void spool_read(void * context, const char * path, void * warm, FILE * out, struct spool_tape * tape)
+{
+    const struct run_options * options = context;
+    struct tape_job job;
+    memset(&job, 0, sizeof(job));
+    job.input_file_name = path;
+    job.options = options;
+    job.warm = warm;
+    job.out = out;
+    if (options->container != NULL &&
+        (job.container_tape = container_add_tape(options->container, path)) == UINT32_MAX) {
+        fprintf(out, "Unable to add %s to the container\n", path);
+        return;
+    }
+    process_tape(&job);
+    tape->ok = job.ok;
+    tape->blocks_reported = (size_t)job.blocks_reported;
+    tape->bytes_read = job.bytes_read;
+    tape->seconds = job.seconds;
+    tape->have_stats = job.have_stats;
+    tape->stats = job.stats;
+}
+
+// Spool callback: whether a capture found by a sweep has been read into the
+// store or container already (by this run or an earlier one), and needn't be
+// read again.
+static int spool_done(void * context, const char * path)
+{
+    struct stat st;
+    if (stat(path, &st) != 0) {
+        return 1;       // (Gone again.)
+    }
+    int done = 0;
+    const struct run_options * options = context;
+    if (options->container != NULL) {
+        pthread_mutex_lock(&options->container->lock);
+        for (size_t i = 0; i < options->container->tape_count && !done; i++) {
+            done = (strcmp(options->container->tapes[i], path) == 0);
+        }
+        pthread_mutex_unlock(&options->container->lock);
+    } else if (options->store != NULL) {
+        // Its list of stored blocks is written once it's been read. (That of a
+        // compressed capture is named without either extension.)
+        char * base = remove_path_extension(path);
+        for (int i = 0; i < 2 && base != NULL && !done; i++) {
+            size_t name_size = strlen(base) + sizeof(".stored");
+            char * stored_name = malloc(name_size);
+            struct stat stored_st;
+            if (stored_name != NULL) {
+                snprintf(stored_name, name_size, "%s.stored", base);
+                done = (stat(stored_name, &stored_st) == 0 && stored_st.st_mtime >= st.st_mtime);
+                free(stored_name);
+            }
+            char * shorter = remove_path_extension(base);
+            free(base);
+            base = shorter;
+        }
+        free(base);
+    }
+    return done;
+}
+
+// Reads a list of input file names, one per line. Blank lines and lines
+// starting with '#' are skipped. Prints a message and returns 0 on failure.
+static int read_manifest(const char * file_name, char *** names, size_t * count)
+{
+    FILE * file = fopen(file_name, "r");
+    if (!file) {
+        printf("Unable to open %s\n", file_name);
+        return 0;
     }
-        
-    printf("\n%-10s%-10s%-10s%-10s%-10s\n", "BLOCK", "NAME", "LENGTH", "TYPE", "ERROR");
-    printf("-----     ----      ------    ----      -----\n");
     
-    // Set up the input parsing state machine and run the input through it.
-    struct spherecas_state read_state;
-    spherecas_begin_read(&read_state);
-    spherecas_read_bytes(&read_state, data, (int)bytes_read);
+    *names = NULL;
+    *count = 0;
+    size_t capacity = 0;
+    char * line = NULL;
+    size_t line_size = 0;
+    ssize_t length;
+    while ((length = getline(&line, &line_size, file)) >= 0) {
+        while (length > 0 && (line[length - 1] == '\n' || line[length - 1] == '\r' ||
+                              line[length - 1] == ' ' || line[length - 1] == '\t')) {
+            line[--length] = '\0';
+        }
+        if (length == 0 || line[0] == '#') {
+            continue;
+        }
+        if (*count == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            char ** grown = realloc(*names, capacity * sizeof(char *));
+            if (grown == NULL) {
+                break;
+            }
+            *names = grown;
+        }
+        (*names)[(*count)++] = strdup(line);
+    }
+    free(line);
+    fclose(file);
     
-    printf("\nDone. %d block(s) found.\n", CurrentBlockIndex);
-    free(data);
-    free(FilenameBase);
+    if (*count == 0) {
+        printf("No input files listed in %s\n", file_name);
+        free(*names);
+        return 0;
+    }
+    return 1;
 }
 
-// This is the callback function for the data reader
-void spherecas_block_read(struct spherecas_state * state ,
-                         char block_name[],
-                         uint8_t * data,
-                         int length,
-                         enum spherecas_blocktype type,
-                         enum spherecas_error error)
+// Indexes a mapped input with a thread per range of the input, then reports
+// the blocks a serial (or recovering) read would have found, in order, plus, if
+// asked, the intact blocks that read couldn't see. Returns 0 on failure.
+static int scan_parallel(struct tape_job * job, const struct input_data * input)
 {
-    const char * type_str = (type == SPHERECAS_BLOCKTYPE_TEXT ? "Text" : "Obj");
-    char * error_str = "";
-    if (error == SPHERECAS_ERROR_TRAILER) {
-        error_str = "Trailer";
-    } else if (error == SPHERECAS_ERROR_CHECKSUM) {
-        error_str = "Checksum";
+    int threads = job->options->scan_threads;
+    if (threads < 1) {
+        threads = 1;
     }
-    printf("%-10d%c%c        %-10d%-10s%-10s\n", CurrentBlockIndex+1, block_name[0], block_name[1], length, type_str, error_str);
+    struct scan_range * ranges = calloc(threads, sizeof(struct scan_range));
+    pthread_t * workers = calloc(threads, sizeof(pthread_t));
+    if (ranges == NULL || workers == NULL) {
+        fprintf(job->out, "Unable to allocate work buffer\n");
+        free(ranges);
+        free(workers);
+        return 0;
+    }
+    
+    size_t share = input->size / threads + 1;
+    for (int i = 0; i < threads; i++) {
+        ranges[i].data = input->bytes;
+        ranges[i].size = input->size;
+        ranges[i].begin = share * i < input->size ? share * i : input->size;
+        ranges[i].end = share * (i + 1) < input->size ? share * (i + 1) : input->size;
+        if (i == 0 || pthread_create(&workers[i], NULL, scan_worker, &ranges[i]) != 0) {
+            // Do this one here (always the case for the first range).
+            workers[i] = pthread_self();
+            scan_worker(&ranges[i]);
+        }
+    }
+    for (int i = 1; i < threads; i++) {
+        if (!pthread_equal(workers[i], pthread_self())) {
+            pthread_join(workers[i], NULL);
+        }
+    }
+    
+    // Stitch the ranges back together; each is already in order.
+    size_t count = 0;
+    int ok = 1;
+    for (int i = 0; i < threads; i++) {
+        count += ranges[i].count;
+        ok &= !ranges[i].failed;
+    }
+    struct spherecas_candidate * candidates = ok ? malloc((count + 1) * sizeof(struct spherecas_candidate)) : NULL;
+    if (candidates != NULL) {
+        size_t next = 0;
+        for (int i = 0; i < threads; i++) {
+            memcpy(&candidates[next], ranges[i].found, ranges[i].count * sizeof(struct spherecas_candidate));
+            next += ranges[i].count;
+        }
+        unsigned reported = SPHERECAS_CANDIDATE_SERIAL;
+        if (job->options->recover) {
+            spherecas_recover_index(candidates, count);
+            reported = SPHERECAS_CANDIDATE_RECOVERY;
+        } else {
+            spherecas_resolve_index(candidates, count);
+        }
+        
+        for (size_t i = 0; i < count; i++) {
+            const struct spherecas_candidate * candidate = &candidates[i];
+            int shadowed;
+            if (candidate->flags & reported) {
+                shadowed = 0;
+            } else if (job->options->show_shadowed &&
+                       (candidate->flags & SPHERECAS_CANDIDATE_COMPLETE) &&
+                       candidate->error == SPHERECAS_ERROR_NONE) {
+                shadowed = 1;
+            } else {
+                continue;
+            }
+            if (job->options->wanted_count > 0 && wanted_slot(job->options, candidate->block_name) < 0) {
+                job->block_index++;
+                continue;
+            }
+            // (The checksum read off the tape follows the payload and ETB.)
+            uint8_t checksum = (candidate->error == SPHERECAS_ERROR_CHECKSUM ?
+                                input->bytes[candidate->data_offset + candidate->length + 1] : 0);
+            if (report_repairable(job, candidate->block_name, &input->bytes[candidate->data_offset], candidate->data_offset,
+                                  candidate->length, candidate->type, SPHERECAS_CONTENT_UNKNOWN, candidate->error, shadowed,
+                                  checksum) == SPHERECAS_STOP) {
+                break;
+            }
+        }
+    } else {
+        fprintf(job->out, "Unable to allocate work buffer\n");
+        ok = 0;
+    }
+    
+    free(candidates);
+    for (int i = 0; i < threads; i++) {
+        free(ranges[i].found);
+    }
+    free(ranges);
+    free(workers);
+    return ok;
+}
+
+static void * scan_worker(void * arg)
+{
+    struct scan_range * range = arg;
+    spherecas_index_range(range->data, range->size, range->begin, range->end, add_candidate, range);
+    return NULL;
+}
 
-    if (!ListOnly) {
-        char * output_name = malloc(strlen(FilenameBase) + 12);
-        sprintf(output_name, "%s-%c%c_%d.bin", FilenameBase, block_name[0], block_name[1], CurrentBlockIndex + 1);
-        FILE * outfile = fopen(output_name, "wb");
-        if (!outfile) {
-            printf("\tFailed to open output file for writing %s\n\n", output_name);
+static void add_candidate(void * context, const struct spherecas_candidate * candidate)
+{
+    struct scan_range * range = context;
+    if (range->count == range->capacity) {
+        size_t capacity = range->capacity ? range->capacity * 2 : 256;
+        struct spherecas_candidate * grown = realloc(range->found, capacity * sizeof(struct spherecas_candidate));
+        if (grown == NULL) {
+            range->failed = 1;
             return;
         }
-        fwrite(data, 1, length, outfile);
-        fclose(outfile);
-        printf("\t--> Block written to file %s\n\n", output_name);
-        free(output_name);
+        range->found = grown;
+        range->capacity = capacity;
+    }
+    range->found[range->count++] = *candidate;
+}
+
+// Parses a comma separated list of block names and name ranges, adding them to
+// the wanted blocks. Returns 0 if it isn't understood.
+static int parse_block_selection(const char * arg, struct run_options * options)
+{
+    while (*arg != '\0') {
+        size_t length = strcspn(arg, ",");
+        struct name_range range;
+        if (length == 2 || (length == 5 && arg[2] == '-')) {
+            range.first = ((uint8_t)arg[0] << 8) | (uint8_t)arg[1];
+            range.last = range.first;
+            if (length == 5) {
+                range.last = ((uint8_t)arg[3] << 8) | (uint8_t)arg[4];
+            }
+        } else {
+            return 0;
+        }
+        if (range.last < range.first) {
+            return 0;
+        }
+        
+        struct name_range * grown = realloc(options->wanted, (options->wanted_count + 1) * sizeof(struct name_range));
+        if (grown == NULL) {
+            return 0;
+        }
+        options->wanted = grown;
+        // A name asked for twice is only found once, so ranges that overlap (or
+        // adjoin) are merged, leaving each name in just one of them.
+        for (size_t i = 0; i < options->wanted_count; ) {
+            struct name_range * other = &options->wanted[i];
+            if (range.first <= (uint32_t)other->last + 1 && other->first <= (uint32_t)range.last + 1) {
+                range.first = (other->first < range.first ? other->first : range.first);
+                range.last = (other->last > range.last ? other->last : range.last);
+                options->wanted_names -= other->last - other->first + 1;
+                *other = options->wanted[--options->wanted_count];
+                i = 0;      // (It's bigger now, so check them all again.)
+            } else {
+                i++;
+            }
+        }
+        options->wanted[options->wanted_count++] = range;
+        options->wanted_names += range.last - range.first + 1;
+        
+        arg += length;
+        if (*arg == ',') {
+            arg++;
+        }
+    }
+    return 1;
+}
+
+// Returns the position of a block name among all of the wanted names, or -1
+// if it isn't wanted.
+static long wanted_slot(const struct run_options * options, const char block_name[])
+{
+    uint16_t value = ((uint8_t)block_name[0] << 8) | (uint8_t)block_name[1];
+    long slot = 0;
+    for (size_t i = 0; i < options->wanted_count; i++) {
+        const struct name_range * range = &options->wanted[i];
+        if (value >= range->first && value <= range->last) {
+            return slot + (value - range->first);
+        }
+        slot += range->last - range->first + 1;
+    }
+    return -1;
+}
+
+// Filter callback for the data reader: skips blocks that weren't asked for
+// (but counts them, so block numbers are the same as in a full listing).
+static int block_filter(struct spherecas_state * state, const char block_name[], uint32_t length)
+{
+    struct tape_job * job = state->context;
+    (void)length;
+    if (wanted_slot(job->options, block_name) >= 0) {
+        return 1;
     }
+    job->block_index++;
+    return 0;
+}
+
+// The parser's options for a job. Payloads are reported straight from the
+// input wherever they can be, and aren't kept at all when nothing is going to
+// look at them (a listing, unless it's being saved as an index or blocks are
+// to be repaired). Classifying them takes only their features.
+static unsigned parser_options(const struct tape_job * job)
+{
+    unsigned options = SPHERECAS_OPTION_ZERO_COPY;
+    if (job->options->list_only && !job->recording && !job->options->repair) {
+        options |= SPHERECAS_OPTION_NO_PAYLOAD;
+    }
+    if (job->options->classify) {
+        options |= SPHERECAS_OPTION_FEATURES;
+    }
+    return options;
+}
+
+// What the block being reported seems to hold, by the features the parser
+// counted as it read it (if it was asked to).
+static enum spherecas_content block_content(const struct spherecas_state * state)
+{
+    if (!(state->options & SPHERECAS_OPTION_FEATURES)) {
+        return SPHERECAS_CONTENT_UNKNOWN;
+    }
+    return spherecas_classify(&state->features);
+}
 
-    CurrentBlockIndex++;
+// This is the callback function for the data reader
+static int block_read(struct spherecas_state * state,
+                      char block_name[],
+                      uint8_t * data,
+                      int length,
+                      enum spherecas_blocktype type,
+                      enum spherecas_error error)
+{
+    return report_repairable(state->context, block_name, data, state->block_offset, length, type,
+                             block_content(state), error, 0, state->tape_checksum);
 }
 
+// Reports a block, first repairing it if it failed its checksum and that's been
+// asked for (--repair). `checksum` is the one read off the tape.
+static int report_repairable(struct tape_job * job,
+                             const char block_name[],
+                             const uint8_t * data,
+                             uint64_t offset,
+                             int length,
+                             enum spherecas_blocktype type,
+                             enum spherecas_content content,
+                             enum spherecas_error error,
+                             int shadowed,
+                             uint8_t checksum)
+{
+    // The index holds the block as it was read, so that it's listed the same
+    // way when replayed without --repair (and repaired again with it).
+    if (job->recording) {
+        record_block(job, block_name, data, offset, length, type, error, shadowed);
+    }
+    uint8_t * repaired = NULL;
+    if (job->options->repair && error == SPHERECAS_ERROR_CHECKSUM && data != NULL) {
+        repaired = repair_payload(job, block_name, data, (uint32_t)length, checksum, NULL, 0, &type);
+        if (repaired != NULL) {
+            data = repaired;
+            error = SPHERECAS_ERROR_NONE;
+            content = SPHERECAS_CONTENT_UNKNOWN;    // (It's classified again.)
+        }
+    }
+    int result = report_block(job, block_name, data, length, type, content, error, shadowed);
+    free(repaired);
+    return result;
+}
+
+// Looks for the single-byte correction that would make a block match its
+// checksum, noting the best (if any) in the listing. If it's likely enough (see
+// REPAIR_MIN_CONFIDENCE), returns a copy of the block with it made, to be freed,
+// and updates `type` to go with it; otherwise NULL.
+static uint8_t * repair_payload(struct tape_job * job,
+                                const char block_name[],
+                                const uint8_t * data,
+                                uint32_t length,
+                                uint8_t checksum,
+                                const uint8_t * const others[],
+                                size_t other_count,
+                                enum spherecas_blocktype * type)
+{
+    struct repair_result repair;
+    repair_search(data, length, checksum, others, other_count, job->options->repair_budget, &repair);
+    if (!repair.found) {
+        return NULL;
+    }
+    uint8_t * repaired = NULL;
+    if (repair.confidence >= REPAIR_MIN_CONFIDENCE && (repaired = malloc(length)) != NULL) {
+        memcpy(repaired, data, length);
+        repaired[repair.position] = repair.to;
+        *type = SPHERECAS_BLOCKTYPE_TEXT;
+        for (uint32_t i = 0; i < length; i++) {
+            if (repaired[i] & 0x80) {
+                *type = SPHERECAS_BLOCKTYPE_OBJECT;
+                break;
+            }
+        }
+    }
+    fprintf(job->out, "(Block %d, %c%c: %s byte %u, 0x%02X to 0x%02X (one %s), confidence %.0f%%%s)\n",
+            job->block_index + 1, block_name[0], block_name[1],
+            (repaired != NULL ? "repaired" : "not repaired; the likeliest fix is"),
+            repair.position, repair.from, repair.to, (repair.single_bit ? "bit" : "byte"),
+            repair.confidence * 100.0, (repair.cut_short ? "; not every byte was tried" : ""));
+    return repaired;
+}
+
+// Lists a block, and writes it out unless only listing. Returns SPHERECAS_STOP
+// once every block asked for has been found intact.
+static int report_block(struct tape_job * job,
+                        const char block_name[],
+                        const uint8_t * data,
+                        int length,
+                        enum spherecas_blocktype type,
+                        enum spherecas_content content,
+                        enum spherecas_error error,
+                        int shadowed)
+{
+    const char * error_str = (shadowed ? "Shadowed" : error_string(error));
+    const char * type_str = (type == SPHERECAS_BLOCKTYPE_TEXT ? "Text" : "Obj");
+    const char * content_str = "";
+    if (job->options->classify) {
+        // Blocks that didn't come straight from the parser (from an index, or
+        // rebuilt) are classified from their payloads.
+        if (content == SPHERECAS_CONTENT_UNKNOWN && data != NULL) {
+            struct spherecas_features features;
+            spherecas_count_features(data, (size_t)length, &features);
+            content = spherecas_classify(&features);
+        }
+        content_str = content_string(content);
+    }
+    fprintf(job->out, "%-10d%c%c        %-10d%-10s%-10s%s\n", job->block_index+1, block_name[0], block_name[1], length,
+            type_str, error_str, content_str);
+    job->blocks_reported++;
+
+    if (job->options->store != NULL) {
+        store_block(job, block_name, data, length, type_str, error_str);
+    } else if (job->options->container != NULL) {
+        if (!container_add_block(job->options->container, job->container_tape, (uint32_t)job->block_index + 1,
+                                 block_name, data, (uint32_t)length, (type == SPHERECAS_BLOCKTYPE_OBJECT), (uint8_t)error)) {
+            fprintf(job->out, "\tFailed to add block to the container\n\n");
+            job->ok = 0;
+        } else if (data != NULL) {
+            fprintf(job->out, "\t--> Block added to the container\n\n");
+        }
+    } else if (job->options->writer != NULL && data != NULL) {
+        // Queued to be written; any failure is reported at the end of the run.
+        size_t name_size = strlen(job->filename_base) + 32;
+        char * output_name = malloc(name_size);
+        if (output_name == NULL) {
+            fprintf(job->out, "\tUnable to allocate output file name\n\n");
+        } else {
+            snprintf(output_name, name_size, "%s-%c%c_%d.bin", job->filename_base, block_name[0], block_name[1], job->block_index + 1);
+            if (writer_put(job->options->writer, output_name, data, (size_t)length)) {
+                fprintf(job->out, "\t--> Block queued to be written to file %s\n\n", output_name);
+            } else {
+                fprintf(job->out, "\tFailed to queue output file for writing %s\n\n", output_name);
+            }
+            free(output_name);
+        }
+    }
+
+    job->block_index++;
+    
+    if (job->wanted_found != NULL && error == SPHERECAS_ERROR_NONE) {
+        long slot = wanted_slot(job->options, block_name);
+        if (slot >= 0 && !job->wanted_found[slot]) {
+            job->wanted_found[slot] = 1;
+            if (--job->wanted_left == 0) {
+                return SPHERECAS_STOP;
+            }
+        }
+    }
+    return SPHERECAS_CONTINUE;
+}
+
+// Puts a block's payload in the store (unless it's there already), and adds it
+// to the tape's list of stored blocks.
+static void store_block(struct tape_job * job,
+                        const char block_name[],
+                        const uint8_t * data,
+                        int length,
+                        const char * type_str,
+                        const char * error_str)
+{
+    const char * directory = job->options->store->directory;
+    char stored_name[STORE_NAME_SIZE] = "-";
+    if (data != NULL) {
+        enum store_result result = store_put(job->options->store, data, (size_t)length, stored_name);
+        if (result == STORE_FAILED) {
+            fprintf(job->out, "\tFailed to store block in %s\n\n", directory);
+            job->ok = 0;
+            strcpy(stored_name, "-");
+        } else if (result == STORE_DUPLICATE) {
+            fprintf(job->out, "\t--> Block already stored as %s/%s\n\n", directory, stored_name);
+        } else {
+            fprintf(job->out, "\t--> Block stored as %s/%s\n\n", directory, stored_name);
+        }
+    }
+    
+    // Names are written as is where they can be, and as \xNN escapes where not.
+    char name[9];
+    size_t at = 0;
+    for (int i = 0; i < 2; i++) {
+        uint8_t c = (uint8_t)block_name[i];
+        if (c > ' ' && c < 0x7F && c != '\\') {
+            name[at++] = (char)c;
+        } else {
+            at += (size_t)snprintf(&name[at], sizeof(name) - at, "\\x%02X", c);
+        }
+    }
+    name[at] = '\0';
+    fprintf(job->stored, "%d\t%s\t%d\t%s\t%s\t%s\n", job->block_index + 1, name, length, type_str,
+            (error_str[0] != '\0' ? error_str : "-"), stored_name);
+}
+
+// Adds a block to the sidecar being collected.
+static void record_block(struct tape_job * job,
+                         const char block_name[],
+                         const uint8_t * data,
+                         uint64_t offset,
+                         int length,
+                         enum spherecas_blocktype type,
+                         enum spherecas_error error,
+                         int shadowed)
+{
+    if (job->entry_count == job->entry_capacity) {
+        size_t capacity = (job->entry_capacity ? job->entry_capacity * 2 : 64);
+        struct sidecar_entry * grown = realloc(job->entries, capacity * sizeof(struct sidecar_entry));
+        if (grown == NULL) {
+            job->entries_failed = 1;
+            return;
+        }
+        job->entries = grown;
+        job->entry_capacity = capacity;
+    }
+    struct sidecar_entry * entry = &job->entries[job->entry_count++];
+    entry->offset = offset;
+    entry->hash = (data != NULL ? sidecar_hash(data, (size_t)length) : 0);
+    entry->length = (uint32_t)length;
+    entry->block_name[0] = block_name[0];
+    entry->block_name[1] = block_name[1];
+    entry->error = (uint8_t)error;
+    entry->flags = ((type == SPHERECAS_BLOCKTYPE_OBJECT ? SIDECAR_OBJECT : 0) |
+                    (shadowed ? SIDECAR_SHADOWED : 0) |
+                    (data == NULL ? SIDECAR_NO_DATA : 0));
+}
+
+// Reports the blocks listed in a sidecar, straight from the mapped input. The
+// payloads to be written out are checked against their hashes first, so that a
+// stale index is caught before anything is reported. Returns 0 if the index
+// can't be used.
+static int replay_sidecar(struct tape_job * job,
+                          const struct input_data * input,
+                          const char * file_name,
+                          const struct sidecar_entry * entries,
+                          size_t count)
+{
+    const struct run_options * options = job->options;
+    for (size_t i = 0; i < count && !options->list_only; i++) {
+        const struct sidecar_entry * entry = &entries[i];
+        if ((options->wanted_count == 0 || wanted_slot(options, entry->block_name) >= 0) &&
+            !(entry->flags & SIDECAR_NO_DATA) &&
+            sidecar_hash(&input->bytes[entry->offset], entry->length) != entry->hash) {
+            return 0;
+        }
+    }
+    
+    fprintf(job->out, "(Using the block index in %s)\n", file_name);
+    for (size_t i = 0; i < count; i++) {
+        const struct sidecar_entry * entry = &entries[i];
+        if (options->wanted_count > 0 && wanted_slot(options, entry->block_name) < 0) {
+            job->block_index++;
+            continue;
+        }
+        const uint8_t * data = (entry->flags & SIDECAR_NO_DATA ? NULL : &input->bytes[entry->offset]);
+        enum spherecas_blocktype type = (entry->flags & SIDECAR_OBJECT ? SPHERECAS_BLOCKTYPE_OBJECT : SPHERECAS_BLOCKTYPE_TEXT);
+        uint8_t checksum = (entry->error == SPHERECAS_ERROR_CHECKSUM && data != NULL ?
+                            input->bytes[entry->offset + entry->length + 1] : 0);
+        if (report_repairable(job, entry->block_name, data, entry->offset, (int)entry->length,
+                              type, SPHERECAS_CONTENT_UNKNOWN, (enum spherecas_error)entry->error, entry->flags & SIDECAR_SHADOWED,
+                              checksum) == SPHERECAS_STOP) {
+            break;
+        }
+    }
+    return 1;
+}
+
+static const char * content_string(enum spherecas_content content)
+{
+    if (content == SPHERECAS_CONTENT_TEXT) {
+        return "Text";
+    } else if (content == SPHERECAS_CONTENT_BASIC) {
+        return "BASIC";
+    } else if (content == SPHERECAS_CONTENT_OBJECT) {
+        return "Obj";
+    } else if (content == SPHERECAS_CONTENT_DATA) {
+        return "Data";
+    }
+    return "-";
+}
+
+static const char * error_string(enum spherecas_error error)
+{
+    if (error == SPHERECAS_ERROR_TRAILER) {
+        return "Trailer";
+    } else if (error == SPHERECAS_ERROR_CHECKSUM) {
+        return "Checksum";
+    } else if (error == SPHERECAS_ERROR_MEMORY) {
+        return "Memory";
+    }
+    return "";
+}
+
+// Opens the named file ("-" being standard input). Regular files are mapped
+// read-only, so parsing can start at once and the pages are shared with the
+// page cache; anything that can't be (pipes, devices) is left to be streamed.
+// A `device` (a serial port) is opened without waiting for a carrier, and isn't
+// checked for compression, which would mean waiting for its first bytes.
+// Prints a message and returns 0 on failure.
+static int open_input(const char * file_name, struct input_data * input, int device, FILE * out)
+{
+    input->bytes = NULL;
+    input->size = 0;
+    input->bytes_read = 0;
+    input->regular_file = 0;
+    input->peek_size = 0;
+    input->decompressor = NULL;
+    input->packed = NULL;
+    
+    if (strcmp(file_name, "-") == 0) {
+        input->fd = STDIN_FILENO;
+    } else {
+        input->fd = open(file_name, O_RDONLY | (device ? O_NOCTTY | O_NONBLOCK : 0));
+        if (input->fd < 0) {
+            fprintf(out, "Unable to open %s\n", file_name);
+            return 0;
+        }
+    }
+    
+    struct stat st;
+    if (fstat(input->fd, &st) != 0) {
+        fprintf(out, "Error reading %s\n", file_name);
+        close_input(input);
+        return 0;
+    }
+    
+    if (S_ISREG(st.st_mode) && input->fd != STDIN_FILENO) {
+        input->regular_file = 1;
+        input->key.size = (uint64_t)st.st_size;
+        input->key.mtime_sec = (int64_t)st.st_mtime;
+#ifdef __APPLE__
+        input->key.mtime_nsec = (uint32_t)st.st_mtimespec.tv_nsec;
+#else
+        input->key.mtime_nsec = (uint32_t)st.st_mtim.tv_nsec;
+#endif
+        input->key.mode = 0;
+    }
+    
+    if (S_ISREG(st.st_mode) && st.st_size > 0) {
+        void * map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, input->fd, 0);
+        if (map != MAP_FAILED) {
+            posix_madvise(map, (size_t)st.st_size, POSIX_MADV_SEQUENTIAL);
+            input->bytes = map;
+            input->size = (size_t)st.st_size;
+        }
+        // Otherwise it will be streamed like a pipe.
+    }
+    if (device) {
+        return 1;
+    }
+    return open_decompression(file_name, input, out);
+}
+
+// Checks an open input for compression, by its first few bytes, and gets ready
+// to decompress it as it's read if need be. Prints a message and returns 0 on
+// failure.
+static int open_decompression(const char * file_name, struct input_data * input, FILE * out)
+{
+    enum compression kind;
+    if (input->bytes != NULL) {
+        kind = detect_compression(input->bytes, input->size);
+    } else {
+        // What's read here is handed back by read_input first.
+        while (input->peek_size < COMPRESSION_MAGIC_SIZE) {
+            ssize_t count = read(input->fd, &input->peek[input->peek_size], COMPRESSION_MAGIC_SIZE - input->peek_size);
+            if (count < 0) {
+                fprintf(out, "Error reading %s\n", file_name);
+                close_input(input);
+                return 0;
+            }
+            if (count == 0) {
+                break;
+            }
+            input->peek_size += (size_t)count;
+        }
+        kind = detect_compression(input->peek, input->peek_size);
+    }
+    if (kind == COMPRESSION_NONE) {
+        return 1;
+    }
+    if (!compression_supported(kind)) {
+        fprintf(out, "%s is %s compressed, which this build can't decompress\n", file_name, compression_name(kind));
+        close_input(input);
+        return 0;
+    }
+    
+    // It's streamed through the decompressor from here on, and can't have a
+    // sidecar (whose offsets would be into the decompressed bytes).
+    if (input->bytes != NULL) {
+        munmap((void *)input->bytes, input->size);
+        input->bytes = NULL;
+        input->size = 0;
+        if (lseek(input->fd, 0, SEEK_SET) != 0) {
+            fprintf(out, "Error reading %s\n", file_name);
+            close_input(input);
+            return 0;
+        }
+    }
+    input->regular_file = 0;
+    input->decompressor = malloc(sizeof(struct decompressor));
+    input->packed = malloc(STREAM_CHUNK_SIZE);
+    if (input->decompressor == NULL || input->packed == NULL ||
+        !decompressor_begin(input->decompressor, kind)) {
+        free(input->decompressor);
+        input->decompressor = NULL;
+        fprintf(out, "Unable to start decompressing %s\n", file_name);
+        close_input(input);
+        return 0;
+    }
+    memcpy(input->packed, input->peek, input->peek_size);
+    input->packed_next = input->packed;
+    input->packed_left = input->peek_size;
+    input->packed_eof = 0;
+    input->peek_size = 0;
+    fprintf(out, "(%s is %s compressed; decompressing it as it's read)\n", file_name, compression_name(kind));
+    return 1;
+}
+
+static void stop_reading(int signal_number)
+{
+    (void)signal_number;
+    reading_stopped = 1;
+}
+
+// Reads a tape file that's still being written (--follow; see follow.h),
+// reporting each block as soon as it's complete, until interrupted (SIGINT or
+// SIGTERM) or every block asked for has been found. Returns 0 on failure.
+static int follow_input(struct tape_job * job, struct input_data * input)
+{
+    struct follow_reader reader;
+    memset(&reader, 0, sizeof(reader));
+    if (input->decompressor != NULL || fstat(input->fd, &reader.st) != 0 || !S_ISREG(reader.st.st_mode)) {
+        fprintf(job->out, "%s can't be followed (only a plain tape file can)\n", job->input_file_name);
+        return 0;
+    }
+    struct sigaction stop, old_int, old_term;
+    memset(&stop, 0, sizeof(stop));
+    stop.sa_handler = stop_reading;
+    sigemptyset(&stop.sa_mask);
+    reading_stopped = 0;
+    sigaction(SIGINT, &stop, &old_int);
+    sigaction(SIGTERM, &stop, &old_term);
+    
+    reader.file_name = job->input_file_name;
+    reader.fd = input->fd;
+    reader.out = job->out;
+    reader.stopped = &reading_stopped;
+    reader.begin = follow_begin;
+    reader.more_wanted = more_blocks_wanted;
+    reader.flush = follow_flush;
+    reader.context = job;
+    reader.blocks_counted = &job->block_index;
+    reader.blocks_reported = &job->blocks_reported;
+    int ok = follow_read(&reader, &job->stats, &input->bytes_read);
+    job->have_stats = 1;
+    sigaction(SIGINT, &old_int, NULL);
+    sigaction(SIGTERM, &old_term, NULL);
+    return ok;
+}
+
+// Follow callback: sets up a parser to report a tape's blocks.
+static void follow_begin(void * context, struct spherecas_state * state)
+{
+    struct tape_job * job = context;
+    spherecas_begin_read_callback(state, block_read, job);
+    spherecas_set_options(state, parser_options(job));
+    if (job->options->wanted_count > 0) {
+        spherecas_set_filter(state, block_filter);
+    }
+}
+
+// Follow and serial callback: whether any block asked for is still to be found.
+static int more_blocks_wanted(void * context)
+{
+    const struct tape_job * job = context;
+    return !(job->options->wanted_count > 0 && job->wanted_left == 0);
+}
+
+// Follow callback: writes out the blocks reported so far.
+static void follow_flush(void * context)
+{
+    const struct tape_job * job = context;
+    if (job->options->writer != NULL) {
+        writer_flush(job->options->writer);
+    }
+}
+
+// Reads a tape live from a serial port (--serial; see serial.h), reporting each
+// block the moment it's complete, until interrupted (SIGINT or SIGTERM), until
+// the line hangs up, or until every block asked for has been found. Returns 0
+// on failure.
+static int serial_input(struct tape_job * job, struct input_data * input)
+{
+    struct spherecas_state read_state;
+    spherecas_begin_read_callback(&read_state, block_read, job);
+    spherecas_set_options(&read_state, parser_options(job));
+    if (job->options->wanted_count > 0) {
+        spherecas_set_filter(&read_state, block_filter);
+    }
+    
+    struct sigaction stop, old_int, old_term;
+    memset(&stop, 0, sizeof(stop));
+    stop.sa_handler = stop_reading;
+    sigemptyset(&stop.sa_mask);
+    reading_stopped = 0;
+    sigaction(SIGINT, &stop, &old_int);
+    sigaction(SIGTERM, &stop, &old_term);
+    
+    struct serial_reader reader;
+    memset(&reader, 0, sizeof(reader));
+    reader.file_name = job->input_file_name;
+    reader.fd = input->fd;
+    reader.baud = job->options->baud;
+    reader.out = job->out;
+    reader.stopped = &reading_stopped;
+    reader.state = &read_state;
+    reader.more_wanted = more_blocks_wanted;
+    reader.context = job;
+    reader.blocks_counted = &job->block_index;
+    int ok = serial_read(&reader);
+    sigaction(SIGINT, &old_int, NULL);
+    sigaction(SIGTERM, &old_term, NULL);
+    
+    input->bytes_read = read_state.stream_offset;
+    spherecas_get_stats(&read_state, &job->stats);
+    job->have_stats = 1;
+    spherecas_end_read(&read_state);
+    return ok;
+}
+
+// Reads several captures of the same tape together (--vote; see vote.h), and
+// reports each block once, as it comes out of the vote. `input` is the first
+// capture. Returns 0 on failure.
+static int vote_input(struct tape_job * job, struct input_data * input)
+{
+    size_t count = job->options->capture_count;
+    struct input_data inputs[VOTE_MAX_COPIES];
+    struct vote_source sources[VOTE_MAX_COPIES];
+    size_t opened = 1;      // (The first capture's input is the job's.)
+    int ok = 1;
+    for (size_t c = 0; c < count && ok; c++) {
+        struct input_data * capture = input;
+        if (c > 0) {
+            capture = &inputs[c];
+            ok = open_input(job->options->captures[c], capture, 0, job->out);
+            opened += ok;
+        }
+        memset(&sources[c], 0, sizeof(struct vote_source));
+        sources[c].bytes = capture->bytes;
+        sources[c].size = capture->size;
+        sources[c].read = vote_read;
+        sources[c].context = capture;
+    }
+    struct vote_reader reader;
+    if (ok && !vote_open(&reader, sources, count, vote_wanted, job)) {
+        fprintf(job->out, "Unable to allocate work buffer\n");
+        ok = 0;
+    }
+    if (ok) {
+        fprintf(job->out, "(Reading %zu captures of the tape together)\n", count);
+        struct vote_result block;
+        int found;
+        while ((found = vote_next(&reader, &block)) > 0) {
+            if (!block.wanted) {
+                job->block_index++;     // Counted, but not wanted
+                continue;
+            }
+            if (vote_report(job, &block) == SPHERECAS_STOP) {
+                break;
+            }
+        }
+        if (found < 0) {
+            fprintf(job->out, "Error reading %s\n", job->options->captures[reader.failed]);
+            ok = 0;
+        }
+        // The counters, and the bytes read, are those of all of the captures.
+        vote_close(&reader, &job->stats);
+        input->bytes_read = job->stats.bytes_scanned;
+        job->have_stats = 1;
+    }
+    for (size_t c = 1; c < opened; c++) {
+        close_input(&inputs[c]);
+    }
+    return ok;
+}
+
+// Vote source callback: reads what comes next of a streamed capture.
+static ssize_t vote_read(void * context, uint8_t * buffer, size_t size)
+{
+    return read_input(context, buffer, size);
+}
+
+// Vote filter callback: only the blocks asked for (-b) are voted on.
+static int vote_wanted(void * context, const char block_name[2])
+{
+    const struct tape_job * job = context;
+    return (job->options->wanted_count == 0 || wanted_slot(job->options, block_name) >= 0);
+}
+
+// Reports one block of a vote, noting how it came out if it wasn't intact in
+// every capture, first repairing it if need be (and asked for), with the
+// copies it was rebuilt from as evidence. Returns what report_block does.
+static int vote_report(struct tape_job * job, const struct vote_result * block)
+{
+    if (block->intact < job->options->capture_count) {
+        static const char * const outcomes[] = {
+            [VOTE_AS_READ] = "",
+            [VOTE_REBUILT] = "; rebuilt by majority vote",
+            [VOTE_REBUILT_LEAVING_ONE_OUT] = "; rebuilt by majority vote, leaving one out",
+            [VOTE_NO_MATCH] = "; no vote matches the checksum"
+        };
+        fprintf(job->out, "(Block %d, %c%c: in %zu of %zu captures, intact in %zu%s)\n",
+                job->block_index + 1, block->block_name[0], block->block_name[1],
+                block->copies, job->options->capture_count, block->intact, outcomes[block->outcome]);
+    }
+    const uint8_t * data = block->data;
+    enum spherecas_blocktype type = block->type;
+    enum spherecas_error error = block->error;
+    uint8_t * repaired = NULL;
+    if (job->options->repair && error == SPHERECAS_ERROR_CHECKSUM && data != NULL) {
+        repaired = repair_payload(job, block->block_name, data, block->length, block->checksum,
+                                  block->voters, block->voter_count, &type);
+        if (repaired != NULL) {
+            data = repaired;
+            error = SPHERECAS_ERROR_NONE;
+        }
+    }
+    int result = report_block(job, block->block_name, data, (int)block->length, type,
+                              SPHERECAS_CONTENT_UNKNOWN, error, 0);
+    free(repaired);
+    return result;
+}
+
+// Reads what comes next of a streamed input, decompressing it if need be.
+// Returns the count, 0 at the end, or -1 on failure (which includes compressed
+// data that's damaged, or cut short).
+static ssize_t read_input(struct input_data * input, uint8_t * buffer, size_t size)
+{
+    if (input->decompressor == NULL) {
+        if (input->peek_size > 0) {
+            size_t count = (input->peek_size < size ? input->peek_size : size);
+            memcpy(buffer, input->peek, count);
+            memmove(input->peek, &input->peek[count], input->peek_size - count);
+            input->peek_size -= count;
+            return (ssize_t)count;
+        }
+        return read(input->fd, buffer, size);
+    }
+    
+    for (;;) {
+        size_t produced;
+        if (decompressor_run(input->decompressor, &input->packed_next, &input->packed_left,
+                             buffer, size, &produced) != DECOMPRESS_OK) {
+            return -1;
+        }
+        if (produced > 0) {
+            return (ssize_t)produced;
+        }
+        if (input->packed_left > 0) {
+            return -1;      // (Stuck, which shouldn't happen.)
+        }
+        if (input->packed_eof) {
+            return (input->decompressor->complete ? 0 : -1);
+        }
+        ssize_t count = read(input->fd, input->packed, STREAM_CHUNK_SIZE);
+        if (count < 0) {
+            return -1;
+        }
+        input->packed_eof = (count == 0);
+        input->packed_next = input->packed;
+        input->packed_left = (size_t)count;
+    }
+}
+
+// Runs the whole input through the parser: in one go if it's mapped, otherwise
+// a chunk at a time through a fixed buffer (`chunk`, of STREAM_CHUNK_SIZE bytes,
+// or if that's NULL one of its own), so memory use doesn't depend on the length
+// of the input. Prints a message and returns 0 on a read error.
+static int parse_input(const char * file_name,
+                       struct input_data * input,
+                       struct spherecas_state * state,
+                       FILE * out,
+                       uint8_t * chunk)
+{
+    if (input->bytes != NULL) {
+        input->bytes_read = spherecas_read_bytes(state, input->bytes, input->size);
+        return 1;
+    }
+    
+    uint8_t * own_chunk = NULL;
+    if (chunk == NULL && (chunk = own_chunk = malloc(STREAM_CHUNK_SIZE)) == NULL) {
+        fprintf(out, "Unable to allocate work buffer\n");
+        return 0;
+    }
+    int ok = 1;
+    for (;;) {
+        ssize_t count = read_input(input, chunk, STREAM_CHUNK_SIZE);
+        if (count < 0) {
+            fprintf(out, "Error reading %s\n", file_name);
+            ok = 0;
+            break;
+        }
+        if (count == 0) {
+            break;
+        }
+        input->bytes_read += (uint64_t)count;
+        if (spherecas_read_bytes(state, chunk, (size_t)count) < (size_t)count) {
+            break;      // Nothing more wanted
+        }
+    }
+    free(own_chunk);
+    return ok;
+}
+
+// Demodulates a WAV recording and runs the bytes through the parser, a chunk
+// of the file at a time (mapped or not). Prints a message and returns 0 if the
+// input can't be read or isn't audio that can be decoded.
+static int parse_audio(const char * file_name,
+                       struct input_data * input,
+                       struct spherecas_state * state,
+                       FILE * out,
+                       size_t * framing_errors)
+{
+    struct kcs_decoder * decoder = malloc(sizeof(struct kcs_decoder));
+    struct audio_sink * sink = malloc(sizeof(struct audio_sink));
+    uint8_t * chunk = (input->bytes == NULL ? malloc(STREAM_CHUNK_SIZE) : NULL);
+    if (decoder == NULL || sink == NULL || (input->bytes == NULL && chunk == NULL)) {
+        fprintf(out, "Unable to allocate work buffer\n");
+        free(decoder);
+        free(sink);
+        free(chunk);
+        return 0;
+    }
+    sink->state = state;
+    sink->count = 0;
+    sink->stopped = 0;
+    kcs_begin_decode(decoder, audio_byte, sink);
+    
+    int ok = 1;
+    enum kcs_wav_result result = KCS_WAV_NEED_MORE;
+    size_t offset = 0;
+    while (!sink->stopped) {
+        const uint8_t * bytes;
+        size_t count;
+        if (input->bytes != NULL) {
+            bytes = &input->bytes[offset];
+            count = input->size - offset;
+            if (count > STREAM_CHUNK_SIZE) {
+                count = STREAM_CHUNK_SIZE;
+            }
+            offset += count;
+        } else {
+            ssize_t got = read_input(input, chunk, STREAM_CHUNK_SIZE);
+            if (got < 0) {
+                fprintf(out, "Error reading %s\n", file_name);
+                ok = 0;
+                break;
+            }
+            bytes = chunk;
+            count = (size_t)got;
+        }
+        if (count == 0) {
+            break;
+        }
+        input->bytes_read += count;
+        result = kcs_decode_bytes(decoder, bytes, count);
+        if (result != KCS_WAV_OK && result != KCS_WAV_NEED_MORE) {
+            break;
+        }
+        flush_audio(sink);
+    }
+    kcs_end_decode(decoder);
+    flush_audio(sink);
+    *framing_errors = decoder->framer.framing_errors;
+    
+    if (ok) {
+        ok = check_audio_result(file_name, result, out);
+    }
+    free(decoder);
+    free(sink);
+    free(chunk);
+    return ok;
+}
+
+static void audio_byte(void * context, uint8_t byte)
+{
+    struct audio_sink * sink = context;
+    sink->bytes[sink->count++] = byte;
+    if (sink->count == AUDIO_BATCH_SIZE) {
+        flush_audio(sink);
+    }
+}
+
+static void flush_audio(struct audio_sink * sink)
+{
+    if (!sink->stopped && sink->count > 0 &&
+        spherecas_read_bytes(sink->state, sink->bytes, sink->count) < sink->count) {
+        sink->stopped = 1;      // Nothing more wanted
+    }
+    sink->count = 0;
+}
+
+// Prints a message and returns 0 if a WAV file couldn't be decoded.
+static int check_audio_result(const char * file_name, enum kcs_wav_result result, FILE * out)
+{
+    if (result == KCS_WAV_UNSUPPORTED) {
+        fprintf(out, "%s is not in a supported audio format (8 or 16-bit PCM, mono or stereo)\n", file_name);
+        return 0;
+    } else if (result != KCS_WAV_OK) {
+        fprintf(out, "%s is not a WAV file\n", file_name);
+        return 0;
+    }
+    return 1;
+}
+
+// Reads a tape with a thread per stage; see struct pipeline. Prints a message
+// and returns 0 on failure.
+static int run_pipeline(struct tape_job * job, struct input_data * input)
+{
+    int audio = job->options->audio;
+    struct pipeline pipe;
+    memset(&pipe, 0, sizeof(pipe));
+    pipe.job = job;
+    pipe.input = input;
+    pipe.wav_result = KCS_WAV_NEED_MORE;
+    atomic_init(&pipe.cancel, 0);
+    
+    int ok = (ring_init(&pipe.bytes, 1, PIPE_BYTE_ITEMS) &&
+              ring_init(&pipe.blocks, sizeof(struct block_message), PIPE_BLOCK_ITEMS) &&
+              (!audio || (ring_init(&pipe.raw, 1, PIPE_RAW_ITEMS) &&
+                          ring_init(&pipe.runs, sizeof(struct tone_run), PIPE_RUN_ITEMS))));
+    if (!ok) {
+        fprintf(job->out, "Unable to allocate work buffer\n");
+    }
+    
+    void * (*stages[4])(void *);
+    int stage_count = 0;
+    stages[stage_count++] = pipe_read;
+    if (audio) {
+        stages[stage_count++] = pipe_demod;
+        stages[stage_count++] = pipe_frame;
+    }
+    stages[stage_count++] = pipe_parse;
+    
+    pthread_t threads[4];
+    int started = 0;
+    while (ok && started < stage_count) {
+        if (pthread_create(&threads[started], NULL, stages[started], &pipe) != 0) {
+            fprintf(job->out, "Unable to start pipeline threads\n");
+            atomic_store(&pipe.cancel, 1);
+            ok = 0;
+            break;
+        }
+        if (job->options->pin_threads) {
+            pin_thread(threads[started], started);
+        }
+        started++;
+    }
+    if (ok) {
+        pipe_output(&pipe);
+    }
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    if (started == stage_count) {
+        job->stats = pipe.stats;
+        job->framing_errors = pipe.framing_errors;
+        job->have_stats = 1;
+    }
+    
+    // Anything still queued was left behind by stopping early.
+    struct block_message message;
+    while (pipe.blocks.items != NULL && ring_try_read(&pipe.blocks, &message, 1) > 0) {
+        free(message.data);
+    }
+    
+    if (ok && pipe.out_of_memory) {
+        fprintf(job->out, "Unable to allocate work buffer\n");
+        ok = 0;
+    } else if (ok && pipe.read_failed) {
+        fprintf(job->out, "Error reading %s\n", job->input_file_name);
+        ok = 0;
+    } else if (ok && audio) {
+        ok = check_audio_result(job->input_file_name, pipe.wav_result, job->out);
+    }
+    ring_destroy(&pipe.raw);
+    ring_destroy(&pipe.runs);
+    ring_destroy(&pipe.bytes);
+    ring_destroy(&pipe.blocks);
+    return ok;
+}
+
+// Pipeline stage: reads the input, a chunk at a time.
+static void * pipe_read(void * arg)
+{
+    struct pipeline * pipe = arg;
+    struct input_data * input = pipe->input;
+    struct ring * out = (pipe->job->options->audio ? &pipe->raw : &pipe->bytes);
+    
+    if (input->bytes != NULL) {
+        size_t offset = 0;
+        while (offset < input->size) {
+            size_t count = input->size - offset;
+            if (count > STREAM_CHUNK_SIZE) {
+                count = STREAM_CHUNK_SIZE;
+            }
+            if (!ring_write(out, &input->bytes[offset], count, &pipe->cancel)) {
+                break;
+            }
+            offset += count;
+            input->bytes_read = offset;
+        }
+    } else {
+        uint8_t * chunk = malloc(STREAM_CHUNK_SIZE);
+        if (chunk == NULL) {
+            pipe->out_of_memory = 1;
+            atomic_store(&pipe->cancel, 1);
+        }
+        while (chunk != NULL) {
+            ssize_t count = read_input(input, chunk, STREAM_CHUNK_SIZE);
+            if (count < 0) {
+                pipe->read_failed = 1;
+                break;
+            }
+            if (count == 0 || !ring_write(out, chunk, (size_t)count, &pipe->cancel)) {
+                break;
+            }
+            input->bytes_read += (uint64_t)count;
+        }
+        free(chunk);
+    }
+    ring_close(out);
+    return NULL;
+}
+
+// Pipeline stage: demodulates audio into tone runs.
+static void * pipe_demod(void * arg)
+{
+    struct pipeline * pipe = arg;
+    struct kcs_decoder * decoder = malloc(sizeof(struct kcs_decoder));
+    struct run_batch * batch = malloc(sizeof(struct run_batch));
+    uint8_t * chunk = malloc(STREAM_CHUNK_SIZE);
+    if (decoder == NULL || batch == NULL || chunk == NULL) {
+        pipe->out_of_memory = 1;
+        atomic_store(&pipe->cancel, 1);
+    } else {
+        batch->pipe = pipe;
+        batch->decoder = decoder;
+        batch->count = 0;
+        kcs_begin_decode_runs(decoder, pipe_run, batch);
+        
+        enum kcs_wav_result result = KCS_WAV_NEED_MORE;
+        size_t count;
+        while ((count = ring_read(&pipe->raw, chunk, STREAM_CHUNK_SIZE, &pipe->cancel)) > 0) {
+            result = kcs_decode_bytes(decoder, chunk, count);
+            if (result != KCS_WAV_OK && result != KCS_WAV_NEED_MORE) {
+                atomic_store(&pipe->cancel, 1);
+                break;
+            }
+            flush_runs(batch);
+        }
+        kcs_end_decode(decoder);
+        flush_runs(batch);
+        pipe->wav_result = result;
+    }
+    ring_close(&pipe->runs);
+    free(decoder);
+    free(batch);
+    free(chunk);
+    return NULL;
+}
+
+static void pipe_run(void * context, int level, uint64_t duration)
+{
+    struct run_batch * batch = context;
+    batch->runs[batch->count].duration = duration;
+    batch->runs[batch->count].level = level;
+    if (++batch->count == PIPE_BATCH) {
+        flush_runs(batch);
+    }
+}
+
+static void flush_runs(struct run_batch * batch)
+{
+    if (batch->count > 0) {
+        batch->pipe->sample_rate = batch->decoder->format.sample_rate;
+        ring_write(&batch->pipe->runs, batch->runs, batch->count, &batch->pipe->cancel);
+        batch->count = 0;
+    }
+}
+
+// Pipeline stage: frames tone runs into bytes.
+static void * pipe_frame(void * arg)
+{
+    struct pipeline * pipe = arg;
+    struct byte_batch batch = { pipe, 0, { 0 } };
+    struct kcs_framer framer;
+    struct tone_run runs[PIPE_BATCH];
+    int started = 0;
+    size_t count;
+    while ((count = ring_read(&pipe->runs, runs, PIPE_BATCH, &pipe->cancel)) > 0) {
+        if (!started) {
+            kcs_framer_begin(&framer, pipe->sample_rate, pipe_byte, &batch);
+            started = 1;
+        }
+        for (size_t i = 0; i < count; i++) {
+            kcs_framer_run(&framer, runs[i].level, runs[i].duration);
+        }
+        flush_bytes(&batch);
+    }
+    if (started) {
+        pipe->framing_errors = framer.framing_errors;
+    }
+    ring_close(&pipe->bytes);
+    return NULL;
+}
+
+static void pipe_byte(void * context, uint8_t byte)
+{
+    struct byte_batch * batch = context;
+    batch->bytes[batch->count++] = byte;
+    if (batch->count == PIPE_BATCH) {
+        flush_bytes(batch);
+    }
+}
+
+static void flush_bytes(struct byte_batch * batch)
+{
+    if (batch->count > 0) {
+        ring_write(&batch->pipe->bytes, batch->bytes, batch->count, &batch->pipe->cancel);
+        batch->count = 0;
+    }
+}
+
+// Pipeline stage: parses tape bytes into blocks.
+static void * pipe_parse(void * arg)
+{
+    struct pipeline * pipe = arg;
+    uint8_t * chunk = malloc(STREAM_CHUNK_SIZE);
+    if (chunk == NULL) {
+        pipe->out_of_memory = 1;
+        atomic_store(&pipe->cancel, 1);
+    } else {
+        struct spherecas_state read_state;
+        spherecas_begin_read_callback(&read_state, pipe_block, pipe);
+        spherecas_set_options(&read_state, parser_options(pipe->job));
+        if (pipe->job->options->wanted_count > 0) {
+            spherecas_set_filter(&read_state, pipe_filter);
+        }
+        size_t count;
+        while ((count = ring_read(&pipe->bytes, chunk, STREAM_CHUNK_SIZE, &pipe->cancel)) > 0) {
+            if (spherecas_read_bytes(&read_state, chunk, count) < count) {
+                break;
+            }
+        }
+        spherecas_get_stats(&read_state, &pipe->stats);
+        spherecas_end_read(&read_state);
+        free(chunk);
+    }
+    ring_close(&pipe->blocks);
+    return NULL;
+}
+
+static int pipe_filter(struct spherecas_state * state, const char block_name[], uint32_t length)
+{
+    struct pipeline * pipe = state->context;
+    (void)length;
+    if (wanted_slot(pipe->job->options, block_name) >= 0) {
+        return 1;
+    }
+    struct block_message message = { { block_name[0], block_name[1] }, 1, NULL, 0, 0, SPHERECAS_BLOCKTYPE_TEXT, SPHERECAS_ERROR_NONE, 0,
+                                     SPHERECAS_CONTENT_UNKNOWN };
+    ring_write(&pipe->blocks, &message, 1, &pipe->cancel);
+    return 0;
+}
+
+// The parse stage's block callback: the block's data is only good until this
+// returns, so it's copied for the output stage.
+static int pipe_block(struct spherecas_state * state,
+                      char block_name[],
+                      uint8_t * data,
+                      int length,
+                      enum spherecas_blocktype type,
+                      enum spherecas_error error)
+{
+    struct pipeline * pipe = state->context;
+    struct block_message message = { { block_name[0], block_name[1] }, 0, NULL, state->block_offset, length, type, error,
+                                     state->tape_checksum, block_content(state) };
+    if (data != NULL) {
+        message.data = malloc((size_t)length);
+        if (message.data != NULL) {
+            memcpy(message.data, data, (size_t)length);
+        } else {
+            message.error = SPHERECAS_ERROR_MEMORY;
+        }
+    }
+    if (!ring_write(&pipe->blocks, &message, 1, &pipe->cancel)) {
+        free(message.data);
+        return SPHERECAS_STOP;
+    }
+    return SPHERECAS_CONTINUE;
+}
+
+// Pipeline stage, on the job's thread: reports the blocks found.
+static void pipe_output(struct pipeline * pipe)
+{
+    struct block_message message;
+    while (ring_read(&pipe->blocks, &message, 1, &pipe->cancel) > 0) {
+        if (message.skipped) {
+            pipe->job->block_index++;
+            continue;
+        }
+        int result = report_repairable(pipe->job, message.block_name, message.data, message.offset,
+                                       message.length, message.type, message.content, message.error, 0,
+                                       message.checksum);
+        free(message.data);
+        if (result == SPHERECAS_STOP) {
+            atomic_store(&pipe->cancel, 1);
+            break;
+        }
+    }
+}
+
+// Pins a pipeline stage's thread to a CPU of its own (while there are enough).
+static void pin_thread(pthread_t thread, int index)
+{
+#ifdef __linux__
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET((int)(index % (cpus > 0 ? cpus : 1)), &set);
+    pthread_setaffinity_np(thread, sizeof(set), &set);
+#else
+    (void)thread;
+    (void)index;
+#endif
+}
+
+// Prints the --stats report for a tape.
+static void print_stats(const struct tape_job * job, const struct input_data * input, double seconds)
+{
+    // An indexed input is read in whole, without a parser state to count.
+    uint64_t bytes = (job->have_stats ? input->bytes_read : input->size);
+    fprintf(job->out, "\nStatistics:\n");
+    fprintf(job->out, "  %-20s%llu bytes in %.3f s (%.1f MB/s)\n", "Input:", (unsigned long long)bytes,
+            seconds, (seconds > 0 ? bytes / seconds / 1e6 : 0.0));
+    if (!job->have_stats) {
+        fprintf(job->out, "  (No parser counters are kept when indexing.)\n");
+        return;
+    }
+    const struct spherecas_stats * stats = &job->stats;
+    if (job->options->audio) {
+        fprintf(job->out, "  %-20s%llu bytes, %zu framing error(s)\n", "Demodulated:",
+                (unsigned long long)stats->bytes_scanned, job->framing_errors);
+    }
+    fprintf(job->out, "  %-20s%llu bytes: %llu sync hunt, %llu payload, %llu header/trailer\n", "Scanned:",
+            (unsigned long long)stats->bytes_scanned, (unsigned long long)stats->sync_bytes,
+            (unsigned long long)stats->payload_bytes,
+            (unsigned long long)(stats->bytes_scanned - stats->sync_bytes - stats->payload_bytes));
+    fprintf(job->out, "  %-20s%llu started, %llu resync(s)\n", "Headers:",
+            (unsigned long long)stats->headers, (unsigned long long)stats->resyncs);
+    fprintf(job->out, "  %-20s%llu read through, largest %u bytes\n", "Blocks:",
+            (unsigned long long)stats->blocks, stats->largest_block);
+    fprintf(job->out, "  %-20s%llu trailer, %llu checksum\n", "Errors:",
+            (unsigned long long)stats->trailer_errors, (unsigned long long)stats->checksum_errors);
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void close_input(struct input_data * input)
+{
+    if (input->bytes != NULL) {
+        munmap((void *)input->bytes, input->size);
+    }
+    if (input->decompressor != NULL) {
+        decompressor_end(input->decompressor);
+        free(input->decompressor);
+    }
+    free(input->packed);
+    if (input->fd != STDIN_FILENO) {
+        close(input->fd);
+    }
+    input->decompressor = NULL;
+    input->packed = NULL;
+    input->bytes = NULL;
+    input->size = 0;
+    input->fd = -1;
+}
 
 // remove_path_extension is adapted from
 //  https://stackoverflow.com/a/2736841/73297
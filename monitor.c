@@ -0,0 +1,89 @@
+//
+//  monitor.c
+//
+//  Copyright (c) Ben Zotto 2022
+//  See LICENSE for licensing information.
+//
+
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "monitor.h"
+
+// Connections waiting to be accepted
+#define MONITOR_BACKLOG     8
+
+// A reader that has gone away mustn't bring the process down with SIGPIPE.
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL        0       // (See SO_NOSIGPIPE, below.)
+#endif
+
+int monitor_open(const char * path)
+{
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(address.sun_path, path);
+
+    struct stat st;
+    if (lstat(path, &st) == 0) {
+        if (!S_ISSOCK(st.st_mode)) {
+            errno = EEXIST;
+            return -1;
+        }
+        unlink(path);
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    if (fcntl(fd, F_SETFD, FD_CLOEXEC) != 0 ||
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) != 0 ||
+        bind(fd, (const struct sockaddr *)&address, sizeof(address)) != 0 ||
+        listen(fd, MONITOR_BACKLOG) != 0) {
+        int error = errno;
+        close(fd);
+        errno = error;
+        return -1;
+    }
+    return fd;
+}
+
+void monitor_answer(int fd, const char * report, size_t length)
+{
+    int client;
+    while ((client = accept(fd, NULL, NULL)) >= 0) {
+        fcntl(client, F_SETFL, fcntl(client, F_GETFL) | O_NONBLOCK);
+#ifdef SO_NOSIGPIPE
+        int on = 1;
+        setsockopt(client, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+        for (size_t done = 0; done < length; ) {
+            ssize_t count = send(client, &report[done], length - done, MSG_NOSIGNAL);
+            if (count < 0 && errno == EINTR) {
+                continue;
+            }
+            if (count <= 0) {
+                break;
+            }
+            done += (size_t)count;
+        }
+        close(client);
+    }
+}
+
+void monitor_close(int fd, const char * path)
+{
+    if (fd >= 0) {
+        close(fd);
+        unlink(path);
+    }
+}
@@ -0,0 +1,30 @@
+//
+//  monitor.h
+//
+//  Copyright (c) Ben Zotto 2022
+//  See LICENSE for licensing information.
+//
+//  A local (Unix domain) socket for keeping an eye on a long-running process:
+//  whatever connects to it is sent a report, and the connection is closed, so
+//  e.g. `nc -U socket` (or `socat - UNIX-CONNECT:socket`) prints it. Nothing is
+//  read from the other end, and a reader that doesn't keep up only misses out
+//  on what didn't fit in the socket's buffer; the process never waits on it.
+//
+
+#ifndef MONITOR_H
+#define MONITOR_H
+
+#include <stddef.h>
+
+// Opens a listening socket at `path` (replacing a socket left there by an
+// earlier run, but nothing else). Returns its descriptor, which is readable
+// when there's someone to answer, or -1 with errno set on failure.
+int monitor_open(const char * path);
+
+// Answers everyone waiting with `report`.
+void monitor_answer(int fd, const char * report, size_t length);
+
+// Closes the socket and removes it.
+void monitor_close(int fd, const char * path);
+
+#endif
@@ -0,0 +1,92 @@
+//
+//  repair.c
+//
+//  Copyright (c) Ben Zotto 2022
+//  See LICENSE for licensing information.
+//
+
+#include <string.h>
+#include "repair.h"
+
+// How much more (or less) likely a correction is, for each thing about it
+#define WEIGHT_SINGLE_BIT       8.0
+#define WEIGHT_MADE_TEXT        100.0   // Leaves a block 7-bit that was, but for the one byte
+#define WEIGHT_NOT_TEXT         0.05    // Puts a high bit into a block that's 7-bit
+#define WEIGHT_KEPT_HIGH        0.01    // Leaves a high bit in a block 7-bit but for one byte
+#define WEIGHT_UNPRINTABLE      0.1     // Puts a control character into 7-bit text
+#define WEIGHT_AGREED           10.0    // For each other copy that has the corrected byte
+#define WEIGHT_CONFIRMED        0.1     // For each other copy that has the byte as it is
+
+static int printable(uint8_t byte)
+{
+    return (byte >= 0x20 && byte < 0x7F) || byte == '\r' || byte == '\n' || byte == '\t';
+}
+
+void repair_search(const uint8_t * data,
+                   size_t length,
+                   uint8_t checksum,
+                   const uint8_t * const others[],
+                   size_t other_count,
+                   size_t budget,
+                   struct repair_result * result)
+{
+    memset(result, 0, sizeof(struct repair_result));
+    uint8_t sum = 0;
+    size_t high_bytes = 0;
+    for (size_t i = 0; i < length; i++) {
+        sum += data[i];
+        high_bytes += (data[i] >> 7);
+    }
+    uint8_t delta = (uint8_t)(checksum - sum);
+    if (delta == 0 || length == 0) {
+        return;
+    }
+    
+    double total = 0.0, best = -1.0;
+    size_t count = (length < budget ? length : budget);
+    for (size_t i = 0; i < count; i++) {
+        uint8_t from = data[i];
+        uint8_t to = (uint8_t)(from + delta);
+        uint8_t changed = from ^ to;
+        double weight = 1.0;
+        if ((changed & (changed - 1)) == 0) {
+            weight *= WEIGHT_SINGLE_BIT;
+        }
+        // Would the corrected block be 7-bit, so probably text?
+        size_t corrected_high = high_bytes - (from >> 7) + (to >> 7);
+        if (corrected_high == 0) {
+            if (high_bytes > 0) {
+                weight *= WEIGHT_MADE_TEXT;
+            }
+            if (!printable(to)) {
+                weight *= WEIGHT_UNPRINTABLE;
+            }
+        } else if (high_bytes == 0) {
+            weight *= WEIGHT_NOT_TEXT;
+        } else if (high_bytes == 1) {
+            // Most likely text with the one stray bit somewhere else; unless
+            // this is hard to beat, every other byte of a long block adds up
+            // to more than the one that would fix it.
+            weight *= WEIGHT_KEPT_HIGH;
+        }
+        for (size_t k = 0; k < other_count; k++) {
+            if (others[k][i] == to) {
+                weight *= WEIGHT_AGREED;
+            } else if (others[k][i] == from) {
+                weight *= WEIGHT_CONFIRMED;
+            }
+        }
+        total += weight;
+        if (weight > best) {
+            best = weight;
+            result->position = (uint32_t)i;
+            result->from = from;
+            result->to = to;
+            result->single_bit = ((changed & (changed - 1)) == 0);
+        }
+    }
+    result->found = 1;
+    result->confidence = best / total;
+    result->tried = count;
+    result->cut_short = (count < length);
+}
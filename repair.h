@@ -0,0 +1,56 @@
+//
+//  repair.h
+//
+//  Copyright (c) Ben Zotto 2022
+//  See LICENSE for licensing information.
+//
+//  A search for the correction that would fix a block that failed its checksum,
+//  for the common case of a single damaged byte (very often a single dropped or
+//  flipped bit). As the checksum is a plain 8-bit sum, how far off it is says
+//  exactly what a damaged byte must have been: for each position there is just
+//  the one value to try, so the search is a single pass over the payload. Every
+//  position has a correction that fits the checksum, though, so they're weighed
+//  against each other by how likely each one is:
+//     - A single-bit change is much more likely than any other.
+//     - One that leaves the block 7-bit text, when that's all that stood in the
+//       way, is likely; one that puts a high bit into 7-bit text, or a control
+//       character, is unlikely, and one that leaves a stray high bit in text
+//       that's 7-bit but for it, more unlikely still.
+//     - Where other copies of the block (from other captures of the tape) are
+//       to hand, each that agrees with a correction makes it far more likely,
+//       and each that has the byte as it is, far less.
+//  The best correction's confidence is its share of the weight of them all.
+//
+
+#ifndef REPAIR_H
+#define REPAIR_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Positions tried at most, by default (enough for any block)
+#define REPAIR_DEFAULT_BUDGET   0x10000
+
+struct repair_result {
+    int             found;          // There's a correction (there isn't, if the checksum matches)
+    uint32_t        position;       // The best one: this byte...
+    uint8_t         from;
+    uint8_t         to;             // ...becomes this
+    int             single_bit;
+    double          confidence;     // 0 to 1
+    size_t          tried;          // Positions tried
+    int             cut_short;      // The budget ran out before all of them were
+};
+
+// Searches for the single-byte correction to `data` that's most likely to make
+// it match `checksum` (the sum read off the tape), trying at most `budget`
+// positions. `others` are other copies of the same block, if any.
+void repair_search(const uint8_t * data,
+                   size_t length,
+                   uint8_t checksum,
+                   const uint8_t * const others[],
+                   size_t other_count,
+                   size_t budget,
+                   struct repair_result * result);
+
+#endif
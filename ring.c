@@ -0,0 +1,149 @@
+//
+//  ring.c
+//
+//  Copyright (c) Ben Zotto 2022
+//  See LICENSE for licensing information.
+//
+
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <time.h>
+#include "ring.h"
+
+// Waiting spins (yielding the CPU) this many times before it starts to sleep,
+// which keeps hand-offs quick when both sides are busy without burning a core
+// when one side is idle for a long time.
+#define RING_SPINS          64
+#define RING_SLEEP_NS       50000
+
+int ring_init(struct ring * ring, size_t item_size, size_t capacity)
+{
+    size_t size = 1;
+    while (size < capacity) {
+        size <<= 1;
+    }
+    ring->items = malloc(size * item_size);
+    if (ring->items == NULL) {
+        return 0;
+    }
+    ring->item_size = item_size;
+    ring->mask = size - 1;
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    atomic_init(&ring->closed, 0);
+    return 1;
+}
+
+void ring_destroy(struct ring * ring)
+{
+    free(ring->items);
+    ring->items = NULL;
+}
+
+// Copies `count` items between a ring's storage, starting at index `at`, and a
+// flat buffer, in up to two pieces around the end of the storage.
+static void copy_items(const struct ring * ring, size_t at, void * buffer, size_t count, int into_ring)
+{
+    size_t start = at & ring->mask;
+    size_t first = ring->mask + 1 - start;
+    if (first > count) {
+        first = count;
+    }
+    uint8_t * slots = &ring->items[start * ring->item_size];
+    uint8_t * flat = buffer;
+    if (into_ring) {
+        memcpy(slots, flat, first * ring->item_size);
+        memcpy(ring->items, &flat[first * ring->item_size], (count - first) * ring->item_size);
+    } else {
+        memcpy(flat, slots, first * ring->item_size);
+        memcpy(&flat[first * ring->item_size], ring->items, (count - first) * ring->item_size);
+    }
+}
+
+size_t ring_try_write(struct ring * ring, const void * items, size_t count)
+{
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    size_t room = ring->mask + 1 - (head - tail);
+    if (count > room) {
+        count = room;
+    }
+    if (count > 0) {
+        copy_items(ring, head, (void *)items, count, 1);
+        atomic_store_explicit(&ring->head, head + count, memory_order_release);
+    }
+    return count;
+}
+
+size_t ring_try_read(struct ring * ring, void * items, size_t count)
+{
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    if (count > head - tail) {
+        count = head - tail;
+    }
+    if (count > 0) {
+        copy_items(ring, tail, items, count, 0);
+        atomic_store_explicit(&ring->tail, tail + count, memory_order_release);
+    }
+    return count;
+}
+
+static void ring_wait(unsigned * spins)
+{
+    if (++*spins < RING_SPINS) {
+        sched_yield();
+    } else {
+        struct timespec pause = { 0, RING_SLEEP_NS };
+        nanosleep(&pause, NULL);
+    }
+}
+
+static int cancelled(const atomic_int * cancel)
+{
+    return (cancel != NULL && atomic_load_explicit(cancel, memory_order_relaxed));
+}
+
+int ring_write(struct ring * ring, const void * items, size_t count, const atomic_int * cancel)
+{
+    const uint8_t * next = items;
+    unsigned spins = 0;
+    while (count > 0) {
+        size_t written = ring_try_write(ring, next, count);
+        next += written * ring->item_size;
+        count -= written;
+        if (written > 0) {
+            spins = 0;
+        } else if (cancelled(cancel)) {
+            return 0;
+        } else {
+            ring_wait(&spins);
+        }
+    }
+    return 1;
+}
+
+size_t ring_read(struct ring * ring, void * items, size_t count, const atomic_int * cancel)
+{
+    unsigned spins = 0;
+    for (;;) {
+        size_t got = ring_try_read(ring, items, count);
+        if (got > 0) {
+            return got;
+        }
+        if (atomic_load_explicit(&ring->closed, memory_order_acquire)) {
+            // Anything written before the close is visible now.
+            return ring_try_read(ring, items, count);
+        }
+        if (cancelled(cancel)) {
+            return 0;
+        }
+        ring_wait(&spins);
+    }
+}
+
+void ring_close(struct ring * ring)
+{
+    atomic_store_explicit(&ring->closed, 1, memory_order_release);
+}
@@ -0,0 +1,53 @@
+//
+//  ring.h
+//
+//  Copyright (c) Ben Zotto 2022
+//  See LICENSE for licensing information.
+//
+//  A bounded single-producer, single-consumer queue of fixed size items, for
+//  passing work between two threads without locks. One thread may only write
+//  to a ring, and one other thread only read from it. Items are copied in and
+//  out in batches; the writer closes the ring when it has nothing more to send.
+//
+//  The try functions never wait. The others wait (spinning briefly, then
+//  sleeping) for room or for items, which is what bounds the memory a pipeline
+//  of rings can use: a fast stage is held back by a slow one after it. While
+//  waiting, they give up if the `cancel` flag (which may be NULL) gets set.
+//
+
+#ifndef RING_H
+#define RING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+#define RING_CACHE_LINE     64
+
+struct ring {
+    // The writer and reader each own one index, kept on separate cache lines
+    // so they don't contend.
+    _Alignas(RING_CACHE_LINE) atomic_size_t head;   // Items written (by the writer)
+    _Alignas(RING_CACHE_LINE) atomic_size_t tail;   // Items read (by the reader)
+    _Alignas(RING_CACHE_LINE) atomic_int closed;
+    uint8_t *       items;
+    size_t          item_size;
+    size_t          mask;                           // Capacity (a power of two), less one
+};
+
+// Capacity is rounded up to a power of two. Returns 0 if out of memory.
+int ring_init(struct ring * ring, size_t item_size, size_t capacity);
+void ring_destroy(struct ring * ring);
+
+size_t ring_try_write(struct ring * ring, const void * items, size_t count);
+size_t ring_try_read(struct ring * ring, void * items, size_t count);
+
+// Writes all of the items. Returns 0 if cancelled first.
+int ring_write(struct ring * ring, const void * items, size_t count, const atomic_int * cancel);
+// Reads up to `count` items, waiting for at least one. Returns 0 once the ring
+// is closed and empty, or if cancelled.
+size_t ring_read(struct ring * ring, void * items, size_t count, const atomic_int * cancel);
+
+void ring_close(struct ring * ring);
+
+#endif
@@ -0,0 +1,216 @@
+//
+//  serial.c
+//
+//  Copyright (c) Ben Zotto 2022
+//  See LICENSE for licensing information.
+//
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <poll.h>
+#include <unistd.h>
+#include "serial.h"
+
+// How much is read at once (at most)
+#define SERIAL_CHUNK_SIZE   0x10000
+
+// What a serial read last said about the block coming in.
+struct serial_report {
+    int             block;          // Block number (-1 before the first)
+    uint32_t        received;
+    double          time;
+};
+
+struct serial_speed {
+    long            baud;
+    speed_t         speed;
+};
+
+static const struct serial_speed speeds[] = {
+    { 300, B300 },
+    { 600, B600 },
+    { 1200, B1200 },
+    { 2400, B2400 },
+    { 4800, B4800 },
+    { 9600, B9600 },
+    { 19200, B19200 },
+    { 38400, B38400 },
+#ifdef B57600
+    { 57600, B57600 },
+#endif
+#ifdef B115200
+    { 115200, B115200 },
+#endif
+#ifdef B230400
+    { 230400, B230400 },
+#endif
+};
+
+static int find_speed(long baud, speed_t * speed)
+{
+    for (size_t i = 0; i < sizeof(speeds) / sizeof(speeds[0]); i++) {
+        if (speeds[i].baud == baud) {
+            *speed = speeds[i].speed;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int serial_speed_supported(long baud)
+{
+    speed_t speed;
+    return find_speed(baud, &speed);
+}
+
+int serial_configure(int fd, long baud, struct termios * saved)
+{
+    if (tcgetattr(fd, saved) != 0) {
+        return 0;
+    }
+    struct termios raw = *saved;
+    cfmakeraw(&raw);
+    // Ignore the modem control lines, and have reads return whatever has
+    // arrived (nothing, if nothing has) rather than wait for some minimum.
+    raw.c_cflag |= CLOCAL | CREAD;
+    raw.c_cc[VMIN] = 0;
+    raw.c_cc[VTIME] = 0;
+    if (baud != 0) {
+        speed_t speed;
+        if (!find_speed(baud, &speed)) {
+            errno = EINVAL;
+            return 0;
+        }
+        cfsetispeed(&raw, speed);
+        cfsetospeed(&raw, speed);
+    }
+    if (tcsetattr(fd, TCSANOW, &raw) != 0) {
+        return 0;
+    }
+    int flags = fcntl(fd, F_GETFL);
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) != 0) {
+        int error = errno;
+        tcsetattr(fd, TCSANOW, saved);
+        errno = error;
+        return 0;
+    }
+    return 1;
+}
+
+void serial_restore(int fd, const struct termios * saved)
+{
+    tcsetattr(fd, TCSANOW, saved);
+    int flags = fcntl(fd, F_GETFL);
+    if (flags >= 0) {
+        fcntl(fd, F_SETFL, flags & ~O_NONBLOCK);
+    }
+}
+
+static void report_progress(const struct serial_reader * reader, struct serial_report * report);
+static double serial_now(void);
+
+int serial_read(const struct serial_reader * reader)
+{
+    struct termios saved;
+    if (!serial_configure(reader->fd, reader->baud, &saved)) {
+        if (errno == ENOTTY) {
+            fprintf(reader->out, "%s isn't a serial device\n", reader->file_name);
+        } else {
+            fprintf(reader->out, "Unable to set up %s: %s\n", reader->file_name, strerror(errno));
+        }
+        return 0;
+    }
+    uint8_t * chunk = malloc(SERIAL_CHUNK_SIZE);
+    if (chunk == NULL) {
+        fprintf(reader->out, "Unable to allocate work buffer\n");
+        serial_restore(reader->fd, &saved);
+        return 0;
+    }
+
+    fprintf(reader->out, "(Reading from %s until interrupted)\n", reader->file_name);
+    fflush(reader->out);
+    int ok = 1;
+    struct spherecas_state * state = reader->state;
+    struct serial_report report = { -1, 0, 0.0 };
+    struct pollfd poll_fd = { reader->fd, POLLIN, 0 };
+    while (!*reader->stopped && reader->more_wanted(reader->context)) {
+        int ready = poll(&poll_fd, 1, SERIAL_POLL_MS);
+        if (ready < 0 && errno != EINTR) {
+            fprintf(reader->out, "Error reading %s\n", reader->file_name);
+            ok = 0;
+            break;
+        }
+        if (ready > 0) {
+            ssize_t count = read(reader->fd, chunk, SERIAL_CHUNK_SIZE);
+            if (count < 0 && errno == EIO) {
+                count = 0;
+                poll_fd.revents |= POLLHUP;
+            }
+            if (count < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                fprintf(reader->out, "Error reading %s\n", reader->file_name);
+                ok = 0;
+                break;
+            }
+            if (count == 0 && (poll_fd.revents & (POLLHUP | POLLERR))) {
+                fprintf(reader->out, "(%s hung up)\n", reader->file_name);
+                break;
+            }
+            if (count > 0) {
+                int blocks = *reader->blocks_counted;
+                spherecas_read_bytes(state, chunk, (size_t)count);
+                if (*reader->blocks_counted != blocks) {
+                    fflush(reader->out);
+                }
+            }
+        }
+        report_progress(reader, &report);
+    }
+    char block_name[2];
+    uint32_t received, expected;
+    if (spherecas_block_progress(state, block_name, &received, &expected)) {
+        fprintf(reader->out, "(Stopped partway through block %d, %c%c: %u of %u bytes received)\n",
+                *reader->blocks_counted + (state->skipping ? 0 : 1), block_name[0], block_name[1], received, expected);
+    }
+    serial_restore(reader->fd, &saved);
+    free(chunk);
+    return ok;
+}
+
+// Reports on the block coming in, if there is one: as soon as its header is
+// in, then every SERIAL_PROGRESS_SECONDS while more arrives.
+static void report_progress(const struct serial_reader * reader, struct serial_report * report)
+{
+    const struct spherecas_state * state = reader->state;
+    char block_name[2];
+    uint32_t received, expected;
+    if (!spherecas_block_progress(state, block_name, &received, &expected)) {
+        return;
+    }
+    // (A block that's being skipped has been counted already.)
+    int block = *reader->blocks_counted - (state->skipping ? 1 : 0);
+    double time = serial_now();
+    if (report->block != block) {
+        fprintf(reader->out, "(Block %d, %c%c: header seen, %u of %u bytes received%s)\n",
+                block + 1, block_name[0], block_name[1], received, expected,
+                state->skipping ? "; skipping it" : "");
+        report->block = block;
+    } else if (received != report->received && time - report->time >= SERIAL_PROGRESS_SECONDS) {
+        fprintf(reader->out, "(Block %d, %c%c: %u of %u bytes received)\n",
+                block + 1, block_name[0], block_name[1], received, expected);
+    } else {
+        return;
+    }
+    report->received = received;
+    report->time = time;
+    fflush(reader->out);
+}
+
+static double serial_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
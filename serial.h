@@ -0,0 +1,62 @@
+//
+//  serial.h
+//
+//  Copyright (c) Ben Zotto 2022
+//  See LICENSE for licensing information.
+//
+//  Setting up a serial port (or any terminal device) to read a tape from live:
+//  raw mode, so that every byte comes through as it arrives, untranslated, and
+//  non-blocking, so that the reader can wait for input with poll() and keep
+//  an eye on other things (progress, interruptions) meanwhile.
+//
+//  And reading a tape from one (--serial): bytes go to the parser as soon as
+//  they arrive, each block is reported the moment it's complete, and there are
+//  progress reports on the way (when a block's header comes in, then every so
+//  often as its payload does), so that a bad read can be spotted and abandoned
+//  early.
+//
+
+#ifndef SERIAL_H
+#define SERIAL_H
+
+#include <stdio.h>
+#include <signal.h>
+#include <termios.h>
+#include "spherecas.h"
+
+// How long a serial read waits for input before looking up, and how often it
+// reports on a block that's coming in.
+#define SERIAL_POLL_MS      100
+#define SERIAL_PROGRESS_SECONDS 1.0
+
+// Whether a line speed (in bits per second) can be set on this system.
+int serial_speed_supported(long baud);
+
+// Puts an open terminal device into raw, non-blocking mode, at `baud` bits per
+// second (or at whatever speed it's at already, if `baud` is 0). Its settings
+// before are kept in `saved`. Returns 0, with errno set, on failure (ENOTTY if
+// it isn't a terminal at all).
+int serial_configure(int fd, long baud, struct termios * saved);
+
+// Puts a device's settings back as they were.
+void serial_restore(int fd, const struct termios * saved);
+
+struct serial_reader {
+    const char *    file_name;      // The device,
+    int             fd;             // ...open for reading
+    long            baud;           // (0 to leave it at its speed)
+    FILE *          out;            // Messages and progress reports go here
+    volatile sig_atomic_t * stopped; // Set (by a signal handler) to stop
+    struct spherecas_state * state; // The parser, whose callback reports the blocks
+    // Whether there are more blocks to read for (not every one asked for is in yet).
+    int             (*more_wanted)(void * context);
+    void *          context;
+    const int *     blocks_counted; // Kept up by the callback
+};
+
+// Reads a tape from a serial device until `*stopped` is set, the line hangs up,
+// or no more blocks are wanted, setting the device up first and putting it back
+// as it was afterwards. Prints a message, and returns 0, on failure.
+int serial_read(const struct serial_reader * reader);
+
+#endif
@@ -0,0 +1,172 @@
+//
+//  sidecar.c
+//
+//  Copyright (c) Ben Zotto 2022
+//  See LICENSE for licensing information.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "spherecas.h"
+#include "sidecar.h"
+
+#define SIDECAR_MAGIC           "S2BINDX1"
+#define SIDECAR_EXTENSION       ".index"
+#define SIDECAR_HEADER_SIZE     40
+#define SIDECAR_ENTRY_SIZE      24
+
+static void put_le(uint8_t * bytes, uint64_t value, int size)
+{
+    for (int i = 0; i < size; i++) {
+        bytes[i] = (uint8_t)(value >> (8 * i));
+    }
+}
+
+static uint64_t get_le(const uint8_t * bytes, int size)
+{
+    uint64_t value = 0;
+    for (int i = size - 1; i >= 0; i--) {
+        value = (value << 8) | bytes[i];
+    }
+    return value;
+}
+
+char * sidecar_name(const char * input_file_name)
+{
+    size_t size = strlen(input_file_name) + sizeof(SIDECAR_EXTENSION);
+    char * name = malloc(size);
+    if (name != NULL) {
+        snprintf(name, size, "%s%s", input_file_name, SIDECAR_EXTENSION);
+    }
+    return name;
+}
+
+uint64_t sidecar_hash(const uint8_t * data, size_t length)
+{
+    uint64_t hash = 0xCBF29CE484222325ULL;
+    for (size_t i = 0; i < length; i++) {
+        hash = (hash ^ data[i]) * 0x100000001B3ULL;
+    }
+    return hash;
+}
+
+static void encode_header(uint8_t header[SIDECAR_HEADER_SIZE], const struct sidecar_key * key, size_t count)
+{
+    memcpy(header, SIDECAR_MAGIC, 8);
+    put_le(&header[8], key->size, 8);
+    put_le(&header[16], (uint64_t)key->mtime_sec, 8);
+    put_le(&header[24], key->mtime_nsec, 4);
+    put_le(&header[28], key->mode, 4);
+    put_le(&header[32], count, 4);
+    put_le(&header[36], 0, 4);
+}
+
+int sidecar_write(const char * file_name,
+                  const struct sidecar_key * key,
+                  const struct sidecar_entry * entries,
+                  size_t count)
+{
+    if (count > UINT32_MAX) {
+        return 0;
+    }
+
+    // Written to the side and renamed into place, so that a reader never sees
+    // half of one.
+    size_t temp_size = strlen(file_name) + 8;
+    char * temp_name = malloc(temp_size);
+    if (temp_name == NULL) {
+        return 0;
+    }
+    snprintf(temp_name, temp_size, "%s.tmp", file_name);
+    FILE * file = fopen(temp_name, "wb");
+    if (file == NULL) {
+        free(temp_name);
+        return 0;
+    }
+
+    uint8_t header[SIDECAR_HEADER_SIZE];
+    encode_header(header, key, count);
+    int ok = (fwrite(header, 1, sizeof(header), file) == sizeof(header));
+    for (size_t i = 0; ok && i < count; i++) {
+        const struct sidecar_entry * entry = &entries[i];
+        uint8_t bytes[SIDECAR_ENTRY_SIZE];
+        put_le(&bytes[0], entry->offset, 8);
+        put_le(&bytes[8], entry->hash, 8);
+        put_le(&bytes[16], entry->length, 4);
+        bytes[20] = (uint8_t)entry->block_name[0];
+        bytes[21] = (uint8_t)entry->block_name[1];
+        bytes[22] = entry->error;
+        bytes[23] = entry->flags;
+        ok = (fwrite(bytes, 1, sizeof(bytes), file) == sizeof(bytes));
+    }
+    if (fclose(file) != 0) {
+        ok = 0;
+    }
+    if (ok) {
+        ok = (rename(temp_name, file_name) == 0);
+    }
+    if (!ok) {
+        remove(temp_name);
+    }
+    free(temp_name);
+    return ok;
+}
+
+int sidecar_read(const char * file_name,
+                 const struct sidecar_key * key,
+                 struct sidecar_entry ** entries,
+                 size_t * count)
+{
+    FILE * file = fopen(file_name, "rb");
+    if (file == NULL) {
+        return 0;
+    }
+
+    // The header must match the one that would be written for this input, but
+    // for the count.
+    uint8_t header[SIDECAR_HEADER_SIZE], expected[SIDECAR_HEADER_SIZE];
+    if (fread(header, 1, sizeof(header), file) != sizeof(header)) {
+        fclose(file);
+        return 0;
+    }
+    size_t entry_count = (size_t)get_le(&header[32], 4);
+    encode_header(expected, key, entry_count);
+    if (memcmp(header, expected, sizeof(header)) != 0) {
+        fclose(file);
+        return 0;
+    }
+
+    struct sidecar_entry * found = malloc((entry_count + 1) * sizeof(struct sidecar_entry));
+    int ok = (found != NULL);
+    for (size_t i = 0; ok && i < entry_count; i++) {
+        uint8_t bytes[SIDECAR_ENTRY_SIZE];
+        if (fread(bytes, 1, sizeof(bytes), file) != sizeof(bytes)) {
+            ok = 0;
+            break;
+        }
+        struct sidecar_entry * entry = &found[i];
+        entry->offset = get_le(&bytes[0], 8);
+        entry->hash = get_le(&bytes[8], 8);
+        entry->length = (uint32_t)get_le(&bytes[16], 4);
+        entry->block_name[0] = (char)bytes[20];
+        entry->block_name[1] = (char)bytes[21];
+        entry->error = bytes[22];
+        entry->flags = bytes[23];
+        // Every block must lie within the input, and so must the checksum
+        // after the ETB of one that failed it (which is read for a repair).
+        uint64_t after = (entry->error == SPHERECAS_ERROR_CHECKSUM ? 2 : 0);
+        if (entry->offset > key->size || entry->length > key->size - entry->offset ||
+            after > key->size - entry->offset - entry->length) {
+            ok = 0;
+        }
+    }
+    fclose(file);
+    if (!ok) {
+        free(found);
+        return 0;
+    }
+    *entries = found;
+    *count = entry_count;
+    return 1;
+}
@@ -0,0 +1,69 @@
+//
+//  sidecar.h
+//
+//  Copyright (c) Ben Zotto 2022
+//  See LICENSE for licensing information.
+//
+//  Block index "sidecar" files. A sidecar records where each block reported for
+//  an input tape file lies (name, payload offset and length, type, error, and a
+//  hash of the payload), so later runs can go straight to the blocks without
+//  scanning the tape again. It's keyed by the input's size and modification
+//  time, and by the reading mode it was made with, and is simply ignored once
+//  any of those no longer match.
+//
+//  The file is a header followed by one fixed size entry per block, all little
+//  endian:
+//     - Magic "S2BINDX1"
+//     - Input size (8 bytes), modification time (8 bytes seconds, 4 bytes
+//       nanoseconds), mode (4 bytes), entry count (4 bytes), reserved (4 bytes)
+//     - Entries: payload offset (8), payload hash (8), length (4), name (2),
+//       error (1), flags (1)
+//
+
+#ifndef SIDECAR_H
+#define SIDECAR_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Entry flags
+#define SIDECAR_OBJECT      0x01    // The block's type is object code
+#define SIDECAR_SHADOWED    0x02    // Reported as shadowed
+#define SIDECAR_NO_DATA     0x04    // Reported without data
+
+struct sidecar_key {
+    uint64_t        size;
+    int64_t         mtime_sec;
+    uint32_t        mtime_nsec;
+    uint32_t        mode;           // Whatever changes which blocks are reported
+};
+
+struct sidecar_entry {
+    uint64_t        offset;
+    uint64_t        hash;
+    uint32_t        length;
+    char            block_name[2];
+    uint8_t         error;
+    uint8_t         flags;
+};
+
+// The sidecar's file name for an input file (to be freed by the caller).
+char * sidecar_name(const char * input_file_name);
+
+// Hash of a block's payload (64-bit FNV-1a).
+uint64_t sidecar_hash(const uint8_t * data, size_t length);
+
+// Writes a sidecar, replacing any old one all at once. Returns 0 on failure.
+int sidecar_write(const char * file_name,
+                  const struct sidecar_key * key,
+                  const struct sidecar_entry * entries,
+                  size_t count);
+
+// Reads a sidecar in, if there is one and it matches the key. Returns 0 if
+// not (and then there is nothing to free).
+int sidecar_read(const char * file_name,
+                 const struct sidecar_key * key,
+                 struct sidecar_entry ** entries,
+                 size_t * count);
+
+#endif
@@ -5,6 +5,8 @@
 //  See LICENSE for licensing information.
 //
 
+#include <stdlib.h>
+#include <string.h>
 #include "spherecas.h"
 
 #define HEADER_SYNC     0x16
@@ -23,20 +25,341 @@ enum spherecas_read_state {
     READ_CHECKSUM
 };
 
-void spherecas_begin_read(struct spherecas_state * state)
+// The options that leave work out, each combination of which has a read_bytes
+// loop of its own (as does each with SPHERECAS_OPTION_FEATURES, which adds it).
+#define OPTIONS_LESS_WORK   (SPHERECAS_OPTION_NO_PAYLOAD | SPHERECAS_OPTION_NO_CHECKSUM | SPHERECAS_OPTION_NO_TYPE)
+
+#if defined(__GNUC__) || defined(__clang__)
+#define ALWAYS_INLINE   inline __attribute__((always_inline))
+#else
+#define ALWAYS_INLINE   inline
+#endif
+
+// Accumulates the 8-bit checksum and the OR of all of the byte values across a
+// run of payload data. The bulk of the run is handled eight bytes at a time with
+// lane-wise (carry-free) byte addition in a 64-bit word, which is as good as
+// SIMD for this and needs nothing beyond portable C. `options` (a constant,
+// where it's inlined) leaves out whichever isn't needed.
+#define LANES_LOW7      0x7F7F7F7F7F7F7F7FULL
+#define LANES_HIGH      0x8080808080808080ULL
+
+static ALWAYS_INLINE void scan_payload(const uint8_t * data,
+                                       size_t count,
+                                       uint8_t * sum,
+                                       uint8_t * bits,
+                                       const unsigned options)
+{
+    const int want_sum = !(options & SPHERECAS_OPTION_NO_CHECKSUM);
+    const int want_bits = !(options & SPHERECAS_OPTION_NO_TYPE);
+    if (!want_sum && !want_bits) {
+        return;
+    }
+    uint64_t lane_sum = 0, lane_bits = 0;
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        uint64_t word;
+        memcpy(&word, &data[i], sizeof(word));
+        if (want_sum) {
+            lane_sum = ((lane_sum & LANES_LOW7) + (word & LANES_LOW7)) ^ ((lane_sum ^ word) & LANES_HIGH);
+        }
+        if (want_bits) {
+            lane_bits |= word;
+        }
+    }
+    uint8_t s = 0, b = 0;
+    for (int lane = 0; lane < 8; lane++) {
+        s += (uint8_t)(lane_sum >> (lane * 8));
+        b |= (uint8_t)(lane_bits >> (lane * 8));
+    }
+    for (; i < count; i++) {
+        s += data[i];
+        b |= data[i];
+    }
+    if (want_sum) {
+        *sum += s;
+    }
+    if (want_bits) {
+        *bits |= b;
+    }
+}
+
+// The 6800 opcodes that count towards `opcodes` in the content features: the
+// commonest in typical code (its loads, stores, branches and calls). At 22 of
+// 256 values, they're under 9% of random bytes.
+static const uint8_t CommonOpcodes[] = {
+    0x08,                               // INX
+    0x20, 0x26, 0x27,                   // BRA, BNE, BEQ
+    0x39,                               // RTS
+    0x4F,                               // CLRA
+    0x7E,                               // JMP extended
+    0x81, 0x86,                         // CMPA, LDAA immediate
+    0x8D,                               // BSR
+    0x96, 0x97,                         // LDAA, STAA direct
+    0xA6, 0xA7,                         // LDAA, STAA indexed
+    0xB6, 0xB7,                         // LDAA, STAA extended
+    0xBD,                               // JSR extended
+    0xCE, 0xDE, 0xDF,                   // LDX immediate, LDX, STX direct
+    0xFE, 0xFF                          // LDX, STX extended
+};
+
+#define IS_LINE_END(byte)   ((byte) == '\r' || (byte) == '\n')
+#define IS_DIGIT(byte)      ((uint8_t)((byte) - '0') < 10)
+
+// Runs at least this long are counted into several histograms at once (and
+// added up after), so that a run of the same value doesn't have each count
+// wait on the one before it.
+#define FEATURES_SPLIT_RUN  1024
+
+#define LANES_ONE       0x0101010101010101ULL
+
+// Lane-wise tests on a word of payload, each giving the high bit of every lane
+// that passes (exactly; no carries cross between lanes).
+static ALWAYS_INLINE uint64_t lanes_equal(uint64_t word, uint8_t value)
+{
+    uint64_t diff = word ^ (LANES_ONE * value);
+    return ~(((diff & LANES_LOW7) + LANES_LOW7) | diff) & LANES_HIGH;
+}
+
+static ALWAYS_INLINE uint64_t lanes_digit(uint64_t word)
+{
+    // High nibble 3, and low nibble under 10 (so adding 6 leaves its bit 4 clear).
+    uint64_t low_ok = ~(((word & 0x0F0F0F0F0F0F0F0FULL) + 0x0606060606060606ULL) << 3) & LANES_HIGH;
+    return lanes_equal(word & 0xF0F0F0F0F0F0F0F0ULL, 0x30) & low_ok;
+}
+
+// Moves each lane's high bit to the lane holding the byte after it in memory,
+// with `carry` (0 or 1) into that of the first; and gets that of the last.
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define LANES_AFTER(lanes, carry)   (((lanes) >> 8) | ((uint64_t)(carry) << 63))
+#define LANES_LAST(lanes)           ((int)((lanes) >> 7) & 1)
+#else
+#define LANES_AFTER(lanes, carry)   (((lanes) << 8) | ((uint64_t)(carry) << 7))
+#define LANES_LAST(lanes)           ((int)((lanes) >> 63))
+#endif
+
+// How many lanes have their high bit set.
+static ALWAYS_INLINE uint32_t count_lanes(uint64_t lanes)
+{
+    return (uint32_t)(((lanes >> 7) * LANES_ONE) >> 56);
+}
+
+static ALWAYS_INLINE void histogram_run(uint32_t * const histograms[4],
+                                        const uint8_t * data,
+                                        size_t count,
+                                        int * line_start,
+                                        uint32_t * numbered)
+{
+    int start = *line_start;
+    uint32_t lines = 0;
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        uint64_t word;
+        memcpy(&word, &data[i], sizeof(word));
+        for (int lane = 0; lane < 8; lane++) {
+            histograms[lane & 3][(uint8_t)(word >> (lane * 8))]++;
+        }
+        // A line starts in the byte after each line end (and in the first, if
+        // the word before ended with one).
+        uint64_t ends = lanes_equal(word, '\r') | lanes_equal(word, '\n');
+        lines += count_lanes(lanes_digit(word) & LANES_AFTER(ends, start));
+        start = LANES_LAST(ends);
+    }
+    for (; i < count; i++) {
+        histograms[0][data[i]]++;
+        lines += (start & IS_DIGIT(data[i]));
+        start = IS_LINE_END(data[i]);
+    }
+    *line_start = start;
+    *numbered += lines;
+}
+
+// Adds a run of payload to the content features' counts. (The lane-wise trick
+// of scan_payload doesn't work for a histogram, but it's read a word at a time
+// just the same.)
+static void count_features(struct spherecas_features * features, const uint8_t * data, size_t count)
+{
+    if (count == 0) {
+        return;
+    }
+    int line_start = (features->count == 0 || IS_LINE_END(features->last));
+    if (count < FEATURES_SPLIT_RUN) {
+        uint32_t * const histograms[4] = {
+            features->histogram, features->histogram, features->histogram, features->histogram
+        };
+        histogram_run(histograms, data, count, &line_start, &features->numbered_lines);
+    } else {
+        uint32_t split[3][256] = { { 0 } };
+        uint32_t * const histograms[4] = { features->histogram, split[0], split[1], split[2] };
+        histogram_run(histograms, data, count, &line_start, &features->numbered_lines);
+        for (int value = 0; value < 256; value++) {
+            features->histogram[value] += split[0][value] + split[1][value] + split[2][value];
+        }
+    }
+    features->count += (uint32_t)count;
+    features->last = data[count - 1];
+}
+
+// Works out the rest of the content features from the histogram.
+static void summarize_features(struct spherecas_features * features)
+{
+    const uint32_t * histogram = features->histogram;
+    uint32_t printable = 0, high_bit = 0, opcodes = 0;
+    for (int value = 0x20; value < 0x7F; value++) {
+        printable += histogram[value];
+    }
+    for (int value = 0x80; value < 0x100; value++) {
+        high_bit += histogram[value];
+    }
+    for (size_t i = 0; i < sizeof(CommonOpcodes); i++) {
+        opcodes += histogram[CommonOpcodes[i]];
+    }
+    features->printable = printable;
+    features->high_bit = high_bit;
+    features->carriage_returns = histogram['\r'];
+    features->line_feeds = histogram['\n'];
+    features->opcodes = opcodes;
+}
+
+// Get ready for the next block, leaving the caller's options alone.
+static void reset_block(struct spherecas_state * state)
 {
     state->read_state = READ_SYNC;
     state->data_count_expected = 0;
     state->data_count_read = 0;
+    state->payload = state->data;
+    state->data_offset = -1;
+    state->block_offset = 0;
     state->checksum = 0;
+    state->tape_checksum = 0;
     state->block_type = SPHERECAS_BLOCKTYPE_TEXT;
+    state->skipping = 0;
+}
+
+static void * default_realloc(void * context, void * ptr, size_t size)
+{
+    (void)context;
+    if (size == 0) {
+        free(ptr);
+        return NULL;
+    }
+    return realloc(ptr, size);
+}
+
+static void release_data(struct spherecas_state * state)
+{
+    if (state->data_owned) {
+        state->allocator(state->allocator_context, state->data, 0);
+    }
+    state->data = state->inline_data;
+    state->data_capacity = sizeof(state->inline_data);
+    state->data_owned = 0;
+}
+
+// Make sure the payload buffer can hold the whole of the current block, growing
+// it if allowed. Returns 0 if the payload will not fit.
+static int reserve_data(struct spherecas_state * state)
+{
+    size_t needed = state->data_count_expected;
+    if (needed <= state->data_capacity) {
+        return 1;
+    }
+    if (state->allocator == NULL) {
+        return 0;
+    }
+    uint8_t * grown = state->allocator(state->allocator_context,
+                                       state->data_owned ? state->data : NULL,
+                                       needed);
+    if (grown == NULL) {
+        return 0;
+    }
+    state->data = grown;
+    state->data_capacity = needed;
+    state->data_owned = 1;
+    state->payload = grown;
+    return 1;
+}
+
+void spherecas_begin_read_callback(struct spherecas_state * state,
+                                   spherecas_block_callback callback,
+                                   void * context)
+{
+    state->callback = callback;
+    state->filter = NULL;
+    state->next_block = NULL;
+    state->context = context;
+    state->options = 0;
+    state->stream_offset = 0;
+    state->allocator = default_realloc;
+    state->allocator_context = NULL;
+    state->data_owned = 0;
+    memset(&state->stats, 0, sizeof(state->stats));
+    release_data(state);
+    reset_block(state);
+}
+
+#ifndef SPHERECAS_NO_GLOBAL_CALLBACK
+static int global_block_read(struct spherecas_state * state,
+                             char block_name[],
+                             uint8_t * data,
+                             int length,
+                             enum spherecas_blocktype type,
+                             enum spherecas_error error)
+{
+    spherecas_block_read(state, block_name, data, length, type, error);
+    return SPHERECAS_CONTINUE;
+}
+
+void spherecas_begin_read(struct spherecas_state * state)
+{
+    spherecas_begin_read_callback(state, global_block_read, NULL);
+}
+#endif
+
+void spherecas_end_read(struct spherecas_state * state)
+{
+    release_data(state);
+    reset_block(state);
+}
+
+void spherecas_set_allocator(struct spherecas_state * state,
+                             spherecas_realloc_func allocator,
+                             void * context)
+{
+    release_data(state);
+    state->allocator = allocator;
+    state->allocator_context = context;
+    reset_block(state);
 }
 
-void spherecas_read_byte(struct spherecas_state * state, uint8_t byte)
+void spherecas_set_data_buffer(struct spherecas_state * state,
+                               uint8_t * buffer,
+                               size_t capacity)
 {
+    release_data(state);
+    state->allocator = NULL;
+    state->data = buffer;
+    state->data_capacity = capacity;
+    reset_block(state);
+}
+
+void spherecas_set_options(struct spherecas_state * state, unsigned options)
+{
+    state->options = options;
+}
+
+void spherecas_set_filter(struct spherecas_state * state, spherecas_filter_callback filter)
+{
+    state->filter = filter;
+}
+
+int spherecas_read_byte(struct spherecas_state * state, uint8_t byte)
+{
+    int result = SPHERECAS_CONTINUE;
+    state->stream_offset++;
     switch (state->read_state) {
         case READ_SYNC:
         {
+            state->stats.sync_bytes++;
             if (byte == HEADER_SYNC) {
                 state->read_state = READ_HEADER_START;
             }
@@ -44,13 +367,16 @@ void spherecas_read_byte(struct spherecas_state * state, uint8_t byte)
         }
         case READ_HEADER_START:
         {
+            state->stats.sync_bytes++;
             if (byte == HEADER_ESC) {
+                state->stats.headers++;
                 state->read_state = READ_DATA_LENGTH_HIGH;
             } else if (byte == HEADER_SYNC) {
                 // Do nothing, remain in this state.
                 ;
             } else {
                 // Resync
+                state->stats.resyncs++;
                 state->read_state = READ_SYNC;
             }
             break;
@@ -77,13 +403,41 @@ void spherecas_read_byte(struct spherecas_state * state, uint8_t byte)
         case READ_BLOCK_NAME_2:
         {
             state->block_name[1] = byte;
+            state->block_offset = state->stream_offset;
+            if (state->filter != NULL) {
+                state->skipping = !state->filter(state, state->block_name, state->data_count_expected);
+            }
+            if ((state->options & SPHERECAS_OPTION_FEATURES) && !state->skipping) {
+                memset(&state->features, 0, sizeof(state->features));
+            }
             state->read_state++;
             break;
         }
         case READ_DATA:
         {
-            state->data[state->data_count_read++] = byte;
-            state->checksum += byte;
+            state->stats.payload_bytes++;
+            if (state->skipping) {
+                // Just count it off.
+                if (++state->data_count_read == state->data_count_expected) {
+                    state->read_state++;
+                }
+                break;
+            }
+            if (!(state->options & SPHERECAS_OPTION_NO_PAYLOAD)) {
+                if (state->data_count_read == 0 && !reserve_data(state)) {
+                    state->payload = NULL;
+                }
+                if (state->payload != NULL) {
+                    state->data[state->data_count_read] = byte;
+                }
+            }
+            state->data_count_read++;
+            if (!(state->options & SPHERECAS_OPTION_NO_CHECKSUM)) {
+                state->checksum += byte;
+            }
+            if (state->options & SPHERECAS_OPTION_FEATURES) {
+                count_features(&state->features, &byte, 1);
+            }
             if (state->data_count_read == state->data_count_expected) {
                 state->read_state++;
             }
@@ -91,7 +445,7 @@ void spherecas_read_byte(struct spherecas_state * state, uint8_t byte)
             // is likely to contain object code. If all bytes are 7-bit ASCII
             // then the block is likely to be text or source (the default).
             // This is the heuristic used by Programma's Tape Directory program.
-            if (byte & 0x80) {
+            if ((byte & 0x80) && !(state->options & SPHERECAS_OPTION_NO_TYPE)) {
                 state->block_type = SPHERECAS_BLOCKTYPE_OBJECT;
             }
             break;
@@ -102,31 +456,643 @@ void spherecas_read_byte(struct spherecas_state * state, uint8_t byte)
                 state->read_state = READ_CHECKSUM;
             } else {
                 // Report out an error with this block.
-                spherecas_block_read(state, state->block_name, state->data, state->data_count_read, state->block_type, SPHERECAS_ERROR_TRAILER);
+                if (!state->skipping) {
+                    state->stats.trailer_errors++;
+                }
+                if (!state->skipping && (state->options & SPHERECAS_OPTION_FEATURES)) {
+                    summarize_features(&state->features);
+                }
+                if (!state->skipping && state->callback != NULL) {
+                    uint8_t * payload = (state->options & SPHERECAS_OPTION_NO_PAYLOAD ? NULL : state->payload);
+                    result = state->callback(state, state->block_name, payload, (int)state->data_count_read, state->block_type, SPHERECAS_ERROR_TRAILER);
+                }
                 // Go back to sync here.
-                spherecas_begin_read(state);
+                reset_block(state);
             }
             break;
         }
         case READ_CHECKSUM:
         {
             enum spherecas_error error = SPHERECAS_ERROR_NONE;
-            if (byte != state->checksum) {
+            uint8_t * payload = state->payload;
+            int bad_sum = (byte != state->checksum && !(state->options & SPHERECAS_OPTION_NO_CHECKSUM));
+            if (state->options & SPHERECAS_OPTION_NO_PAYLOAD) {
+                payload = NULL;
+            } else if (payload == NULL) {
+                error = SPHERECAS_ERROR_MEMORY;
+            }
+            if (error == SPHERECAS_ERROR_NONE && bad_sum) {
                 error = SPHERECAS_ERROR_CHECKSUM;
             }
-            spherecas_block_read(state, state->block_name, state->data, state->data_count_read, state->block_type, error);
-            spherecas_begin_read(state);
+            state->tape_checksum = byte;
+            if (!state->skipping) {
+                // (A skipped block's checksum isn't worked out, so none of
+                // these counts it.)
+                state->stats.blocks++;
+                if (bad_sum) {
+                    state->stats.checksum_errors++;
+                }
+                if (state->data_count_read > state->stats.largest_block) {
+                    state->stats.largest_block = state->data_count_read;
+                }
+            }
+            if (!state->skipping && (state->options & SPHERECAS_OPTION_FEATURES)) {
+                summarize_features(&state->features);
+            }
+            if (!state->skipping && state->callback != NULL) {
+                result = state->callback(state, state->block_name, payload, (int)state->data_count_read, state->block_type, error);
+            }
+            reset_block(state);
             break;
         }
     }
+    return result;
 }
 
-void spherecas_read_bytes(struct spherecas_state * restrict state,
-                          const uint8_t * restrict data,
-                          int count)
+// The body of read_bytes, for the given options (those in OPTIONS_LESS_WORK, and
+// SPHERECAS_OPTION_FEATURES; it's only ever called with a constant, so the work
+// they leave out, or don't add, is compiled out).
+static ALWAYS_INLINE size_t read_bytes_with(struct spherecas_state * restrict state,
+                                            const uint8_t * restrict data,
+                                            size_t count,
+                                            const unsigned options)
 {
-    while (count > 0) {
-        spherecas_read_byte(state, *data++);
-        --count;
+    const uint8_t * start = data;
+    const uint8_t * end = data + count;
+    while (data < end) {
+        switch (state->read_state) {
+            case READ_SYNC:
+            {
+                // Outside of a block nothing but a sync byte matters, so hunt
+                // for the next one in bulk (memchr is vectorized by any
+                // reasonable libc) rather than stepping through the garbage.
+                const uint8_t * sync = memchr(data, HEADER_SYNC, end - data);
+                if (sync == NULL) {
+                    state->stream_offset += end - data;
+                    state->stats.sync_bytes += end - data;
+                    return count;
+                }
+                state->stream_offset += sync + 1 - data;
+                state->stats.sync_bytes += sync + 1 - data;
+                data = sync + 1;
+                state->read_state = READ_HEADER_START;
+                break;
+            }
+            case READ_HEADER_START:
+            {
+                // Skip the rest of the leader run, then let the state machine
+                // decide on the first byte that isn't a sync byte.
+                const uint8_t * leader = data;
+                while (data < end && *data == HEADER_SYNC) {
+                    data++;
+                }
+                state->stream_offset += data - leader;
+                state->stats.sync_bytes += data - leader;
+                if (data < end) {
+                    spherecas_read_byte(state, *data++);    // Can't complete a block
+                }
+                break;
+            }
+            case READ_DATA:
+            {
+                // Take as much of the payload as this call has in one go.
+                size_t run = state->data_count_expected - state->data_count_read;
+                uint8_t bits = 0;
+                if (state->skipping || (options & SPHERECAS_OPTION_NO_PAYLOAD)) {
+                    // Not wanted (or not kept); just jump over it.
+                    if (run > (size_t)(end - data)) {
+                        run = end - data;
+                    }
+                } else if ((state->options & SPHERECAS_OPTION_ZERO_COPY) &&
+                    state->data_count_read == 0 && (size_t)(end - data) >= run + 2) {
+                    // The whole block, through the ETB and checksum, is in the
+                    // caller's buffer, so report it from there without copying.
+                    state->payload = (uint8_t *)data;
+                    state->data_offset = data - start;
+                } else {
+                    if (run > (size_t)(end - data)) {
+                        run = end - data;
+                    }
+                    if (state->data_count_read == 0 && !reserve_data(state)) {
+                        state->payload = NULL;
+                    }
+                    if (state->payload != NULL) {
+                        memcpy(&state->data[state->data_count_read], data, run);
+                    }
+                }
+                if (!state->skipping) {
+                    scan_payload(data, run, &state->checksum, &bits, options);
+                    if (options & SPHERECAS_OPTION_FEATURES) {
+                        count_features(&state->features, data, run);
+                    }
+                }
+                if (bits & 0x80) {
+                    state->block_type = SPHERECAS_BLOCKTYPE_OBJECT;
+                }
+                state->data_count_read += run;
+                state->stream_offset += run;
+                state->stats.payload_bytes += run;
+                data += run;
+                if (state->data_count_read == state->data_count_expected) {
+                    state->read_state++;
+                }
+                break;
+            }
+            default:
+            {
+                if (spherecas_read_byte(state, *data++) == SPHERECAS_STOP) {
+                    return data - start;
+                }
+                break;
+            }
+        }
+    }
+    return count;
+}
+
+#define READ_BYTES_WITH(options)    case (options): return read_bytes_with(state, data, count, (options) | more)
+
+// Picks the loop for the options that leave work out, with `more` (a constant)
+// added to them.
+static ALWAYS_INLINE size_t read_bytes_adding(struct spherecas_state * restrict state,
+                                              const uint8_t * restrict data,
+                                              size_t count,
+                                              const unsigned more)
+{
+    switch (state->options & OPTIONS_LESS_WORK) {
+        READ_BYTES_WITH(0);
+        READ_BYTES_WITH(SPHERECAS_OPTION_NO_PAYLOAD);
+        READ_BYTES_WITH(SPHERECAS_OPTION_NO_CHECKSUM);
+        READ_BYTES_WITH(SPHERECAS_OPTION_NO_TYPE);
+        READ_BYTES_WITH(SPHERECAS_OPTION_NO_PAYLOAD | SPHERECAS_OPTION_NO_CHECKSUM);
+        READ_BYTES_WITH(SPHERECAS_OPTION_NO_PAYLOAD | SPHERECAS_OPTION_NO_TYPE);
+        READ_BYTES_WITH(SPHERECAS_OPTION_NO_CHECKSUM | SPHERECAS_OPTION_NO_TYPE);
+        default:
+        READ_BYTES_WITH(OPTIONS_LESS_WORK);
+    }
+}
+
+size_t spherecas_read_bytes(struct spherecas_state * restrict state,
+                            const uint8_t * restrict data,
+                            size_t count)
+{
+    if (state->options & SPHERECAS_OPTION_FEATURES) {
+        return read_bytes_adding(state, data, count, SPHERECAS_OPTION_FEATURES);
+    }
+    return read_bytes_adding(state, data, count, 0);
+}
+
+void spherecas_get_stats(const struct spherecas_state * state, struct spherecas_stats * stats)
+{
+    *stats = state->stats;
+    stats->bytes_scanned = state->stream_offset;
+}
+
+int spherecas_block_progress(const struct spherecas_state * state,
+                             char block_name[2],
+                             uint32_t * received,
+                             uint32_t * expected)
+{
+    if (state->read_state < READ_DATA) {
+        return 0;
+    }
+    block_name[0] = state->block_name[0];
+    block_name[1] = state->block_name[1];
+    *received = state->data_count_read;
+    *expected = state->data_count_expected;
+    return 1;
+}
+
+void spherecas_count_features(const uint8_t * data, size_t length, struct spherecas_features * features)
+{
+    memset(features, 0, sizeof(struct spherecas_features));
+    count_features(features, data, length);
+    summarize_features(features);
+}
+
+enum spherecas_content spherecas_classify(const struct spherecas_features * features)
+{
+    uint64_t count = features->count;
+    if (count == 0) {
+        return SPHERECAS_CONTENT_UNKNOWN;
+    }
+    uint64_t textual = (uint64_t)features->printable + features->carriage_returns +
+                       features->line_feeds + features->histogram['\t'];
+    if (features->high_bit == 0 && textual * 20 >= count * 19) {
+        // Mostly text: at least 95% printable. (If lines end with CR LF, the
+        // larger of the two is the number of line ends; there's one more line
+        // than that unless it ends with one. It takes one to make it BASIC.)
+        uint64_t ends = (features->carriage_returns > features->line_feeds ?
+                         features->carriage_returns : features->line_feeds);
+        uint64_t lines = ends + !IS_LINE_END(features->last);
+        if (ends > 0 && features->numbered_lines * 2 >= lines) {
+            return SPHERECAS_CONTENT_BASIC;
+        }
+        return SPHERECAS_CONTENT_TEXT;
+    }
+    // Common opcodes are 22/256 of random bytes; object code needs twice that.
+    if ((uint64_t)features->opcodes * 256 >= count * 2 * sizeof(CommonOpcodes)) {
+        return SPHERECAS_CONTENT_OBJECT;
+    }
+    return SPHERECAS_CONTENT_DATA;
+}
+
+// Checkpoint layout: the fixed part, then the partial payload
+#define CHECKPOINT_MAGIC        "SPHRCHK1"
+#define CHECKPOINT_HEADER_SIZE  104
+#define CHECKPOINT_LOST_PAYLOAD 0x01
+
+static void put_le(uint8_t * bytes, uint64_t value, int size)
+{
+    for (int i = 0; i < size; i++) {
+        bytes[i] = (uint8_t)(value >> (8 * i));
+    }
+}
+
+static uint64_t get_le(const uint8_t * bytes, int size)
+{
+    uint64_t value = 0;
+    for (int i = size - 1; i >= 0; i--) {
+        value = (value << 8) | bytes[i];
+    }
+    return value;
+}
+
+// How much of the payload so far a checkpoint holds: all of it, unless it's
+// being skipped or couldn't be stored in the first place.
+static size_t checkpoint_payload(const struct spherecas_state * state)
+{
+    if (state->read_state < READ_DATA || state->skipping || state->payload == NULL ||
+        (state->options & SPHERECAS_OPTION_NO_PAYLOAD)) {
+        return 0;
+    }
+    return state->data_count_read;
+}
+
+size_t spherecas_checkpoint_size(const struct spherecas_state * state)
+{
+    return CHECKPOINT_HEADER_SIZE + checkpoint_payload(state);
+}
+
+size_t spherecas_save_checkpoint(const struct spherecas_state * state, uint8_t * buffer, size_t capacity)
+{
+    size_t payload = checkpoint_payload(state);
+    if (capacity < CHECKPOINT_HEADER_SIZE + payload) {
+        return 0;
+    }
+    const struct spherecas_stats * stats = &state->stats;
+    memcpy(buffer, CHECKPOINT_MAGIC, 8);
+    buffer[8] = (uint8_t)state->read_state;
+    buffer[9] = (uint8_t)state->block_type;
+    buffer[10] = (uint8_t)(state->skipping != 0);
+    // (A payload that isn't being kept counts as lost, for a state that would.)
+    buffer[11] = (state->read_state >= READ_DATA && !state->skipping &&
+                  (state->payload == NULL || (state->options & SPHERECAS_OPTION_NO_PAYLOAD)) ? CHECKPOINT_LOST_PAYLOAD : 0);
+    buffer[12] = state->checksum;
+    buffer[13] = (uint8_t)state->block_name[0];
+    buffer[14] = (uint8_t)state->block_name[1];
+    buffer[15] = 0;
+    put_le(&buffer[16], state->data_count_expected, 4);
+    put_le(&buffer[20], state->data_count_read, 4);
+    put_le(&buffer[24], state->stream_offset, 8);
+    put_le(&buffer[32], state->block_offset, 8);
+    put_le(&buffer[40], stats->sync_bytes, 8);
+    put_le(&buffer[48], stats->payload_bytes, 8);
+    put_le(&buffer[56], stats->headers, 8);
+    put_le(&buffer[64], stats->resyncs, 8);
+    put_le(&buffer[72], stats->blocks, 8);
+    put_le(&buffer[80], stats->trailer_errors, 8);
+    put_le(&buffer[88], stats->checksum_errors, 8);
+    put_le(&buffer[96], stats->largest_block, 4);
+    put_le(&buffer[100], payload, 4);
+    if (payload > 0) {
+        memcpy(&buffer[CHECKPOINT_HEADER_SIZE], state->payload, payload);
+    }
+    return CHECKPOINT_HEADER_SIZE + payload;
+}
+
+int spherecas_restore_checkpoint(struct spherecas_state * state, const uint8_t * checkpoint, size_t size)
+{
+    if (size < CHECKPOINT_HEADER_SIZE || memcmp(checkpoint, CHECKPOINT_MAGIC, 8) != 0) {
+        return 0;
+    }
+    int read_state = checkpoint[8];
+    uint32_t expected = (uint32_t)get_le(&checkpoint[16], 4);
+    uint32_t read = (uint32_t)get_le(&checkpoint[20], 4);
+    size_t payload = (size_t)get_le(&checkpoint[100], 4);
+    int skipping = checkpoint[10];
+    int lost = (checkpoint[11] & CHECKPOINT_LOST_PAYLOAD);
+    // It has to be a state the parser could really have been in. Nothing is
+    // read before the data, which has a length from 1 up once it's known (with
+    // just the high byte of it in, a multiple of 256 no more than 0xFF00), and
+    // the data is left as soon as all of it has been read.
+    if (read_state > READ_CHECKSUM || checkpoint[9] > SPHERECAS_BLOCKTYPE_OBJECT ||
+        expected > 0x10000 || read > expected ||
+        (read_state < READ_DATA && read != 0) ||
+        (read_state == READ_DATA_LENGTH_LOW && ((expected & 0xFF) != 0 || expected > 0xFF00)) ||
+        (read_state > READ_DATA_LENGTH_LOW && expected == 0) ||
+        (read_state == READ_DATA && read == expected) ||
+        (read_state > READ_DATA && read != expected) ||
+        size != CHECKPOINT_HEADER_SIZE + payload ||
+        payload != (read_state < READ_DATA || skipping || lost ? 0 : read)) {
+        return 0;
+    }
+
+    reset_block(state);
+    state->read_state = read_state;
+    state->block_type = (enum spherecas_blocktype)checkpoint[9];
+    state->skipping = skipping;
+    state->checksum = checkpoint[12];
+    state->block_name[0] = (char)checkpoint[13];
+    state->block_name[1] = (char)checkpoint[14];
+    state->data_count_expected = expected;
+    state->data_count_read = read;
+    state->stream_offset = get_le(&checkpoint[24], 8);
+    state->block_offset = get_le(&checkpoint[32], 8);
+    state->stats.sync_bytes = get_le(&checkpoint[40], 8);
+    state->stats.payload_bytes = get_le(&checkpoint[48], 8);
+    state->stats.headers = get_le(&checkpoint[56], 8);
+    state->stats.resyncs = get_le(&checkpoint[64], 8);
+    state->stats.blocks = get_le(&checkpoint[72], 8);
+    state->stats.trailer_errors = get_le(&checkpoint[80], 8);
+    state->stats.checksum_errors = get_le(&checkpoint[88], 8);
+    state->stats.largest_block = (uint32_t)get_le(&checkpoint[96], 4);
+    if (read_state >= READ_DATA && !skipping && !(state->options & SPHERECAS_OPTION_NO_PAYLOAD)) {
+        if (lost || (read > 0 && !reserve_data(state))) {
+            state->payload = NULL;
+        } else if (read > 0) {
+            memcpy(state->data, &checkpoint[CHECKPOINT_HEADER_SIZE], payload);
+        }
+    }
+    if ((state->options & SPHERECAS_OPTION_FEATURES) && read_state >= READ_DATA && !skipping) {
+        memset(&state->features, 0, sizeof(state->features));
+        count_features(&state->features, &checkpoint[CHECKPOINT_HEADER_SIZE], payload);
+    }
+    return 1;
+}
+
+// Block callback used by next_block: hands the block back and stops the read.
+static int next_block_read(struct spherecas_state * state,
+                           char block_name[],
+                           uint8_t * data,
+                           int length,
+                           enum spherecas_blocktype type,
+                           enum spherecas_error error)
+{
+    struct spherecas_block * block = state->next_block;
+    block->block_name[0] = block_name[0];
+    block->block_name[1] = block_name[1];
+    block->data_offset = state->block_offset;
+    block->length = (uint32_t)length;
+    block->data = data;
+    block->type = type;
+    block->error = error;
+    block->checksum = (error == SPHERECAS_ERROR_TRAILER ? 0 : state->tape_checksum);
+    block->features = (state->options & SPHERECAS_OPTION_FEATURES ? &state->features : NULL);
+    state->next_block = NULL;
+    return SPHERECAS_STOP;
+}
+
+int spherecas_next_block(struct spherecas_state * state,
+                         const uint8_t * data,
+                         size_t count,
+                         size_t * consumed,
+                         struct spherecas_block * block)
+{
+    spherecas_block_callback callback = state->callback;
+    state->callback = next_block_read;
+    state->next_block = block;
+    *consumed = spherecas_read_bytes(state, data, count);
+    state->callback = callback;
+    
+    // The callback clears next_block once it has filled it in.
+    int found = (state->next_block == NULL);
+    state->next_block = NULL;
+    return found;
+}
+
+// Block header layout, relative to the escape marker
+#define HEADER_DATA_START   5       // ESC, length (2), name (2)
+#define TRAILER_SIZE        2       // ETB, checksum
+
+void spherecas_index_range(const uint8_t * data,
+                           size_t size,
+                           size_t begin,
+                           size_t end,
+                           spherecas_candidate_callback callback,
+                           void * context)
+{
+    if (end > size) {
+        end = size;
+    }
+    if (begin == 0) {
+        begin = 1;      // The escape marker needs a sync byte in front of it
+    }
+    while (begin < end) {
+        const uint8_t * esc = memchr(&data[begin], HEADER_ESC, end - begin);
+        if (esc == NULL) {
+            return;
+        }
+        size_t offset = esc - data;
+        begin = offset + 1;
+        if (data[offset - 1] != HEADER_SYNC) {
+            continue;
+        }
+        
+        struct spherecas_candidate candidate;
+        memset(&candidate, 0, sizeof(candidate));
+        candidate.header_offset = offset;
+        candidate.data_offset = offset + HEADER_DATA_START;
+        candidate.type = SPHERECAS_BLOCKTYPE_TEXT;
+        if (size - offset >= HEADER_DATA_START) {
+            candidate.length = ((data[offset + 1] << 8) | data[offset + 2]) + 1;
+            candidate.block_name[0] = data[offset + 3];
+            candidate.block_name[1] = data[offset + 4];
+        }
+        
+        // Checked the same way the streaming reader would: a bad ETB is reported
+        // as soon as it's seen, otherwise the checksum byte is needed too.
+        size_t etb = candidate.data_offset + candidate.length;
+        if (size - offset >= HEADER_DATA_START && etb < size) {
+            uint8_t checksum = 0, bits = 0;
+            scan_payload(&data[candidate.data_offset], candidate.length, &checksum, &bits, 0);
+            if (bits & 0x80) {
+                candidate.type = SPHERECAS_BLOCKTYPE_OBJECT;
+            }
+            if (data[etb] != HEADER_ETB) {
+                candidate.error = SPHERECAS_ERROR_TRAILER;
+                candidate.resume_offset = etb + 1;
+                candidate.flags |= SPHERECAS_CANDIDATE_COMPLETE;
+            } else if (etb + 1 < size) {
+                if (data[etb + 1] != checksum) {
+                    candidate.error = SPHERECAS_ERROR_CHECKSUM;
+                }
+                candidate.resume_offset = etb + TRAILER_SIZE;
+                candidate.flags |= SPHERECAS_CANDIDATE_COMPLETE;
+            }
+        }
+        if (!(candidate.flags & SPHERECAS_CANDIDATE_COMPLETE)) {
+            candidate.resume_offset = size;
+        }
+        callback(context, &candidate);
+    }
+}
+
+void spherecas_resolve_index(struct spherecas_candidate * candidates, size_t count)
+{
+    // A streaming read starts out looking for sync, and looks again from just
+    // after each block it reports; the first candidate whose sync byte it can
+    // see is the block it reads next. It never gets past an incomplete block.
+    uint64_t position = 0;
+    for (size_t i = 0; i < count; i++) {
+        candidates[i].flags &= ~SPHERECAS_CANDIDATE_SERIAL;
+        if (candidates[i].header_offset - 1 < position) {
+            continue;
+        }
+        if (!(candidates[i].flags & SPHERECAS_CANDIDATE_COMPLETE)) {
+            position = UINT64_MAX;
+            continue;
+        }
+        candidates[i].flags |= SPHERECAS_CANDIDATE_SERIAL;
+        position = candidates[i].resume_offset;
+    }
+}
+
+void spherecas_recover_index(struct spherecas_candidate * candidates, size_t count)
+{
+    uint64_t position = 0;
+    for (size_t i = 0; i < count; i++) {
+        candidates[i].flags &= ~SPHERECAS_CANDIDATE_RECOVERY;
+        if (candidates[i].header_offset - 1 < position) {
+            continue;
+        }
+        if ((candidates[i].flags & SPHERECAS_CANDIDATE_COMPLETE) &&
+            candidates[i].error != SPHERECAS_ERROR_TRAILER) {
+            candidates[i].flags |= SPHERECAS_CANDIDATE_RECOVERY;
+            position = candidates[i].resume_offset;
+        } else {
+            // Report a bad trailer as usual, but don't believe its length.
+            if (candidates[i].flags & SPHERECAS_CANDIDATE_COMPLETE) {
+                candidates[i].flags |= SPHERECAS_CANDIDATE_RECOVERY;
+            }
+            position = candidates[i].header_offset + 1;
+        }
+    }
+}
+
+ptrdiff_t spherecas_find_false_sync(const uint8_t * data, size_t length)
+{
+    size_t at = 1;
+    while (at < length) {
+        const uint8_t * esc = memchr(&data[at], HEADER_ESC, length - at);
+        if (esc == NULL) {
+            break;
+        }
+        at = esc - data;
+        if (data[at - 1] == HEADER_SYNC) {
+            return at - 1;
+        }
+        at++;
+    }
+    return -1;
+}
+
+// Fills in the eight bytes of a block header (through the name), and the six
+// bytes of its trailer (ETB onward).
+static void encode_block_frame(uint8_t header[8],
+                               uint8_t trailer[6],
+                               const char block_name[2],
+                               const uint8_t * data,
+                               size_t length)
+{
+    uint8_t checksum = 0, bits = 0;
+    scan_payload(data, length, &checksum, &bits, 0);
+    
+    header[0] = HEADER_SYNC;
+    header[1] = HEADER_SYNC;
+    header[2] = HEADER_SYNC;
+    header[3] = HEADER_ESC;
+    header[4] = (uint8_t)((length - 1) >> 8);
+    header[5] = (uint8_t)(length - 1);
+    header[6] = (uint8_t)block_name[0];
+    header[7] = (uint8_t)block_name[1];
+    
+    trailer[0] = HEADER_ETB;
+    trailer[1] = checksum;
+    trailer[2] = checksum;
+    trailer[3] = checksum;
+    trailer[4] = checksum;
+    trailer[5] = checksum;
+}
+
+// Checks the part of a block after its escape marker for sync sequences. (The
+// trailer can't contain one, as it starts with the ETB.)
+static int has_false_sync(const uint8_t header[8], const uint8_t * data, size_t length)
+{
+    uint8_t joined[5] = { header[4], header[5], header[6], header[7], data[0] };
+    return (spherecas_find_false_sync(joined, sizeof(joined)) >= 0 ||
+            spherecas_find_false_sync(data, length) >= 0);
+}
+
+enum spherecas_write_result spherecas_write_block(uint8_t * buffer,
+                                                  size_t capacity,
+                                                  const char block_name[2],
+                                                  const uint8_t * data,
+                                                  size_t length,
+                                                  unsigned flags,
+                                                  size_t * written)
+{
+    *written = 0;
+    if (length < 1 || length > 0x10000) {
+        return SPHERECAS_WRITE_BAD_LENGTH;
+    }
+    if (capacity < SPHERECAS_BLOCK_SIZE(length)) {
+        return SPHERECAS_WRITE_NO_ROOM;
+    }
+    
+    uint8_t header[8], trailer[6];
+    encode_block_frame(header, trailer, block_name, data, length);
+    enum spherecas_write_result result = SPHERECAS_WRITE_OK;
+    if ((flags & (SPHERECAS_WRITE_CHECK_SYNC | SPHERECAS_WRITE_REFUSE_SYNC)) &&
+        has_false_sync(header, data, length)) {
+        result = SPHERECAS_WRITE_FALSE_SYNC;
+        if (flags & SPHERECAS_WRITE_REFUSE_SYNC) {
+            return result;
+        }
+    }
+    
+    memcpy(buffer, header, sizeof(header));
+    memcpy(&buffer[sizeof(header)], data, length);
+    memcpy(&buffer[sizeof(header) + length], trailer, sizeof(trailer));
+    *written = SPHERECAS_BLOCK_SIZE(length);
+    return result;
+}
+
+enum spherecas_write_result spherecas_write_block_file(FILE * file,
+                                                       const char block_name[2],
+                                                       const uint8_t * data,
+                                                       size_t length,
+                                                       unsigned flags)
+{
+    if (length < 1 || length > 0x10000) {
+        return SPHERECAS_WRITE_BAD_LENGTH;
+    }
+    
+    uint8_t header[8], trailer[6];
+    encode_block_frame(header, trailer, block_name, data, length);
+    enum spherecas_write_result result = SPHERECAS_WRITE_OK;
+    if ((flags & (SPHERECAS_WRITE_CHECK_SYNC | SPHERECAS_WRITE_REFUSE_SYNC)) &&
+        has_false_sync(header, data, length)) {
+        result = SPHERECAS_WRITE_FALSE_SYNC;
+        if (flags & SPHERECAS_WRITE_REFUSE_SYNC) {
+            return result;
+        }
+    }
+    
+    if (fwrite(header, 1, sizeof(header), file) != sizeof(header) ||
+        fwrite(data, 1, length, file) != length ||
+        fwrite(trailer, 1, sizeof(trailer), file) != sizeof(trailer)) {
+        return SPHERECAS_WRITE_IO_ERROR;
     }
+    return result;
 }
@@ -6,9 +6,10 @@
 //
 //  This module is a small library for parsing cassette data recorded for/by the
 //  Sphere 1 and other Sphere microcomputers. Create a state object,
-//  then call begin_read to set it up, then call read_byte(s) until all of the
-//  input data is exhausted. The library will invoke your callback function
-//  at the completion of every block found in the cassette data stream.
+//  then call begin_read_callback to set it up, then call read_byte(s) until all of the
+//  input data is exhausted, then call end_read. The library will invoke your
+//  callback function at the completion of every block found in the cassette
+//  data stream.
 //
 //  Format details:
 //
@@ -40,58 +41,406 @@
 #define SPHERECAS_H
 
 #include <stdio.h>
+#include <stddef.h>
 #include <stdint.h>
 
+// Payloads up to this size are held inside the state structure itself; larger
+// blocks get a buffer sized to fit from the allocator (see below). Define this
+// as 0x10000 to get the original fixed layout, which never allocates.
+#ifndef SPHERECAS_INLINE_DATA_SIZE
+#define SPHERECAS_INLINE_DATA_SIZE  256
+#endif
+
 enum spherecas_blocktype {
     SPHERECAS_BLOCKTYPE_TEXT,
     SPHERECAS_BLOCKTYPE_OBJECT
 };
 
+// Options for spherecas_set_options
+#define SPHERECAS_OPTION_ZERO_COPY      0x01    // Report payloads in place where possible (see below)
+#define SPHERECAS_OPTION_NO_PAYLOAD     0x02    // Don't keep payloads (report them as NULL)
+#define SPHERECAS_OPTION_NO_CHECKSUM    0x04    // Don't check checksums
+#define SPHERECAS_OPTION_NO_TYPE        0x08    // Don't classify blocks (all are TEXT)
+#define SPHERECAS_OPTION_FEATURES       0x10    // Count each block's content features (see below)
+
 enum spherecas_error {
     SPHERECAS_ERROR_NONE,
     SPHERECAS_ERROR_TRAILER = 1,
-    SPHERECAS_ERROR_CHECKSUM
+    SPHERECAS_ERROR_CHECKSUM,
+    SPHERECAS_ERROR_MEMORY          // No room to store the payload
+};
+
+struct spherecas_state;
+
+// Block callback. The arguments are as follows:
+//      state           - Pointer to the spherecas_state structure
+//      block_name      - Two characters indicating the "name" of this block
+//      data            - Pointer to the start of the data payload
+//      length          - Length of data payload
+//      type            - object (code) or (likely) text or source
+//      error           - Success (0) or an error code
+//
+// Note that while the interpreted record is passed entirely as arguments,
+// the raw data is available in the `spherecas_state` structure, which includes the
+// address and checksum as part of data. (In zero copy mode `state->payload` is
+// the authoritative pointer to the data; `state->data` may not have been filled.)
+// The `context` pointer given to begin_read is available as `state->context`.
+// Return SPHERECAS_CONTINUE to carry on, or SPHERECAS_STOP to have read_bytes
+// return straight after this block (see below).
+// `state->block_offset` is the position of the first payload byte within the
+// whole input stream (counting every byte read since begin_read, which is what
+// `state->stream_offset` holds); the header starts just before it.
+typedef int (*spherecas_block_callback)(struct spherecas_state * state,
+                                        char block_name[],
+                                        uint8_t * data,
+                                        int length,
+                                        enum spherecas_blocktype type,
+                                        enum spherecas_error error);
+
+#define SPHERECAS_CONTINUE  0
+#define SPHERECAS_STOP      1
+
+// Filter callback: given the name and length of a block whose header has just
+// been read, return nonzero to read the block, or zero to skip over it without
+// looking at its payload. Skipped blocks are not reported.
+typedef int (*spherecas_filter_callback)(struct spherecas_state * state,
+                                         const char block_name[],
+                                         uint32_t length);
+
+// Content features of a payload, for telling apart kinds of content that the
+// TEXT/OBJECT type doesn't: BASIC source from other text, and 6800 object code
+// from other binary data. With SPHERECAS_OPTION_FEATURES, the histogram (and
+// `numbered_lines`) are counted in the same pass over the payload as the
+// checksum, as it's read; the rest are worked out from them once the block is
+// complete, just before it's reported. Either way nothing goes over the
+// payload again, and it needn't be kept (they can go with NO_PAYLOAD).
+struct spherecas_features {
+    uint32_t  histogram[256];   // How many times each byte value occurs
+    uint32_t  count;            // Bytes counted (see spherecas_restore_checkpoint)
+    uint32_t  printable;        // 0x20-0x7E
+    uint32_t  high_bit;         // 0x80-0xFF
+    uint32_t  carriage_returns;
+    uint32_t  line_feeds;
+    uint32_t  numbered_lines;   // Lines (the first included) that start with a digit
+    uint32_t  opcodes;          // Bytes that are common 6800 opcodes (listed in spherecas.c)
+    uint8_t   last;             // The last byte counted
+};
+
+enum spherecas_content {
+    SPHERECAS_CONTENT_UNKNOWN,      // Nothing was counted
+    SPHERECAS_CONTENT_TEXT,
+    SPHERECAS_CONTENT_BASIC,        // Text in numbered lines: BASIC source
+    SPHERECAS_CONTENT_OBJECT,       // 6800 object code, by the opcodes in it
+    SPHERECAS_CONTENT_DATA          // Anything else
+};
+
+// Allocator hook: behaves like realloc(ptr, size), and like free(ptr) for size 0.
+typedef void * (*spherecas_realloc_func)(void * context, void * ptr, size_t size);
+
+// Counters kept while reading, since begin_read. Every byte read is counted in
+// exactly one of sync_bytes (outside of any block, hunting for a header),
+// payload_bytes (block data, including skipped blocks) or the header and
+// trailer bytes in between, which are the rest of bytes_scanned. The counts of
+// blocks (blocks, the two errors, and largest_block) leave out those skipped
+// by a filter, whose checksums aren't worked out: they're of the blocks that
+// were reported.
+struct spherecas_stats {
+    uint64_t  bytes_scanned;
+    uint64_t  sync_bytes;
+    uint64_t  payload_bytes;
+    uint64_t  headers;          // Headers started (a sync byte, then the escape marker)
+    uint64_t  resyncs;          // Sync bytes followed by something other than a header
+    uint64_t  blocks;           // Blocks read through to their checksum
+    uint64_t  trailer_errors;
+    uint64_t  checksum_errors;
+    uint32_t  largest_block;    // Longest payload of a block read through
 };
 
 struct spherecas_state {
     int       read_state;
     char      block_name[2];
-    uint16_t  data_count_expected;
-    int       data_count_read;
-    uint8_t   data[0x10000];  
+    uint32_t  data_count_expected;
+    uint32_t  data_count_read;
+    uint8_t * data;
+    size_t    data_capacity;
+    uint8_t * payload;
+    ptrdiff_t data_offset;
+    uint64_t  stream_offset;
+    uint64_t  block_offset;
     uint8_t   checksum;
+    uint8_t   tape_checksum;    // The checksum byte of the block being reported, as read
     enum spherecas_blocktype block_type;
+    struct spherecas_features features; // The block being reported's (with SPHERECAS_OPTION_FEATURES)
+    spherecas_block_callback callback;
+    spherecas_filter_callback filter;
+    int       skipping;
+    struct spherecas_block * next_block;
     void *    context;
+    unsigned  options;
+    spherecas_realloc_func allocator;
+    void *    allocator_context;
+    int       data_owned;
+    struct spherecas_stats stats;
+    uint8_t   inline_data[SPHERECAS_INLINE_DATA_SIZE];
 };
 
-// Begin reading
+// Begin reading. Each state has its own callback and context, so any number of
+// states (on any number of threads) can be in use at the same time. The callback
+// may be NULL if blocks are only going to be pulled with next_block.
+void spherecas_begin_read_callback(struct spherecas_state * state,
+                                   spherecas_block_callback callback,
+                                   void * context);
+
+#ifndef SPHERECAS_NO_GLOBAL_CALLBACK
+// Begin reading, reporting blocks to the global spherecas_block_read function
+// (declared below). Define SPHERECAS_NO_GLOBAL_CALLBACK when building the library
+// to leave this out, so that the global symbol need not exist.
 void spherecas_begin_read(struct spherecas_state * state);
+#endif
 
-// Read a single character
-void spherecas_read_byte(struct spherecas_state * state, uint8_t byte);
+// Done reading: releases any payload buffer the parser allocated. Call this
+// before discarding (or re-beginning) a state.
+void spherecas_end_read(struct spherecas_state * state);
 
-// Read `count` characters from `data`
-void spherecas_read_bytes(struct spherecas_state * restrict state,
-                          const uint8_t * restrict data,
-                          int count);
+// Payload storage. Call these after begin_read. By default, blocks too big for
+// the inline buffer get a heap buffer (which is kept for reuse until end_read).
+// set_allocator replaces the heap functions; passing NULL disables growth.
+// set_data_buffer supplies the caller's own buffer instead, and disables growth.
+// Either way, a block that can't be stored is reported with SPHERECAS_ERROR_MEMORY
+// (or SPHERECAS_ERROR_TRAILER if that also failed) and a NULL data pointer.
+void spherecas_set_allocator(struct spherecas_state * state,
+                             spherecas_realloc_func allocator,
+                             void * context);
+void spherecas_set_data_buffer(struct spherecas_state * state,
+                               uint8_t * buffer,
+                               size_t capacity);
 
-// Callback - this must be provided by the user of the library.
-// The arguments are as follows:
-//      state           - Pointer to the spherecas_state structure
-//      block_name      - Two characters indicating the "name" of this block
-//      data            - Pointer to the start of the data payload
-//      length          - Length of data payload
-//      type            - object (code) or (likely) text or source
-//      error           - Success (0) or an error code
+// Set SPHERECAS_OPTION_* flags. Call after begin_read, which clears them.
 //
-// Note that while the interpreted record is passed entirely as arguments,
-// the raw data is available in the `spherecas_state` structure, which includes the
-// address and checksum as part of data.
+// With SPHERECAS_OPTION_ZERO_COPY, a block that lies entirely within a single
+// buffer given to read_bytes is reported with `data` pointing directly into that
+// buffer, and `state->data_offset` holding its offset there. Blocks that span
+// calls (or arrive through read_byte) are copied as usual and report an offset
+// of -1. The callback must not modify the data in either case.
+//
+// The NO_ options leave work out, for callers that don't need it; read_bytes
+// has a loop of its own for each combination of them, with that work compiled
+// out. For example, a listing that shows names, lengths, types and errors can
+// use SPHERECAS_OPTION_NO_PAYLOAD (nothing is stored or copied), and one that
+// only wants where the blocks are can add the other two. Without a checksum,
+// the only error reported is SPHERECAS_ERROR_TRAILER; without a type, every
+// block is SPHERECAS_BLOCKTYPE_TEXT; without a payload, `data` is NULL (and
+// SPHERECAS_ERROR_MEMORY never comes up).
+//
+// SPHERECAS_OPTION_FEATURES adds work instead: each block's content features
+// are counted as it's read, and are in `state->features` when it's reported
+// (and pointed to by `block->features`, for next_block). Skipped blocks aren't
+// counted. It has read_bytes loops of its own, too.
+void spherecas_set_options(struct spherecas_state * state, unsigned options);
+
+// Set (or with NULL, clear) a filter to skip unwanted blocks. Call after begin_read.
+void spherecas_set_filter(struct spherecas_state * state, spherecas_filter_callback filter);
+
+// Read a single character. Returns SPHERECAS_STOP if it completed a block and
+// the callback asked to stop, otherwise SPHERECAS_CONTINUE.
+int spherecas_read_byte(struct spherecas_state * state, uint8_t byte);
+
+// Read `count` characters from `data`. This is equivalent to calling
+// read_byte for each character, but skips quickly over the garbage between blocks
+// (and over the payloads of filtered-out blocks). Returns the number of characters
+// read, which is less than `count` only if the callback asked to stop. Reading
+// can pick up again from there.
+size_t spherecas_read_bytes(struct spherecas_state * restrict state,
+                            const uint8_t * restrict data,
+                            size_t count);
+
+// Copies out the counters (see struct spherecas_stats). Can be called at any
+// time, including from the callback.
+void spherecas_get_stats(const struct spherecas_state * state, struct spherecas_stats * stats);
+
+// Tells how far through a block the reader is, for progress reports. Returns 1,
+// with the block's name and counts of payload bytes received and expected, if
+// its header has been read (and the block isn't complete yet), otherwise 0.
+int spherecas_block_progress(const struct spherecas_state * state,
+                             char block_name[2],
+                             uint32_t * received,
+                             uint32_t * expected);
+
+// Counts the content features of a payload held in memory (one found by a block
+// index, say), just as reading it with SPHERECAS_OPTION_FEATURES would have.
+void spherecas_count_features(const uint8_t * data, size_t length, struct spherecas_features * features);
+
+// Makes a best guess at what a block holds, from its features. Text is 7-bit
+// and nearly all printable characters and line ends; it's BASIC if at least
+// half of its lines start with a digit (a line number). Anything else is object
+// code if common 6800 opcodes make up at least twice the share of it they would
+// of random bytes, and otherwise data. (This is separate from the block type,
+// which goes by high bits alone, as Programma's Tape Directory did.)
+enum spherecas_content spherecas_classify(const struct spherecas_features * features);
+
+// Checkpoints
+//
+// Between calls to read_byte(s), a state's progress can be saved as a compact
+// checkpoint: where it is in the block format, the block so far (name, counts,
+// checksum, and the partial payload), the stream offset and the counters. A
+// checkpoint is plain bytes (little endian), so it can be kept in a file and
+// restored in another process, which then picks up reading with the input byte
+// at `stream_offset`. It's no bigger than SPHERECAS_CHECKPOINT_SIZE(the payload
+// bytes read so far).
+
+#define SPHERECAS_CHECKPOINT_SIZE(payload)  ((size_t)(payload) + 104)
+
+// Writes a checkpoint into `buffer`. Returns its size, or 0 if there isn't room
+// (spherecas_checkpoint_size says how much is needed).
+size_t spherecas_checkpoint_size(const struct spherecas_state * state);
+size_t spherecas_save_checkpoint(const struct spherecas_state * state, uint8_t * buffer, size_t capacity);
+
+// Restores a checkpoint into a state, after begin_read (and whatever options,
+// filter and payload storage it's to have; these aren't part of a checkpoint).
+// Returns 0, leaving the state as begin_read left it, if the checkpoint isn't
+// valid. A partial payload that can't be stored makes the block come out as
+// SPHERECAS_ERROR_MEMORY, as it would have had the read not been interrupted.
+// Content features (with SPHERECAS_OPTION_FEATURES) are counted again from the
+// partial payload; a checkpoint saved without one has them count only what's
+// read after it, which `features.count` then shows.
+int spherecas_restore_checkpoint(struct spherecas_state * state, const uint8_t * checkpoint, size_t size);
+
+// Block iterator
+//
+// Instead of having blocks pushed to the callback, the caller can pull them,
+// one at a time: feed input to next_block until it produces a block, then carry
+// on with the rest of the input from where it left off.
+
+struct spherecas_block {
+    char      block_name[2];
+    uint64_t  data_offset;      // Stream offset of the first payload byte
+    uint32_t  length;
+    const uint8_t * data;       // NULL if it couldn't be stored (SPHERECAS_ERROR_MEMORY)
+    enum spherecas_blocktype type;
+    enum spherecas_error error;
+    uint8_t   checksum;         // As on the tape (meaningless if the trailer was bad)
+    const struct spherecas_features * features; // NULL without SPHERECAS_OPTION_FEATURES
+};
+
+// Reads from `data` until the end of the next block, or until all `count`
+// characters are used up. Returns 1 with `block` filled in if a block was
+// completed, else 0 (more input is needed). Either way, `consumed` is set to the
+// number of characters read; begin the next call with the ones after them.
+// `block->data` (and `block->features`) are good until the next call on this state, unless it points into
+// the caller's own buffer (in zero copy mode), when it's good as long as that is.
+// Blocks read this way are not passed to the state's callback, which may be NULL.
+int spherecas_next_block(struct spherecas_state * state,
+                         const uint8_t * data,
+                         size_t count,
+                         size_t * consumed,
+                         struct spherecas_block * block);
+
+// Block index
+//
+// As an alternative to the streaming reader, an input held entirely in memory
+// can be indexed: every place a block header could start is found and checked
+// on its own, so separate ranges of the input can be indexed in parallel (e.g.
+// one thread per range). resolve_index then marks the candidates that the
+// streaming reader would have reported, with the same results and in the same
+// order -- including blocks hidden by an earlier false or orphaned header.
+// Alternatively, recover_index marks the blocks of a more forgiving read, which
+// doesn't let such headers hide anything.
+//
+// The streaming reader syncs on a sync byte followed by the escape marker, so
+// that pair is what defines a candidate, at the offset of the escape marker.
+
+#define SPHERECAS_CANDIDATE_COMPLETE    0x01    // The whole block is within the input
+#define SPHERECAS_CANDIDATE_SERIAL      0x02    // A streaming read reports this block
+#define SPHERECAS_CANDIDATE_RECOVERY    0x04    // A recovering read reports this block
+
+struct spherecas_candidate {
+    uint64_t  header_offset;    // Offset of the escape marker
+    uint64_t  data_offset;      // Offset of the first payload byte
+    uint64_t  resume_offset;    // Where a streaming read picks up after this block
+    uint32_t  length;
+    char      block_name[2];
+    enum spherecas_blocktype type;
+    enum spherecas_error error;
+    unsigned  flags;
+};
+
+typedef void (*spherecas_candidate_callback)(void * context,
+                                             const struct spherecas_candidate * candidate);
+
+// Finds and checks each candidate whose escape marker lies in [begin, end) of the
+// `size` bytes at `data`, in order. A candidate's block may extend past `end`.
+void spherecas_index_range(const uint8_t * data,
+                           size_t size,
+                           size_t begin,
+                           size_t end,
+                           spherecas_candidate_callback callback,
+                           void * context);
+
+// Sets SPHERECAS_CANDIDATE_SERIAL on the candidates a streaming read of the
+// whole input would report. `candidates` must be in offset order.
+void spherecas_resolve_index(struct spherecas_candidate * candidates, size_t count);
+
+// Sets SPHERECAS_CANDIDATE_RECOVERY on the candidates a recovering read reports.
+// This reads like a streaming read, except that after a block whose trailer is
+// bad (or which runs off the end of the input) it looks for sync again just
+// after that block's header rather than after its supposed end. A false sync
+// in a payload or an orphaned header then costs nothing but its own report, so
+// every intact block comes out of the one index. `candidates` must be in order.
+void spherecas_recover_index(struct spherecas_candidate * candidates, size_t count);
+
+// Block writer
+//
+// Encodes a block in the same format: sync, escape, length minus one, name,
+// data, ETB, checksum and the three trailer bytes (the checksum, repeated).
+// Optionally, the block is checked for accidental sync sequences (a sync byte
+// followed by the escape marker, which is what a reader syncs on) in the part
+// after its header, which would make a reader that missed the real header
+// mis-sync on it.
+
+// Total size of an encoded block with a `length` byte payload
+#define SPHERECAS_BLOCK_SIZE(length)    ((size_t)(length) + 13)
+
+// Flags for spherecas_write_block*
+#define SPHERECAS_WRITE_CHECK_SYNC      0x01    // Warn about accidental sync sequences
+#define SPHERECAS_WRITE_REFUSE_SYNC     0x02    // ...and don't write the block if there are any
+
+enum spherecas_write_result {
+    SPHERECAS_WRITE_OK,
+    SPHERECAS_WRITE_FALSE_SYNC,     // Contains a sync sequence (written unless refused)
+    SPHERECAS_WRITE_BAD_LENGTH,     // Payloads must be 1 to 65536 bytes
+    SPHERECAS_WRITE_NO_ROOM,        // The buffer is too small
+    SPHERECAS_WRITE_IO_ERROR
+};
+
+// Writes a block into `buffer`, setting `written` to the number of bytes used
+// (which is SPHERECAS_BLOCK_SIZE(length), or 0 if nothing was written).
+enum spherecas_write_result spherecas_write_block(uint8_t * buffer,
+                                                  size_t capacity,
+                                                  const char block_name[2],
+                                                  const uint8_t * data,
+                                                  size_t length,
+                                                  unsigned flags,
+                                                  size_t * written);
+
+// Writes a block to a stream.
+enum spherecas_write_result spherecas_write_block_file(FILE * file,
+                                                       const char block_name[2],
+                                                       const uint8_t * data,
+                                                       size_t length,
+                                                       unsigned flags);
+
+// Returns the offset of the first sync sequence (0x16, 0x1B) in `data`, or -1.
+ptrdiff_t spherecas_find_false_sync(const uint8_t * data, size_t length);
+
+#ifndef SPHERECAS_NO_GLOBAL_CALLBACK
+// Callback - this must be provided by the user of the library when using
+// spherecas_begin_read. The arguments are as for spherecas_block_callback.
 extern void spherecas_block_read(struct spherecas_state * state ,
                                  char block_name[],
                                  uint8_t * data,
                                  int length,
                                  enum spherecas_blocktype type,
                                  enum spherecas_error error);
+#endif
 
 #endif /* SPHERECAS_H */
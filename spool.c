@@ -0,0 +1,365 @@
+//
+//  spool.c
+//
+//  Copyright (c) Ben Zotto 2022
+//  See LICENSE for licensing information.
+//
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include "spool.h"
+#include "watch.h"
+#include "monitor.h"
+
+// The captures waiting to be read by the workers, and the totals reported on
+// the stats socket.
+struct spool {
+    const struct spool_reader * reader;
+    pthread_mutex_t lock;
+    pthread_cond_t  queued;         // Signalled when there may be a capture to take, or it's stopping
+    char **         waiting;        // Captures to read, oldest first
+    size_t          waiting_count;
+    size_t          waiting_capacity;
+    char **         reading;        // Per worker: the capture it's reading (or NULL)
+    int             workers;
+    int             stopping;
+    int             uncommitted;    // Tapes added to the container since its last table
+    double          started;
+    size_t          tapes_read;
+    size_t          tapes_failed;
+    uint64_t        blocks_reported;
+    uint64_t        input_bytes;
+    double          read_seconds;   // Summed over the workers
+    struct spherecas_stats stats;   // ...and so are the parsers' counters
+    pthread_mutex_t output;         // Held while a listing is printed
+};
+
+// One of the worker threads.
+struct spool_worker {
+    struct spool *  spool;
+    int             index;
+    void *          warm;
+    pthread_t       thread;
+};
+
+static void spool_capture(void * context, const char * path, int swept);
+static void * spool_worker(void * arg);
+static void spool_report(struct spool * spool, int fd);
+static double spool_now(void);
+
+int spool_run(const struct spool_reader * reader,
+              char * const directories[],
+              size_t count,
+              int threads,
+              const char * socket_path,
+              volatile sig_atomic_t * stopped)
+{
+    struct watch watch;
+    if (!watch_open(&watch, directories, count)) {
+        printf("Unable to watch the directories given: %s\n", strerror(errno));
+        return 0;
+    }
+    int monitor = -1;
+    if (socket_path != NULL && (monitor = monitor_open(socket_path)) < 0) {
+        printf("Unable to open the stats socket %s: %s\n", socket_path, strerror(errno));
+        watch_close(&watch);
+        return 0;
+    }
+
+    struct spool spool;
+    memset(&spool, 0, sizeof(spool));
+    spool.reader = reader;
+    spool.started = spool_now();
+    pthread_mutex_init(&spool.lock, NULL);
+    pthread_cond_init(&spool.queued, NULL);
+    pthread_mutex_init(&spool.output, NULL);
+    spool.reading = calloc(threads, sizeof(char *));
+    struct spool_worker * workers = calloc(threads, sizeof(struct spool_worker));
+
+    // An interrupt is left to this thread to see.
+    sigset_t stopping, old_mask;
+    sigemptyset(&stopping);
+    sigaddset(&stopping, SIGINT);
+    sigaddset(&stopping, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &stopping, &old_mask);
+    while (spool.reading != NULL && workers != NULL && spool.workers < threads) {
+        struct spool_worker * worker = &workers[spool.workers];
+        worker->spool = &spool;
+        worker->index = spool.workers;
+        worker->warm = malloc(reader->warm_size);
+        if (worker->warm == NULL || pthread_create(&worker->thread, NULL, spool_worker, worker) != 0) {
+            free(worker->warm);
+            break;
+        }
+        spool.workers++;
+    }
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+
+    int ok = (spool.workers > 0);
+    if (!ok) {
+        printf("Unable to start any workers\n");
+    } else {
+        printf("(Watching %zu director%s for captures, with %d worker(s); interrupt to stop)\n",
+               count, (count == 1 ? "y" : "ies"), spool.workers);
+        fflush(stdout);
+        watch_sweep(&watch, spool_capture, &spool);
+    }
+
+    double committed = spool_now();
+    while (ok && !*stopped) {
+        struct pollfd fds[2] = { { watch.fd, POLLIN, 0 }, { monitor, POLLIN, 0 } };
+        int ready = poll(fds, (monitor >= 0 ? 2 : 1), SPOOL_POLL_MS);
+        if (ready < 0 && errno != EINTR) {
+            break;
+        }
+        if (ready > 0 && (fds[0].revents & POLLIN) && !watch_read(&watch, spool_capture, &spool)) {
+            pthread_mutex_lock(&spool.output);
+            printf("Unable to read the directories' events: %s\n", strerror(errno));
+            pthread_mutex_unlock(&spool.output);
+            ok = 0;
+        }
+        if (ready > 0 && monitor >= 0 && (fds[1].revents & POLLIN)) {
+            spool_report(&spool, monitor);
+        }
+
+        if (reader->container != NULL) {
+            pthread_mutex_lock(&spool.lock);
+            int idle = (spool.waiting_count == 0);
+            for (int i = 0; i < spool.workers && idle; i++) {
+                idle = (spool.reading[i] == NULL);
+            }
+            int commit = (spool.uncommitted > 0 && (idle || spool_now() - committed >= SPOOL_COMMIT_SECONDS));
+            if (commit) {
+                spool.uncommitted = 0;
+            }
+            pthread_mutex_unlock(&spool.lock);
+            if (commit) {
+                committed = spool_now();
+                if (!container_commit(reader->container)) {
+                    pthread_mutex_lock(&spool.output);
+                    printf("Unable to write the container's table\n");
+                    fflush(stdout);
+                    pthread_mutex_unlock(&spool.output);
+                }
+            }
+        }
+    }
+
+    // The captures being read are finished; any still waiting are left for
+    // the next run to find.
+    pthread_mutex_lock(&spool.lock);
+    spool.stopping = 1;
+    pthread_cond_broadcast(&spool.queued);
+    pthread_mutex_unlock(&spool.lock);
+    for (int i = 0; i < spool.workers; i++) {
+        pthread_join(workers[i].thread, NULL);
+        free(workers[i].warm);
+    }
+    if (spool.workers > 0) {
+        printf("\n(Stopped after reading %zu capture(s), %zu of them unsuccessfully; %zu left waiting)\n",
+               spool.tapes_read, spool.tapes_failed, spool.waiting_count);
+    }
+    if (spool.tapes_failed > 0) {
+        ok = 0;
+    }
+
+    for (size_t i = 0; i < spool.waiting_count; i++) {
+        free(spool.waiting[i]);
+    }
+    free(spool.waiting);
+    free(spool.reading);
+    free(workers);
+    pthread_mutex_destroy(&spool.output);
+    pthread_cond_destroy(&spool.queued);
+    pthread_mutex_destroy(&spool.lock);
+    monitor_close(monitor, socket_path);
+    watch_close(&watch);
+    return ok;
+}
+
+// Watch callback: queues a capture to be read, unless it's waiting already.
+// (One completed again while it's being read is read again afterwards.)
+static void spool_capture(void * context, const char * path, int swept)
+{
+    struct spool * spool = context;
+    if (swept && spool->reader->done(spool->reader->context, path)) {
+        return;
+    }
+    pthread_mutex_lock(&spool->lock);
+    int queued = 0;
+    for (size_t i = 0; i < spool->waiting_count && !queued; i++) {
+        queued = (strcmp(spool->waiting[i], path) == 0);
+    }
+    for (int i = 0; i < spool->workers && swept && !queued; i++) {
+        queued = (spool->reading[i] != NULL && strcmp(spool->reading[i], path) == 0);
+    }
+    if (!queued && spool->waiting_count == spool->waiting_capacity) {
+        size_t capacity = (spool->waiting_capacity ? spool->waiting_capacity * 2 : 64);
+        char ** grown = realloc(spool->waiting, capacity * sizeof(char *));
+        if (grown != NULL) {
+            spool->waiting = grown;
+            spool->waiting_capacity = capacity;
+        }
+    }
+    if (!queued && spool->waiting_count < spool->waiting_capacity &&
+        (spool->waiting[spool->waiting_count] = strdup(path)) != NULL) {
+        spool->waiting_count++;
+        pthread_cond_signal(&spool->queued);
+    }
+    pthread_mutex_unlock(&spool->lock);
+}
+
+// Worker thread: reads the oldest capture waiting (that no other worker is
+// reading) until the daemon stops, printing each one's listing as soon as it's
+// done.
+static void * spool_worker(void * arg)
+{
+    struct spool_worker * worker = arg;
+    struct spool * spool = worker->spool;
+    const struct spool_reader * reader = spool->reader;
+    for (;;) {
+        pthread_mutex_lock(&spool->lock);
+        char * path = NULL;
+        while (!spool->stopping && path == NULL) {
+            for (size_t i = 0; i < spool->waiting_count && path == NULL; i++) {
+                int busy = 0;
+                for (int j = 0; j < spool->workers && !busy; j++) {
+                    busy = (spool->reading[j] != NULL && strcmp(spool->reading[j], spool->waiting[i]) == 0);
+                }
+                if (!busy) {
+                    path = spool->waiting[i];
+                    memmove(&spool->waiting[i], &spool->waiting[i + 1], (spool->waiting_count - i - 1) * sizeof(char *));
+                    spool->waiting_count--;
+                }
+            }
+            if (path == NULL && !spool->stopping) {
+                pthread_cond_wait(&spool->queued, &spool->lock);
+            }
+        }
+        spool->reading[worker->index] = path;
+        pthread_mutex_unlock(&spool->lock);
+        if (path == NULL) {
+            return NULL;
+        }
+
+        struct spool_tape tape;
+        memset(&tape, 0, sizeof(tape));
+        char * out_text = NULL;
+        size_t out_size = 0;
+        FILE * out = open_memstream(&out_text, &out_size);
+        if (out != NULL) {
+            fprintf(out, "\n%s:\n", path);
+            reader->read(reader->context, path, worker->warm, out, &tape);
+            fclose(out);
+        }
+        pthread_mutex_lock(&spool->output);
+        if (out_text != NULL) {
+            fwrite(out_text, 1, out_size, stdout);
+        } else {
+            printf("\n%s: Unable to collect output\n", path);
+        }
+        fflush(stdout);
+        pthread_mutex_unlock(&spool->output);
+        free(out_text);
+
+        pthread_mutex_lock(&spool->lock);
+        spool->tapes_read++;
+        spool->tapes_failed += !tape.ok;
+        spool->uncommitted += (reader->container != NULL);
+        spool->blocks_reported += tape.blocks_reported;
+        spool->input_bytes += tape.bytes_read;
+        spool->read_seconds += tape.seconds;
+        if (tape.have_stats) {
+            struct spherecas_stats * stats = &spool->stats;
+            stats->bytes_scanned += tape.stats.bytes_scanned;
+            stats->sync_bytes += tape.stats.sync_bytes;
+            stats->payload_bytes += tape.stats.payload_bytes;
+            stats->headers += tape.stats.headers;
+            stats->resyncs += tape.stats.resyncs;
+            stats->blocks += tape.stats.blocks;
+            stats->trailer_errors += tape.stats.trailer_errors;
+            stats->checksum_errors += tape.stats.checksum_errors;
+            if (tape.stats.largest_block > stats->largest_block) {
+                stats->largest_block = tape.stats.largest_block;
+            }
+        }
+        spool->reading[worker->index] = NULL;
+        free(path);
+        // (Another worker may be waiting for this capture to be done with.)
+        pthread_cond_broadcast(&spool->queued);
+        pthread_mutex_unlock(&spool->lock);
+    }
+}
+
+// Answers whoever has connected to the stats socket with the daemon's totals.
+static void spool_report(struct spool * spool, int fd)
+{
+    char * text = NULL;
+    size_t size = 0;
+    FILE * report = open_memstream(&text, &size);
+    if (report == NULL) {
+        monitor_answer(fd, "", 0);
+        return;
+    }
+    pthread_mutex_lock(&spool->lock);
+    int reading = 0;
+    for (int i = 0; i < spool->workers; i++) {
+        reading += (spool->reading[i] != NULL);
+    }
+    double uptime = spool_now() - spool->started;
+    const struct spherecas_stats * stats = &spool->stats;
+    fprintf(report, "uptime_seconds %.1f\n", uptime);
+    fprintf(report, "workers %d\n", spool->workers);
+    fprintf(report, "backlog %zu\n", spool->waiting_count);
+    fprintf(report, "reading %d\n", reading);
+    fprintf(report, "tapes_read %zu\n", spool->tapes_read);
+    fprintf(report, "tapes_failed %zu\n", spool->tapes_failed);
+    fprintf(report, "blocks_reported %llu\n", (unsigned long long)spool->blocks_reported);
+    fprintf(report, "input_bytes %llu\n", (unsigned long long)spool->input_bytes);
+    fprintf(report, "read_seconds %.3f\n", spool->read_seconds);
+    fprintf(report, "read_mb_per_second %.1f\n",
+            (spool->read_seconds > 0 ? spool->input_bytes / spool->read_seconds / 1e6 : 0.0));
+    fprintf(report, "mb_per_second %.3f\n", (uptime > 0 ? spool->input_bytes / uptime / 1e6 : 0.0));
+    fprintf(report, "bytes_scanned %llu\n", (unsigned long long)stats->bytes_scanned);
+    fprintf(report, "sync_bytes %llu\n", (unsigned long long)stats->sync_bytes);
+    fprintf(report, "payload_bytes %llu\n", (unsigned long long)stats->payload_bytes);
+    fprintf(report, "headers %llu\n", (unsigned long long)stats->headers);
+    fprintf(report, "resyncs %llu\n", (unsigned long long)stats->resyncs);
+    fprintf(report, "blocks %llu\n", (unsigned long long)stats->blocks);
+    fprintf(report, "trailer_errors %llu\n", (unsigned long long)stats->trailer_errors);
+    fprintf(report, "checksum_errors %llu\n", (unsigned long long)stats->checksum_errors);
+    fprintf(report, "largest_block %u\n", stats->largest_block);
+    pthread_mutex_unlock(&spool->lock);
+
+    struct block_store * store = spool->reader->store;
+    if (store != NULL) {
+        pthread_mutex_lock(&store->lock);
+        fprintf(report, "store_written %zu\n", store->written);
+        fprintf(report, "store_duplicates %zu\n", store->duplicates);
+        pthread_mutex_unlock(&store->lock);
+    }
+    struct container * container = spool->reader->container;
+    if (container != NULL) {
+        pthread_mutex_lock(&container->lock);
+        fprintf(report, "container_tapes %zu\n", container->tape_count);
+        fprintf(report, "container_blocks %zu\n", container->entry_count);
+        pthread_mutex_unlock(&container->lock);
+    }
+    if (fclose(report) == 0) {
+        monitor_answer(fd, text, size);
+    } else {
+        monitor_answer(fd, "", 0);
+    }
+    free(text);
+}
+
+static double spool_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
@@ -0,0 +1,74 @@
+//
+//  spool.h
+//
+//  Copyright (c) Ben Zotto 2022
+//  See LICENSE for licensing information.
+//
+//  A daemon (--watch) that reads the captures dropped into spool directories,
+//  on a pool of worker threads, until it's told to stop. Those already there
+//  to begin with are read too, unless the caller says they've been read
+//  already. What reading a capture takes is left to the caller: each worker
+//  hands it the capture's path, a buffer of its own that lasts from one
+//  capture to the next (for a parser and its buffers, kept warm), and a
+//  stream for its listing, which is printed as a whole once it's done.
+//
+//  With a container, its table is written out whenever the daemon runs out of
+//  captures to read (and every so often while it doesn't), so that it can be
+//  read as it is at any time. With a stats socket, whatever connects to it is
+//  answered with the totals so far (see spool_run).
+//
+
+#ifndef SPOOL_H
+#define SPOOL_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <signal.h>
+#include "spherecas.h"
+#include "store.h"
+#include "container.h"
+
+// The container's table is written this often while the daemon is kept busy,
+// and its main loop looks up at least this often.
+#define SPOOL_COMMIT_SECONDS    10.0
+#define SPOOL_POLL_MS           1000
+
+// What came of reading one capture, for the totals.
+struct spool_tape {
+    int             ok;
+    size_t          blocks_reported;
+    uint64_t        bytes_read;
+    double          seconds;
+    int             have_stats;     // Set if `stats` holds the parser's counters
+    struct spherecas_stats stats;
+};
+
+struct spool_reader {
+    // Reads the capture at `path`, listing it to `out`, and fills in `tape`.
+    // `warm` is the worker's own buffer (of `warm_size` bytes).
+    void (*read)(void * context, const char * path, void * warm, FILE * out, struct spool_tape * tape);
+    // Whether a capture that was in a directory already has been read before.
+    int (*done)(void * context, const char * path);
+    void *          context;
+    size_t          warm_size;
+    struct container * container;   // If any, to commit (and report on)
+    struct block_store * store;     // If any, to report on
+};
+
+// Reads every capture completed in (or moved into) the directories, with up to
+// `threads` workers, until `*stopped` is set (by a signal handler the caller
+// has installed; SIGINT and SIGTERM are kept from the workers). The captures
+// being read when it stops are finished, and any still waiting are left.
+// `socket_path`, if not NULL, is a stats socket to open (see monitor.h), which
+// is answered with the --stats counters summed over every capture read, the
+// backlog, and the throughput, one "name value" per line. Prints a message,
+// and returns 0, if it couldn't be started or a capture couldn't be read.
+int spool_run(const struct spool_reader * reader,
+              char * const directories[],
+              size_t count,
+              int threads,
+              const char * socket_path,
+              volatile sig_atomic_t * stopped);
+
+#endif
@@ -0,0 +1,290 @@
+//
+//  store.c
+//
+//  Copyright (c) Ben Zotto 2022
+//  See LICENSE for licensing information.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <sys/stat.h>
+#include "store.h"
+#include "sidecar.h"
+
+#define STORE_EMPTY         0
+#define STORE_PENDING       1       // Being looked for on disk, or written
+#define STORE_STORED        2
+#define STORE_LOST          3       // Couldn't be stored; may be tried again
+
+// Stored payloads are never any bigger than a block's.
+#define STORE_MAX_PAYLOAD   0x10000
+
+// The second hash, to tell apart payloads whose first hashes are the same.
+static uint64_t check_hash(const uint8_t * data, size_t length)
+{
+    uint64_t hash = 0x9E3779B97F4A7C15ULL ^ length;
+    for (size_t i = 0; i < length; i++) {
+        hash = (hash + data[i]) * 0xFF51AFD7ED558CCDULL;
+        hash ^= hash >> 32;
+    }
+    return hash;
+}
+
+static size_t slot_for(const struct block_store * store, uint64_t hash, uint32_t variant)
+{
+    size_t slot = (size_t)(hash ^ ((uint64_t)variant * 0x9E3779B97F4A7C15ULL)) & (store->capacity - 1);
+    while (store->entries[slot].state != STORE_EMPTY &&
+           (store->entries[slot].hash != hash || store->entries[slot].variant != variant)) {
+        slot = (slot + 1) & (store->capacity - 1);
+    }
+    return slot;
+}
+
+// Keeps the table under half full. Returns 0 if out of memory.
+static int grow_entries(struct block_store * store)
+{
+    if (store->count * 2 < store->capacity) {
+        return 1;
+    }
+    struct block_store grown = *store;
+    grown.capacity = store->capacity * 2;
+    grown.entries = calloc(grown.capacity, sizeof(struct store_entry));
+    if (grown.entries == NULL) {
+        return 0;
+    }
+    for (size_t i = 0; i < store->capacity; i++) {
+        const struct store_entry * entry = &store->entries[i];
+        if (entry->state != STORE_EMPTY) {
+            grown.entries[slot_for(&grown, entry->hash, entry->variant)] = *entry;
+        }
+    }
+    free(store->entries);
+    store->entries = grown.entries;
+    store->capacity = grown.capacity;
+    return 1;
+}
+
+int store_open(struct block_store * store, const char * directory)
+{
+    memset(store, 0, sizeof(struct block_store));
+    if (mkdir(directory, 0777) != 0 && errno != EEXIST) {
+        return 0;
+    }
+    store->directory = strdup(directory);
+    store->capacity = 1024;
+    store->entries = calloc(store->capacity, sizeof(struct store_entry));
+    if (store->directory == NULL || store->entries == NULL) {
+        free(store->directory);
+        free(store->entries);
+        return 0;
+    }
+    pthread_mutex_init(&store->lock, NULL);
+    pthread_cond_init(&store->changed, NULL);
+    return 1;
+}
+
+void store_close(struct block_store * store)
+{
+    pthread_mutex_destroy(&store->lock);
+    pthread_cond_destroy(&store->changed);
+    free(store->directory);
+    free(store->entries);
+    store->directory = NULL;
+    store->entries = NULL;
+}
+
+static char * store_path(const struct block_store * store, const char * name)
+{
+    size_t size = strlen(store->directory) + strlen(name) + 2;
+    char * path = malloc(size);
+    if (path != NULL) {
+        snprintf(path, size, "%s/%s", store->directory, name);
+    }
+    return path;
+}
+
+// Looks at a file already in the store. Returns -1 if there's no such file, 1
+// if it holds exactly this payload, 0 if something else (setting its length
+// and check hash then), or -2 if it couldn't be read.
+static int compare_file(const char * path,
+                        const uint8_t * data,
+                        size_t length,
+                        uint32_t * file_length,
+                        uint64_t * file_check)
+{
+    FILE * file = fopen(path, "rb");
+    if (file == NULL) {
+        return (errno == ENOENT ? -1 : -2);
+    }
+    uint8_t * contents = malloc(STORE_MAX_PAYLOAD + 1);
+    if (contents == NULL) {
+        fclose(file);
+        return -2;
+    }
+    size_t size = fread(contents, 1, STORE_MAX_PAYLOAD + 1, file);
+    int failed = ferror(file);
+    fclose(file);
+    int result;
+    if (failed) {
+        result = -2;
+    } else if (size == length && memcmp(contents, data, length) == 0) {
+        result = 1;
+    } else {
+        // (Something too big to be a payload never matches anything.)
+        *file_length = (size > STORE_MAX_PAYLOAD ? UINT32_MAX : (uint32_t)size);
+        *file_check = check_hash(contents, size);
+        result = 0;
+    }
+    free(contents);
+    return result;
+}
+
+// Writes a new file into the store: to a temporary file first, then linked
+// into place, which fails rather than replace a file that another process
+// wrote in the meantime. Returns 1 if written, 0 if the name was taken, or -1
+// on failure.
+static int write_file(const struct block_store * store, const char * path, const uint8_t * data, size_t length)
+{
+    char * temp_path = store_path(store, ".incoming-XXXXXX");
+    if (temp_path == NULL) {
+        return -1;
+    }
+    int fd = mkstemp(temp_path);
+    if (fd < 0) {
+        free(temp_path);
+        return -1;
+    }
+    int ok = 1;
+    for (size_t done = 0; ok && done < length; ) {
+        ssize_t count = write(fd, &data[done], length - done);
+        if (count < 0 && errno == EINTR) {
+            continue;
+        }
+        ok = (count > 0);
+        done += (ok ? (size_t)count : 0);
+    }
+    fchmod(fd, 0644);
+    if (close(fd) != 0) {
+        ok = 0;
+    }
+
+    int result = -1;
+    if (ok) {
+        if (link(temp_path, path) == 0) {
+            result = 1;
+        } else if (errno == EEXIST) {
+            result = 0;
+        } else if (rename(temp_path, path) == 0) {
+            // (For filesystems without hard links.)
+            result = 1;
+        }
+    }
+    unlink(temp_path);
+    free(temp_path);
+    return result;
+}
+
+// Settles a pending entry, and wakes anyone waiting on it.
+static void settle_entry(struct block_store * store,
+                         uint64_t hash,
+                         uint32_t variant,
+                         int state,
+                         uint32_t length,
+                         uint64_t check)
+{
+    pthread_mutex_lock(&store->lock);
+    struct store_entry * entry = &store->entries[slot_for(store, hash, variant)];
+    entry->state = state;
+    entry->length = length;
+    entry->check = check;
+    pthread_cond_broadcast(&store->changed);
+    pthread_mutex_unlock(&store->lock);
+}
+
+enum store_result store_put(struct block_store * store,
+                            const uint8_t * data,
+                            size_t length,
+                            char name[STORE_NAME_SIZE])
+{
+    uint64_t hash = sidecar_hash(data, length);
+    uint64_t check = check_hash(data, length);
+
+    for (uint32_t variant = 0; variant < UINT32_MAX; variant++) {
+        if (variant == 0) {
+            snprintf(name, STORE_NAME_SIZE, "%016" PRIx64 ".bin", hash);
+        } else {
+            snprintf(name, STORE_NAME_SIZE, "%016" PRIx64 "-%" PRIu32 ".bin", hash, variant);
+        }
+
+        // Known already this run (or being dealt with by another thread)?
+        pthread_mutex_lock(&store->lock);
+        struct store_entry * entry = &store->entries[slot_for(store, hash, variant)];
+        while (entry->state == STORE_PENDING) {
+            pthread_cond_wait(&store->changed, &store->lock);
+            entry = &store->entries[slot_for(store, hash, variant)];
+        }
+        if (entry->state == STORE_STORED) {
+            int same = (entry->length == length && entry->check == check);
+            if (same) {
+                store->duplicates++;
+            }
+            pthread_mutex_unlock(&store->lock);
+            if (same) {
+                return STORE_DUPLICATE;
+            }
+            continue;
+        }
+        // Claim it while the disk is checked.
+        if (entry->state == STORE_EMPTY) {
+            if (!grow_entries(store)) {
+                pthread_mutex_unlock(&store->lock);
+                return STORE_FAILED;
+            }
+            entry = &store->entries[slot_for(store, hash, variant)];
+            entry->hash = hash;
+            entry->variant = variant;
+            store->count++;
+        }
+        entry->state = STORE_PENDING;
+        pthread_mutex_unlock(&store->lock);
+
+        char * path = store_path(store, name);
+        uint32_t file_length = 0;
+        uint64_t file_check = 0;
+        int found = (path != NULL ? compare_file(path, data, length, &file_length, &file_check) : -2);
+        int written = 0;
+        if (found == -1) {
+            written = write_file(store, path, data, length);
+            if (written == 0) {
+                // Someone else's, just now; have a look at it after all.
+                found = compare_file(path, data, length, &file_length, &file_check);
+            }
+        }
+        free(path);
+
+        if (written == 1 || found == 1) {
+            settle_entry(store, hash, variant, STORE_STORED, (uint32_t)length, check);
+            pthread_mutex_lock(&store->lock);
+            if (written == 1) {
+                store->written++;
+            } else {
+                store->duplicates++;
+            }
+            pthread_mutex_unlock(&store->lock);
+            return (written == 1 ? STORE_WRITTEN : STORE_DUPLICATE);
+        }
+        if (found == 0) {
+            // A different payload with the same hash; try the next name.
+            settle_entry(store, hash, variant, STORE_STORED, file_length, file_check);
+            continue;
+        }
+        settle_entry(store, hash, variant, STORE_LOST, 0, 0);
+        return STORE_FAILED;
+    }
+    return STORE_FAILED;
+}
@@ -0,0 +1,67 @@
+//
+//  store.h
+//
+//  Copyright (c) Ben Zotto 2022
+//  See LICENSE for licensing information.
+//
+//  A content-addressed block store: a directory in which each distinct payload
+//  is kept once, as <hash>.bin, however many tapes it turns up on. The hash is
+//  the 64-bit one the sidecar uses. In case two different payloads ever share
+//  one, the second is kept as <hash>-1.bin (and so on), so a store is never
+//  wrong about what it holds:
+//     - A payload already stored during this run is matched by its length and
+//       a second, independent hash, remembered in a cache.
+//     - A file left by an earlier run is compared byte for byte before it's
+//       taken to be the same.
+//
+//  One store can be shared by any number of threads; the cache is guarded by a
+//  mutex, which is not held while files are read or written.
+//
+
+#ifndef STORE_H
+#define STORE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+// Enough for "<16 hex digits>-<variant>.bin"
+#define STORE_NAME_SIZE     32
+
+struct store_entry {
+    uint64_t        hash;
+    uint64_t        check;
+    uint32_t        length;
+    uint32_t        variant;
+    int             state;
+};
+
+struct block_store {
+    char *          directory;
+    pthread_mutex_t lock;
+    pthread_cond_t  changed;        // Signalled when a pending entry is settled
+    struct store_entry * entries;   // Open addressing, by hash and variant
+    size_t          capacity;
+    size_t          count;
+    size_t          written;        // Payloads new to the store
+    size_t          duplicates;     // Payloads it already had
+};
+
+enum store_result {
+    STORE_WRITTEN,
+    STORE_DUPLICATE,
+    STORE_FAILED
+};
+
+// Opens a store, creating its directory if need be. Returns 0 on failure.
+int store_open(struct block_store * store, const char * directory);
+void store_close(struct block_store * store);
+
+// Stores a payload unless it's there already, and sets `name` to its file
+// name within the store directory.
+enum store_result store_put(struct block_store * store,
+                            const uint8_t * data,
+                            size_t length,
+                            char name[STORE_NAME_SIZE]);
+
+#endif
@@ -0,0 +1,156 @@
+//
+//  checkpoint_test
+//
+//  Checks that spherecas_restore_checkpoint takes back what save_checkpoint
+//  wrote, and turns down records of states the parser can't really be in (a
+//  damaged or stale checkpoint file must not become a parser that writes past
+//  its payload buffer).
+//
+//  Build from the top of the repo with:
+//
+//      cc -O1 -g -fsanitize=address -I. -DSPHERECAS_NO_GLOBAL_CALLBACK tests/checkpoint_test.c spherecas.c -o checkpoint_test
+//
+//  It prints each check that fails, and exits with 1 if any did.
+//
+//  Copyright (c) Ben Zotto 2022.
+//  See LICENSE for licensing information.
+//
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include "spherecas.h"
+
+// Parser states, as numbered in a checkpoint (see spherecas.c).
+#define STATE_HEADER_START      1
+#define STATE_LENGTH_LOW        3
+#define STATE_DATA              6
+#define STATE_ETB               7
+#define STATE_CHECKSUM          8
+
+static int failures;
+
+static void check(int ok, const char * what)
+{
+    if (!ok) {
+        printf("FAILED: %s\n", what);
+        failures++;
+    }
+}
+
+static void put_le(uint8_t * bytes, uint64_t value, int size)
+{
+    for (int i = 0; i < size; i++) {
+        bytes[i] = (uint8_t)(value >> (8 * i));
+    }
+}
+
+static int count_block(struct spherecas_state * state,
+                       char block_name[],
+                       uint8_t * data,
+                       int length,
+                       enum spherecas_blocktype type,
+                       enum spherecas_error error)
+{
+    (void)block_name;
+    (void)data;
+    (void)length;
+    (void)type;
+    (void)error;
+    (*(int *)state->context)++;
+    return SPHERECAS_CONTINUE;
+}
+
+// A checkpoint header for a parser in `read_state`, with the data counts given.
+// Any payload read is marked as lost, so none need be included.
+static void make_record(uint8_t record[SPHERECAS_CHECKPOINT_SIZE(0)], int read_state, uint32_t expected, uint32_t read)
+{
+    memset(record, 0, SPHERECAS_CHECKPOINT_SIZE(0));
+    memcpy(record, "SPHRCHK1", 8);
+    record[8] = (uint8_t)read_state;
+    record[11] = 0x01;
+    record[13] = 'A';
+    record[14] = '0';
+    put_le(&record[16], expected, 4);
+    put_le(&record[20], read, 4);
+}
+
+// Restores a made up record, and whether or not that works, runs some bytes
+// through the parser (which must stay in bounds). Returns the restore's result.
+static int restore_record(int read_state, uint32_t expected, uint32_t read)
+{
+    uint8_t record[SPHERECAS_CHECKPOINT_SIZE(0)];
+    make_record(record, read_state, expected, read);
+    struct spherecas_state state;
+    int blocks = 0;
+    spherecas_begin_read_callback(&state, count_block, &blocks);
+    int restored = spherecas_restore_checkpoint(&state, record, sizeof(record));
+    for (int i = 0; i < 1024; i++) {
+        spherecas_read_byte(&state, (uint8_t)i);
+    }
+    spherecas_end_read(&state);
+    return restored;
+}
+
+// Saves a checkpoint after every byte of a tape, and checks that a parser
+// restored from each finds the same number of blocks as one that read it all.
+static void check_round_trip(void)
+{
+    uint8_t tape[256];
+    size_t size = 0;
+    const uint8_t payload[] = "HELLO";
+    for (int block = 0; block < 2; block++) {
+        uint8_t header[] = { 0x16, 0x16, 0x16, 0x1B, 0x00, sizeof(payload) - 2, 'A', (uint8_t)('0' + block) };
+        memcpy(&tape[size], header, sizeof(header));
+        size += sizeof(header);
+        uint8_t sum = 0;
+        for (size_t i = 0; i < sizeof(payload) - 1; i++) {
+            tape[size++] = payload[i];
+            sum += payload[i];
+        }
+        tape[size++] = 0x17;
+        for (int i = 0; i < 4; i++) {
+            tape[size++] = sum;
+        }
+    }
+
+    for (size_t at = 0; at <= size; at++) {
+        struct spherecas_state state;
+        int blocks = 0;
+        spherecas_begin_read_callback(&state, count_block, &blocks);
+        spherecas_read_bytes(&state, tape, at);
+        uint8_t checkpoint[SPHERECAS_CHECKPOINT_SIZE(sizeof(payload))];
+        size_t checkpoint_size = spherecas_save_checkpoint(&state, checkpoint, sizeof(checkpoint));
+        spherecas_end_read(&state);
+
+        struct spherecas_state restored;
+        spherecas_begin_read_callback(&restored, count_block, &blocks);
+        check(checkpoint_size > 0 && spherecas_restore_checkpoint(&restored, checkpoint, checkpoint_size),
+              "a saved checkpoint is restored");
+        spherecas_read_bytes(&restored, &tape[at], size - at);
+        spherecas_end_read(&restored);
+        check(blocks == 2, "a restored parser finds the rest of the blocks");
+    }
+}
+
+int main(void)
+{
+    check_round_trip();
+
+    check(restore_record(STATE_DATA, 5, 2), "a block part way through its data is restored");
+    check(restore_record(STATE_ETB, 5, 5), "a block waiting for its ETB is restored");
+
+    check(!restore_record(STATE_DATA, 0, 0), "data with no length is turned down");
+    check(!restore_record(STATE_DATA, 5, 5), "data that's all been read is turned down");
+    check(!restore_record(STATE_ETB, 0, 0), "an ETB after no data is turned down");
+    check(!restore_record(STATE_CHECKSUM, 0, 0), "a checksum after no data is turned down");
+    check(!restore_record(STATE_LENGTH_LOW, 0xFF05, 0), "a length's high byte with low bits is turned down");
+    check(restore_record(STATE_LENGTH_LOW, 0xFF00, 0), "the largest length's high byte is restored");
+    check(!restore_record(STATE_LENGTH_LOW, 0x10000, 0), "a length's high byte past 0xFF is turned down");
+    check(!restore_record(STATE_HEADER_START, 5, 3), "data read before the header is turned down");
+
+    if (failures == 0) {
+        printf("All checkpoint checks passed.\n");
+    }
+    return failures ? 1 : 0;
+}
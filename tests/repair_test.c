@@ -0,0 +1,122 @@
+//
+//  repair_test
+//
+//  Checks that repair_search finds the byte that was damaged in a block, and
+//  is sure enough of it for sphere2bin to make the repair (--repair) where the
+//  README says it should be: text blocks, of lengths real tapes have, with one
+//  stray high bit.
+//
+//  Build from the top of the repo with:
+//
+//      cc -O1 -g -fsanitize=address -I. tests/repair_test.c repair.c -o repair_test
+//
+//  It prints each check that fails, and exits with 1 if any did.
+//
+//  Copyright (c) Ben Zotto 2022.
+//  See LICENSE for licensing information.
+//
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include "repair.h"
+
+// As sphere2bin requires before it repairs a block (see main.c)
+#define MIN_CONFIDENCE          0.5
+
+static int failures;
+
+static void check(int ok, const char * what)
+{
+    if (!ok) {
+        printf("FAILED: %s\n", what);
+        failures++;
+    }
+}
+
+// Fills `text` with lines of a made-up program listing.
+static void make_text(uint8_t * text, size_t length)
+{
+    const char listing[] = "10 REM SPHERE TAPE\r20 FOR I=1 TO 10\r30 PRINT \"HELLO\";I\r40 NEXT I\r50 END\r";
+    for (size_t i = 0; i < length; i++) {
+        text[i] = (uint8_t)listing[i % (sizeof(listing) - 1)];
+    }
+}
+
+static uint8_t sum(const uint8_t * data, size_t length)
+{
+    uint8_t total = 0;
+    for (size_t i = 0; i < length; i++) {
+        total += data[i];
+    }
+    return total;
+}
+
+// Damages a text block of `length` bytes at `position` by setting the high
+// bit, and checks that the repair would put it back.
+static void check_stray_high_bit(size_t length, size_t position, const char * what)
+{
+    uint8_t * block = malloc(length);
+    make_text(block, length);
+    uint8_t checksum = sum(block, length);
+    uint8_t original = block[position];
+    block[position] |= 0x80;
+
+    struct repair_result repair;
+    repair_search(block, length, checksum, NULL, 0, REPAIR_DEFAULT_BUDGET, &repair);
+    check(repair.found && repair.position == position && repair.to == original, what);
+    check(repair.confidence >= MIN_CONFIDENCE, what);
+    free(block);
+}
+
+// Flips a bit of a block that has high bits all through it (as object code
+// does): the right byte should still be the likeliest, but without other copies
+// there's nothing to be sure of it by.
+static void check_object_block(void)
+{
+    uint8_t block[512];
+    for (size_t i = 0; i < sizeof(block); i++) {
+        block[i] = (uint8_t)(i * 37 + 0x80);
+    }
+    uint8_t checksum = sum(block, sizeof(block));
+    block[100] ^= 0x04;
+
+    struct repair_result repair;
+    repair_search(block, sizeof(block), checksum, NULL, 0, REPAIR_DEFAULT_BUDGET, &repair);
+    check(repair.found && repair.confidence < MIN_CONFIDENCE, "damaged object code isn't repaired on its own");
+
+    // With two other captures that read the byte right, it is.
+    uint8_t other[sizeof(block)];
+    memcpy(other, block, sizeof(block));
+    other[100] ^= 0x04;
+    const uint8_t * const others[] = { other, other };
+    repair_search(block, sizeof(block), checksum, others, 2, REPAIR_DEFAULT_BUDGET, &repair);
+    check(repair.found && repair.position == 100 && repair.confidence >= MIN_CONFIDENCE,
+          "damaged object code is repaired when other copies agree");
+}
+
+int main(void)
+{
+    check_stray_high_bit(5, 2, "a short text block with a stray high bit is repaired");
+    check_stray_high_bit(108, 60, "a 108-byte text block with a stray high bit is repaired");
+    check_stray_high_bit(1024, 0, "a 1K text block with a stray high bit at the start is repaired");
+    check_stray_high_bit(4096, 4095, "a 4K text block with a stray high bit at the end is repaired");
+    check_object_block();
+
+    // A block that matches its checksum has nothing to repair.
+    uint8_t text[64];
+    make_text(text, sizeof(text));
+    struct repair_result repair;
+    repair_search(text, sizeof(text), sum(text, sizeof(text)), NULL, 0, REPAIR_DEFAULT_BUDGET, &repair);
+    check(!repair.found, "an intact block isn't repaired");
+
+    // A budget stops the search short.
+    text[40] |= 0x80;
+    repair_search(text, sizeof(text), sum(text, sizeof(text)) - 0x80, NULL, 0, 16, &repair);
+    check(repair.cut_short && repair.tried == 16, "the search stops at its budget");
+
+    if (failures == 0) {
+        printf("All repair checks passed.\n");
+    }
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,381 @@
+//
+//  vote.c
+//
+//  Copyright (c) Ben Zotto 2022
+//  See LICENSE for licensing information.
+//
+
+#include <stdlib.h>
+#include <string.h>
+#include "vote.h"
+
+// Bit-sliced counters: bit i of count[b] is bit b of the count for bit i of the
+// word. Four slices count up to 15, which is plenty for VOTE_MAX_COPIES.
+#define SLICES  4
+
+// How much of a capture that's read a chunk at a time is read at once
+#define VOTE_CHUNK_SIZE     0x10000
+
+static void count_word(uint64_t count[SLICES], uint64_t word)
+{
+    uint64_t carry = word;
+    for (int b = 0; b < SLICES; b++) {
+        uint64_t next = count[b] & carry;
+        count[b] ^= carry;
+        carry = next;
+    }
+}
+
+// The bits whose counts are at least (or exactly) `threshold`.
+static uint64_t count_at_least(const uint64_t count[SLICES], unsigned threshold, uint64_t * exactly)
+{
+    uint64_t above = 0, equal = ~0ULL;
+    for (int b = SLICES - 1; b >= 0; b--) {
+        if (threshold & (1u << b)) {
+            equal &= count[b];
+        } else {
+            above |= equal & count[b];
+            equal &= ~count[b];
+        }
+    }
+    if (exactly != NULL) {
+        *exactly = equal;
+    }
+    return above | equal;
+}
+
+static uint64_t vote_word(const uint64_t words[], size_t count)
+{
+    uint64_t slices[SLICES] = { 0 };
+    for (size_t i = 0; i < count; i++) {
+        count_word(slices, words[i]);
+    }
+    uint64_t majority = count_at_least(slices, (unsigned)(count / 2 + 1), NULL);
+    if (count % 2 == 0) {
+        uint64_t tied;
+        count_at_least(slices, (unsigned)(count / 2), &tied);
+        majority |= tied & words[0];
+    }
+    return majority;
+}
+
+void vote_bits(const uint8_t * const copies[], size_t count, size_t length, uint8_t * out)
+{
+    if (count > VOTE_MAX_COPIES) {
+        count = VOTE_MAX_COPIES;
+    }
+    uint64_t words[VOTE_MAX_COPIES];
+    size_t i = 0;
+    for (; i + 8 <= length; i += 8) {
+        for (size_t c = 0; c < count; c++) {
+            memcpy(&words[c], &copies[c][i], sizeof(uint64_t));
+        }
+        uint64_t result = vote_word(words, count);
+        memcpy(&out[i], &result, sizeof(uint64_t));
+    }
+    if (i < length) {
+        // The last few bytes, in a word of their own.
+        for (size_t c = 0; c < count; c++) {
+            words[c] = 0;
+            memcpy(&words[c], &copies[c][i], length - i);
+        }
+        uint64_t result = vote_word(words, count);
+        memcpy(&out[i], &result, length - i);
+    }
+}
+
+uint8_t vote_byte(const uint8_t values[], size_t count)
+{
+    uint8_t best = (count > 0 ? values[0] : 0);
+    size_t best_count = 0;
+    for (size_t i = 0; i < count; i++) {
+        size_t same = 0;
+        for (size_t j = 0; j < count; j++) {
+            same += (values[j] == values[i]);
+        }
+        if (same > best_count) {
+            best = values[i];
+            best_count = same;
+        }
+    }
+    return best;
+}
+
+uint8_t vote_checksum(const uint8_t * data, size_t length)
+{
+    uint8_t sum = 0;
+    for (size_t i = 0; i < length; i++) {
+        sum += data[i];
+    }
+    return sum;
+}
+
+int vote_open(struct vote_reader * reader,
+              const struct vote_source sources[],
+              size_t count,
+              vote_filter filter,
+              void * context)
+{
+    memset(reader, 0, sizeof(struct vote_reader));
+    reader->filter = filter;
+    reader->context = context;
+    reader->captures = calloc(count, sizeof(struct vote_capture));
+    if (reader->captures == NULL) {
+        return 0;
+    }
+    reader->count = count;
+    int ok = 1;
+    for (size_t c = 0; c < count; c++) {
+        struct vote_capture * capture = &reader->captures[c];
+        capture->source = sources[c];
+        if (capture->source.bytes != NULL) {
+            capture->next = capture->source.bytes;
+            capture->left = capture->source.size;
+        } else if ((capture->chunk = malloc(VOTE_CHUNK_SIZE)) == NULL) {
+            ok = 0;
+        }
+        spherecas_begin_read_callback(&capture->state, NULL, NULL);
+        spherecas_set_options(&capture->state, SPHERECAS_OPTION_ZERO_COPY);
+    }
+    if (!ok) {
+        vote_close(reader, NULL);
+    }
+    return ok;
+}
+
+// Reads blocks from a capture until it has VOTE_LOOKAHEAD of them waiting, or
+// it has no more. Returns 0 on failure.
+static int read_ahead(struct vote_capture * capture)
+{
+    while (capture->ahead_count < VOTE_LOOKAHEAD && !capture->ended) {
+        if (capture->left == 0) {
+            if (capture->source.bytes != NULL) {
+                capture->ended = 1;     // (All of it was there from the start.)
+                break;
+            }
+            ssize_t count = capture->source.read(capture->source.context, capture->chunk, VOTE_CHUNK_SIZE);
+            if (count < 0) {
+                return 0;
+            }
+            if (count == 0) {
+                capture->ended = 1;
+                break;
+            }
+            capture->next = capture->chunk;
+            capture->left = (size_t)count;
+        }
+        struct spherecas_block block;
+        size_t consumed;
+        int found = spherecas_next_block(&capture->state, capture->next, capture->left, &consumed, &block);
+        capture->next += consumed;
+        capture->left -= consumed;
+        if (!found) {
+            continue;
+        }
+        // Copied, as the block may point into the chunk, which is about to be
+        // read over.
+        struct vote_block * ahead = &capture->ahead[capture->ahead_count++];
+        memcpy(ahead->block_name, block.block_name, 2);
+        ahead->length = block.length;
+        ahead->type = block.type;
+        ahead->error = block.error;
+        ahead->checksum = block.checksum;
+        ahead->data = NULL;
+        if (block.data != NULL) {
+            ahead->data = malloc(block.length);
+            if (ahead->data != NULL) {
+                memcpy(ahead->data, block.data, block.length);
+            } else if (ahead->error != SPHERECAS_ERROR_TRAILER) {
+                ahead->error = SPHERECAS_ERROR_MEMORY;
+            }
+        }
+    }
+    return 1;
+}
+
+// Votes on the copies of a block: the first of them that's intact, if any is,
+// or else the majority vote of them all, and so on (see above).
+static void vote_copies(struct vote_reader * reader, struct vote_block * const copies[], size_t count,
+                        struct vote_result * result)
+{
+    const struct vote_block * first = copies[0];
+    const struct vote_block * intact = NULL;
+    size_t payload_count = 0;
+    uint8_t sums[VOTE_MAX_COPIES];
+    size_t sum_count = 0;
+    result->intact = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (copies[i]->error == SPHERECAS_ERROR_NONE) {
+            result->intact++;
+            if (intact == NULL) {
+                intact = copies[i];
+            }
+        }
+        if (copies[i]->data != NULL) {
+            reader->payloads[payload_count++] = copies[i]->data;
+        }
+        if (copies[i]->error != SPHERECAS_ERROR_TRAILER) {
+            sums[sum_count++] = copies[i]->checksum;
+        }
+    }
+
+    result->checksum = vote_byte(sums, sum_count);
+    result->data = first->data;
+    result->type = first->type;
+    result->error = first->error;
+    result->outcome = VOTE_AS_READ;
+    if (intact != NULL) {
+        result->data = intact->data;
+        result->type = intact->type;
+        result->error = SPHERECAS_ERROR_NONE;
+    } else if (payload_count >= 2 && (reader->rebuilt = malloc(first->length)) != NULL) {
+        uint8_t * rebuilt = reader->rebuilt;
+        const uint8_t * voters[VOTE_MAX_COPIES];
+        int passed = 0;
+        // (Leaving out one for each >= 0; the first time round, none.)
+        for (long left_out = -1; left_out < (long)payload_count && !passed; left_out++) {
+            size_t voter_count = 0;
+            for (size_t i = 0; i < payload_count; i++) {
+                if ((long)i != left_out) {
+                    voters[voter_count++] = reader->payloads[i];
+                }
+            }
+            if (voter_count < 2) {
+                break;
+            }
+            vote_bits(voters, voter_count, first->length, rebuilt);
+            passed = (sum_count > 0 && vote_checksum(rebuilt, first->length) == result->checksum);
+            if (passed) {
+                result->outcome = (left_out < 0 ? VOTE_REBUILT : VOTE_REBUILT_LEAVING_ONE_OUT);
+            }
+        }
+        if (!passed) {
+            // The best guess there is, but marked bad.
+            vote_bits(reader->payloads, payload_count, first->length, rebuilt);
+            result->outcome = VOTE_NO_MATCH;
+        }
+        result->data = rebuilt;
+        result->error = (passed ? SPHERECAS_ERROR_NONE :
+                         (sum_count > 0 ? SPHERECAS_ERROR_CHECKSUM : SPHERECAS_ERROR_TRAILER));
+        result->type = SPHERECAS_BLOCKTYPE_TEXT;
+        for (uint32_t i = 0; i < first->length; i++) {
+            if (rebuilt[i] & 0x80) {
+                result->type = SPHERECAS_BLOCKTYPE_OBJECT;
+                break;
+            }
+        }
+        result->voters = reader->payloads;
+        result->voter_count = payload_count;
+    }
+}
+
+int vote_next(struct vote_reader * reader, struct vote_result * result)
+{
+    // The last block's copies are done with.
+    for (size_t i = 0; i < reader->taken_count; i++) {
+        struct vote_capture * capture = &reader->captures[reader->taken[i]];
+        free(capture->ahead[0].data);
+        capture->ahead_count--;
+        memmove(&capture->ahead[0], &capture->ahead[1], capture->ahead_count * sizeof(struct vote_block));
+    }
+    reader->taken_count = 0;
+    free(reader->rebuilt);
+    reader->rebuilt = NULL;
+
+    size_t count = reader->count;
+    struct vote_capture * captures = reader->captures;
+    for (size_t c = 0; c < count; c++) {
+        if (!read_ahead(&captures[c])) {
+            reader->failed = c;
+            return -1;
+        }
+    }
+
+    // The next block is the one at the front of the most captures, of those
+    // that no capture has anything in front of (a block that's missing from
+    // a capture lets the ones after it come to the front early).
+    const struct vote_block * next = NULL;
+    size_t next_votes = 0;
+    int next_clear = 0;
+    for (size_t c = 0; c < count; c++) {
+        if (captures[c].ahead_count == 0) {
+            continue;
+        }
+        const struct vote_block * head = &captures[c].ahead[0];
+        size_t votes = 0;
+        int clear = 1;
+        for (size_t d = 0; d < count; d++) {
+            for (size_t k = 0; k < captures[d].ahead_count; k++) {
+                const struct vote_block * other = &captures[d].ahead[k];
+                if (other->length == head->length && memcmp(other->block_name, head->block_name, 2) == 0) {
+                    if (k == 0) {
+                        votes++;
+                    } else {
+                        clear = 0;
+                    }
+                    break;
+                }
+            }
+        }
+        if (next == NULL || (clear && !next_clear) || (clear == next_clear && votes > next_votes)) {
+            next = head;
+            next_votes = votes;
+            next_clear = clear;
+        }
+    }
+    if (next == NULL) {
+        return 0;       // Every capture has been read through.
+    }
+
+    struct vote_block * copies[VOTE_MAX_COPIES];
+    for (size_t c = 0; c < count; c++) {
+        struct vote_block * head = &captures[c].ahead[0];
+        if (captures[c].ahead_count > 0 && head->length == next->length &&
+            memcmp(head->block_name, next->block_name, 2) == 0) {
+            reader->taken[reader->taken_count] = c;
+            copies[reader->taken_count++] = head;
+        }
+    }
+    memset(result, 0, sizeof(struct vote_result));
+    memcpy(result->block_name, copies[0]->block_name, 2);
+    result->length = copies[0]->length;
+    result->copies = reader->taken_count;
+    result->wanted = (reader->filter == NULL || reader->filter(reader->context, result->block_name));
+    if (result->wanted) {
+        vote_copies(reader, copies, reader->taken_count, result);
+    }
+    return 1;
+}
+
+void vote_close(struct vote_reader * reader, struct spherecas_stats * stats)
+{
+    if (stats != NULL) {
+        memset(stats, 0, sizeof(struct spherecas_stats));
+    }
+    for (size_t c = 0; c < reader->count; c++) {
+        struct vote_capture * capture = &reader->captures[c];
+        if (stats != NULL) {
+            struct spherecas_stats read;
+            spherecas_get_stats(&capture->state, &read);
+            stats->bytes_scanned += read.bytes_scanned;
+            stats->sync_bytes += read.sync_bytes;
+            stats->payload_bytes += read.payload_bytes;
+            stats->headers += read.headers;
+            stats->resyncs += read.resyncs;
+            stats->blocks += read.blocks;
+            stats->trailer_errors += read.trailer_errors;
+            stats->checksum_errors += read.checksum_errors;
+            if (read.largest_block > stats->largest_block) {
+                stats->largest_block = read.largest_block;
+            }
+        }
+        spherecas_end_read(&capture->state);
+        for (size_t k = 0; k < capture->ahead_count; k++) {
+            free(capture->ahead[k].data);
+        }
+        free(capture->chunk);
+    }
+    free(reader->rebuilt);
+    free(reader->captures);
+    memset(reader, 0, sizeof(struct vote_reader));
+}
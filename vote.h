@@ -0,0 +1,134 @@
+//
+//  vote.h
+//
+//  Copyright (c) Ben Zotto 2022
+//  See LICENSE for licensing information.
+//
+//  Majority votes over several copies of the same data, e.g. the payloads of one
+//  block as read from different captures of a worn tape, each of which has its
+//  own scattered errors.
+//
+//  A vote reader (--vote) reads the captures of a tape together, each through a
+//  parser of its own, a block at a time from each, so that none of them needs
+//  to be read in whole first. The captures are kept in step by the blocks'
+//  names and lengths, reading a few blocks ahead in each to see past any that
+//  one of them has lost (or gained). Each block comes out once: intact from
+//  whichever capture has it so, or else rebuilt from all of them by majority
+//  vote -- or, if that doesn't match the checksum that most of them read off
+//  the tape, from all but one of them, leaving each out in turn.
+//
+
+#ifndef VOTE_H
+#define VOTE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include "spherecas.h"
+
+// Most copies that can be voted on at once
+#define VOTE_MAX_COPIES     8
+
+// Blocks a vote reader reads ahead in each capture, to keep them in step
+#define VOTE_LOOKAHEAD      4
+
+// Sets each bit of `out` to the value it has in most of the `count` copies (ties,
+// with an even count, going to the first copy). Wherever most of the copies agree
+// on a whole byte, then, that's the byte that comes out. The copies are counted
+// 64 bits at a time, in bit-sliced counters, rather than bit by bit.
+void vote_bits(const uint8_t * const copies[], size_t count, size_t length, uint8_t * out);
+
+// Returns the most common of `count` values (the first to appear, of any tied).
+uint8_t vote_byte(const uint8_t values[], size_t count);
+
+// Returns the 8-bit sum of `data`, which is what a block's checksum is.
+uint8_t vote_checksum(const uint8_t * data, size_t length);
+
+// Where a capture's bytes come from: all of it at once (`bytes`), or else
+// `read`, a chunk at a time, which returns the count, 0 at the end, or -1 on
+// failure.
+struct vote_source {
+    const uint8_t * bytes;
+    size_t          size;
+    ssize_t         (*read)(void * context, uint8_t * buffer, size_t size);
+    void *          context;
+};
+
+// A block read ahead from one of the captures.
+struct vote_block {
+    char            block_name[2];
+    uint32_t        length;
+    uint8_t *       data;           // NULL if it couldn't be stored
+    enum spherecas_blocktype type;
+    enum spherecas_error error;
+    uint8_t         checksum;       // As on the tape
+};
+
+// One capture of the tape: its source and parser, and the blocks read ahead
+// from it, oldest first.
+struct vote_capture {
+    struct vote_source source;
+    struct spherecas_state state;
+    uint8_t *       chunk;          // Read from `source.read`:
+    const uint8_t * next;           // ...the part not yet parsed
+    size_t          left;
+    int             ended;          // No more blocks in it
+    struct vote_block ahead[VOTE_LOOKAHEAD];
+    size_t          ahead_count;
+};
+
+// How a block came out of a vote.
+enum vote_outcome {
+    VOTE_AS_READ,                   // Intact in a capture, or the first's copy (not voted on)
+    VOTE_REBUILT,                   // Rebuilt by majority vote
+    VOTE_REBUILT_LEAVING_ONE_OUT,   // ...of all but one of the copies
+    VOTE_NO_MATCH                   // No vote matches the checksum (the best guess, marked bad)
+};
+
+struct vote_result {
+    char            block_name[2];
+    uint32_t        length;
+    int             wanted;         // If not, the rest isn't filled in
+    const uint8_t * data;           // Good until the next vote_next (NULL if none)
+    enum spherecas_blocktype type;
+    enum spherecas_error error;
+    uint8_t         checksum;       // The one most of the copies read off the tape
+    size_t          copies;         // Captures it's in,
+    size_t          intact;         // ...and intact in
+    enum vote_outcome outcome;
+    const uint8_t * const * voters; // If rebuilt, the copies it was rebuilt from
+    size_t          voter_count;
+};
+
+// Says whether a block is wanted; one that isn't is counted, but not voted on.
+typedef int (*vote_filter)(void * context, const char block_name[2]);
+
+struct vote_reader {
+    struct vote_capture * captures;
+    size_t          count;
+    size_t          failed;         // The capture that couldn't be read, when one can't
+    vote_filter     filter;
+    void *          context;
+    size_t          taken[VOTE_MAX_COPIES]; // The captures the last block came from
+    size_t          taken_count;
+    const uint8_t * payloads[VOTE_MAX_COPIES];
+    uint8_t *       rebuilt;
+};
+
+// Starts reading `count` captures (2 to VOTE_MAX_COPIES) together, passing
+// each block to `filter`, if not NULL, first. Returns 0 if out of memory.
+int vote_open(struct vote_reader * reader,
+              const struct vote_source sources[],
+              size_t count,
+              vote_filter filter,
+              void * context);
+
+// Reads the next block. Returns 1 with `result` filled in, 0 once every capture
+// has been read through, or -1 if capture `reader->failed` couldn't be read.
+int vote_next(struct vote_reader * reader, struct vote_result * result);
+
+// Stops reading, and sets `stats` to the parsers' counters summed over all of
+// the captures (`bytes_scanned` is then how much was read of them all).
+void vote_close(struct vote_reader * reader, struct spherecas_stats * stats);
+
+#endif
@@ -0,0 +1,170 @@
+//
+//  watch.c
+//
+//  Copyright (c) Ben Zotto 2022
+//  See LICENSE for licensing information.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+#include "watch.h"
+
+static const char * const ignored_extensions[] = {
+    ".bin", ".stored", ".index", ".checkpoint"
+};
+
+int watch_ignores(const char * name)
+{
+    if (name[0] == '.' || name[0] == '\0') {
+        return 1;
+    }
+    size_t length = strlen(name);
+    for (size_t i = 0; i < sizeof(ignored_extensions) / sizeof(ignored_extensions[0]); i++) {
+        size_t extension = strlen(ignored_extensions[i]);
+        if (length > extension && strcmp(&name[length - extension], ignored_extensions[i]) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Hands a file in a watched directory to the callback, unless it's ignored.
+static void report(const char * directory, const char * name, watch_callback callback, void * context, int swept)
+{
+    if (watch_ignores(name)) {
+        return;
+    }
+    size_t size = strlen(directory) + strlen(name) + 2;
+    char * path = malloc(size);
+    if (path == NULL) {
+        return;
+    }
+    snprintf(path, size, "%s/%s", directory, name);
+    struct stat st;
+    // (A sweep sees everything, including the odd subdirectory.)
+    if (!swept || (stat(path, &st) == 0 && S_ISREG(st.st_mode))) {
+        callback(context, path, swept);
+    }
+    free(path);
+}
+
+#ifdef __linux__
+
+int watch_open(struct watch * watch, char * const directories[], size_t count)
+{
+    memset(watch, 0, sizeof(struct watch));
+    watch->directories = directories;
+    watch->count = count;
+    watch->descriptors = malloc(count * sizeof(int));
+    watch->events = malloc(WATCH_EVENT_BUFFER);
+    watch->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (watch->descriptors == NULL || watch->events == NULL || watch->fd < 0) {
+        int error = (watch->fd < 0 ? errno : ENOMEM);
+        watch_close(watch);
+        errno = error;
+        return 0;
+    }
+    for (size_t i = 0; i < count; i++) {
+        watch->descriptors[i] = inotify_add_watch(watch->fd, directories[i], IN_CLOSE_WRITE | IN_MOVED_TO | IN_ONLYDIR);
+        if (watch->descriptors[i] < 0) {
+            int error = errno;
+            watch_close(watch);
+            errno = error;
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int watch_read(struct watch * watch, watch_callback callback, void * context)
+{
+    for (;;) {
+        ssize_t size = read(watch->fd, watch->events, WATCH_EVENT_BUFFER);
+        if (size < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return (errno == EAGAIN || errno == EWOULDBLOCK);
+        }
+        for (ssize_t at = 0; at < size; ) {
+            const struct inotify_event * event = (const struct inotify_event *)&watch->events[at];
+            at += sizeof(struct inotify_event) + event->len;
+            if (event->mask & IN_Q_OVERFLOW) {
+                watch->overflowed = 1;
+                continue;
+            }
+            if (event->len == 0 || (event->mask & IN_ISDIR)) {
+                continue;
+            }
+            for (size_t i = 0; i < watch->count; i++) {
+                if (watch->descriptors[i] == event->wd) {
+                    report(watch->directories[i], event->name, callback, context, 0);
+                    break;
+                }
+            }
+        }
+        if (watch->overflowed) {
+            // The kernel's queue filled up, so some captures went unseen.
+            watch_sweep(watch, callback, context);
+        }
+    }
+}
+
+#else
+
+int watch_open(struct watch * watch, char * const directories[], size_t count)
+{
+    memset(watch, 0, sizeof(struct watch));
+    watch->fd = -1;
+    (void)directories;
+    (void)count;
+    errno = ENOSYS;
+    return 0;
+}
+
+int watch_read(struct watch * watch, watch_callback callback, void * context)
+{
+    (void)watch;
+    (void)callback;
+    (void)context;
+    errno = ENOSYS;
+    return 0;
+}
+
+#endif
+
+void watch_sweep(struct watch * watch, watch_callback callback, void * context)
+{
+    watch->overflowed = 0;
+    for (size_t i = 0; i < watch->count; i++) {
+        DIR * dir = opendir(watch->directories[i]);
+        if (dir == NULL) {
+            continue;
+        }
+        struct dirent * entry;
+        while ((entry = readdir(dir)) != NULL) {
+            report(watch->directories[i], entry->d_name, callback, context, 1);
+        }
+        closedir(dir);
+    }
+}
+
+void watch_close(struct watch * watch)
+{
+    if (watch->fd >= 0) {
+        close(watch->fd);
+        watch->fd = -1;
+    }
+    free(watch->descriptors);
+    free(watch->events);
+    watch->descriptors = NULL;
+    watch->events = NULL;
+}
@@ -0,0 +1,57 @@
+//
+//  watch.h
+//
+//  Copyright (c) Ben Zotto 2022
+//  See LICENSE for licensing information.
+//
+//  Watching spool directories for tape captures, with inotify (on Linux; on
+//  other systems, watch_open fails with ENOSYS). A capture counts as complete
+//  once whatever was writing it has closed it, or as soon as it's moved into
+//  the directory (the way to drop one in all at once). Only the directories
+//  themselves are watched, not any below them.
+//
+//  Files the tool writes itself (.bin, .stored, .index, .checkpoint), and
+//  hidden ones (a capture program's temporary files, say), are ignored.
+//
+
+#ifndef WATCH_H
+#define WATCH_H
+
+#include <stddef.h>
+
+// Room for a batch of events (each up to NAME_MAX more than the fixed part)
+#define WATCH_EVENT_BUFFER  (64 * 1024)
+
+struct watch {
+    int             fd;             // For poll(): readable when there are events
+    int *           descriptors;    // Per directory: its inotify watch
+    char * const *  directories;
+    size_t          count;
+    int             overflowed;     // Events were lost (and a sweep made up for them)
+    char *          events;
+};
+
+// Called for each complete capture, with its path (the directory's name, a
+// slash, and the file's), which is only good during the call. `swept` is set
+// for one found by a sweep, which may well have been read already, rather
+// than one that has just been completed.
+typedef void (*watch_callback)(void * context, const char * path, int swept);
+
+// Starts watching the directories, whose names must last as long as the watch.
+// Returns 0, with errno set, on failure.
+int watch_open(struct watch * watch, char * const directories[], size_t count);
+
+// Whether a file name is one to ignore (see above).
+int watch_ignores(const char * name);
+
+// Passes every capture that's in the directories already to the callback.
+void watch_sweep(struct watch * watch, watch_callback callback, void * context);
+
+// Passes the captures completed since the last call to the callback, without
+// waiting for any. If events were lost, sweeps the directories instead. Returns
+// 0, with errno set, if the events couldn't be read.
+int watch_read(struct watch * watch, watch_callback callback, void * context);
+
+void watch_close(struct watch * watch);
+
+#endif
@@ -0,0 +1,240 @@
+//
+//  writer.c
+//
+//  Copyright (c) Ben Zotto 2022
+//  See LICENSE for licensing information.
+//
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "writer.h"
+
+static void * writer_thread(void * arg);
+
+int writer_start(struct block_writer * writer)
+{
+    memset(writer, 0, sizeof(struct block_writer));
+    writer->directory_fd = -1;
+    if (pthread_mutex_init(&writer->lock, NULL) != 0) {
+        return 0;
+    }
+    pthread_cond_init(&writer->queued, NULL);
+    pthread_cond_init(&writer->room, NULL);
+    // Without a thread, files are simply written in turn.
+    writer->threaded = (pthread_create(&writer->thread, NULL, writer_thread, writer) == 0);
+    return 1;
+}
+
+// Notes a failure. (Called with the lock held.)
+static void add_failure(struct block_writer * writer, const char * path, int error)
+{
+    if (writer->failure_count == writer->failure_capacity) {
+        size_t capacity = (writer->failure_capacity ? writer->failure_capacity * 2 : 16);
+        struct writer_failure * grown = realloc(writer->failures, capacity * sizeof(struct writer_failure));
+        if (grown == NULL) {
+            return;
+        }
+        writer->failures = grown;
+        writer->failure_capacity = capacity;
+    }
+    writer->failures[writer->failure_count].path = strdup(path);
+    writer->failures[writer->failure_count].error = error;
+    writer->failure_count++;
+}
+
+// Opens a file for writing: relative to its directory if that's the same one
+// as last time, and otherwise after opening (and keeping) the new directory.
+static int open_output(struct block_writer * writer, const char * path)
+{
+    // The directory as it's opened: what comes before the last slash, "/" if
+    // that's nothing, or "." if there's no slash at all. (What's kept is this,
+    // so that "/x.bin" and "y.bin" aren't taken to be in the same one.)
+    const char * slash = strrchr(path, '/');
+    const char * leaf = (slash != NULL ? slash + 1 : path);
+    const char * directory = path;
+    size_t directory_length = (slash != NULL ? (size_t)(slash - path) : 0);
+    if (slash == NULL || directory_length == 0) {
+        directory = (slash == NULL ? "." : "/");
+        directory_length = 1;
+    }
+
+    if (writer->directory == NULL ||
+        strlen(writer->directory) != directory_length ||
+        memcmp(writer->directory, directory, directory_length) != 0) {
+        if (writer->directory_fd >= 0) {
+            close(writer->directory_fd);
+        }
+        free(writer->directory);
+        writer->directory = strndup(directory, directory_length);
+        writer->directory_fd = -1;
+        if (writer->directory != NULL) {
+            writer->directory_fd = open(writer->directory, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        }
+    }
+    if (writer->directory_fd < 0) {
+        return open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    }
+    return openat(writer->directory_fd, leaf, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+}
+
+// Writes one file. Returns 0, or the errno value it failed with.
+static int write_item(struct block_writer * writer, const struct writer_item * item)
+{
+    int fd = open_output(writer, item->path);
+    if (fd < 0) {
+        return errno;
+    }
+    int error = 0;
+    for (size_t done = 0; done < item->length; ) {
+        ssize_t count = write(fd, &item->data[done], item->length - done);
+        if (count < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            error = errno;
+            break;
+        }
+        done += (size_t)count;
+    }
+    if (close(fd) != 0 && error == 0) {
+        error = errno;
+    }
+    return error;
+}
+
+// Writes out a batch of files, then settles up for them.
+static void write_batch(struct block_writer * writer, struct writer_item * batch, size_t count)
+{
+    int errors[WRITER_BATCH];
+    size_t bytes = 0;
+    for (size_t i = 0; i < count; i++) {
+        errors[i] = write_item(writer, &batch[i]);
+        bytes += batch[i].length;
+    }
+
+    pthread_mutex_lock(&writer->lock);
+    for (size_t i = 0; i < count; i++) {
+        if (errors[i] != 0) {
+            add_failure(writer, batch[i].path, errors[i]);
+        } else {
+            writer->written++;
+        }
+        free(batch[i].path);
+        free(batch[i].data);
+    }
+    writer->pending_bytes -= bytes;
+    pthread_cond_broadcast(&writer->room);
+    pthread_mutex_unlock(&writer->lock);
+}
+
+static void * writer_thread(void * arg)
+{
+    struct block_writer * writer = arg;
+    struct writer_item batch[WRITER_BATCH];
+    for (;;) {
+        pthread_mutex_lock(&writer->lock);
+        while (writer->count == 0 && !writer->closing) {
+            pthread_cond_wait(&writer->queued, &writer->lock);
+        }
+        if (writer->count == 0) {
+            pthread_mutex_unlock(&writer->lock);
+            return NULL;
+        }
+        size_t count = 0;
+        while (count < WRITER_BATCH && writer->count > 0) {
+            batch[count++] = writer->items[writer->head];
+            writer->head = (writer->head + 1) % WRITER_QUEUE_ITEMS;
+            writer->count--;
+        }
+        pthread_mutex_unlock(&writer->lock);
+        write_batch(writer, batch, count);
+    }
+}
+
+int writer_put(struct block_writer * writer, const char * path, const uint8_t * data, size_t length)
+{
+    struct writer_item item;
+    item.path = strdup(path);
+    item.data = malloc(length ? length : 1);
+    item.length = length;
+    if (item.path == NULL || item.data == NULL) {
+        free(item.path);
+        free(item.data);
+        pthread_mutex_lock(&writer->lock);
+        add_failure(writer, path, ENOMEM);
+        pthread_mutex_unlock(&writer->lock);
+        return 0;
+    }
+    memcpy(item.data, data, length);
+
+    pthread_mutex_lock(&writer->lock);
+    if (!writer->threaded) {
+        // (Under the lock, as it may be called from more than one thread.)
+        int error = write_item(writer, &item);
+        if (error != 0) {
+            add_failure(writer, item.path, error);
+        } else {
+            writer->written++;
+        }
+        pthread_mutex_unlock(&writer->lock);
+        free(item.path);
+        free(item.data);
+        return 1;
+    }
+    writer->pending_bytes += length;
+    // (Something bigger than the limit on its own still goes, once the queue
+    // has emptied.)
+    while (writer->count == WRITER_QUEUE_ITEMS ||
+           (writer->pending_bytes > WRITER_QUEUE_BYTES && writer->pending_bytes > length)) {
+        pthread_cond_wait(&writer->room, &writer->lock);
+    }
+    writer->items[(writer->head + writer->count) % WRITER_QUEUE_ITEMS] = item;
+    writer->count++;
+    pthread_cond_signal(&writer->queued);
+    pthread_mutex_unlock(&writer->lock);
+    return 1;
+}
+
+void writer_flush(struct block_writer * writer)
+{
+    pthread_mutex_lock(&writer->lock);
+    while (writer->threaded && (writer->count > 0 || writer->pending_bytes > 0)) {
+        pthread_cond_wait(&writer->room, &writer->lock);
+    }
+    pthread_mutex_unlock(&writer->lock);
+}
+
+size_t writer_finish(struct block_writer * writer)
+{
+    if (writer->threaded) {
+        pthread_mutex_lock(&writer->lock);
+        writer->closing = 1;
+        pthread_cond_signal(&writer->queued);
+        pthread_mutex_unlock(&writer->lock);
+        pthread_join(writer->thread, NULL);
+        writer->threaded = 0;
+    }
+    if (writer->directory_fd >= 0) {
+        close(writer->directory_fd);
+        writer->directory_fd = -1;
+    }
+    free(writer->directory);
+    writer->directory = NULL;
+    return writer->failure_count;
+}
+
+void writer_destroy(struct block_writer * writer)
+{
+    for (size_t i = 0; i < writer->failure_count; i++) {
+        free(writer->failures[i].path);
+    }
+    free(writer->failures);
+    writer->failures = NULL;
+    writer->failure_count = 0;
+    pthread_cond_destroy(&writer->queued);
+    pthread_cond_destroy(&writer->room);
+    pthread_mutex_destroy(&writer->lock);
+}
@@ -0,0 +1,77 @@
+//
+//  writer.h
+//
+//  Copyright (c) Ben Zotto 2022
+//  See LICENSE for licensing information.
+//
+//  A background writer for output files. Payloads are copied into a queue and
+//  written out by a thread of its own, a batch at a time, so that reading never
+//  waits on file creation (which can be slow, on network filesystems above
+//  all). Files in the same directory as the one before are opened relative to
+//  it, which saves looking the whole path up again for each one.
+//
+//  The queue is bounded: whoever adds to it waits while it's full. Failures
+//  are collected, to be reported once everything has been written.
+//
+
+#ifndef WRITER_H
+#define WRITER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+// Bounds on what's queued (or being written) at once
+#define WRITER_QUEUE_ITEMS  1024
+#define WRITER_QUEUE_BYTES  (16 * 1024 * 1024)
+
+// Files written per batch
+#define WRITER_BATCH        64
+
+struct writer_item {
+    char *          path;
+    uint8_t *       data;
+    size_t          length;
+};
+
+struct writer_failure {
+    char *          path;
+    int             error;          // An errno value
+};
+
+struct block_writer {
+    pthread_mutex_t lock;
+    pthread_cond_t  queued;         // Signalled when there's more to write, or no more to come
+    pthread_cond_t  room;           // Signalled when there's room in the queue
+    pthread_t       thread;
+    int             threaded;       // If not, files are written as they're added
+    int             closing;
+    struct writer_item items[WRITER_QUEUE_ITEMS];
+    size_t          head;
+    size_t          count;
+    size_t          pending_bytes;  // Queued or being written
+    size_t          written;
+    struct writer_failure * failures;
+    size_t          failure_count;
+    size_t          failure_capacity;
+    int             directory_fd;   // (For the writing thread)
+    char *          directory;
+};
+
+// Starts a writer. Returns 0 on failure.
+int writer_start(struct block_writer * writer);
+
+// Queues a file to be written, copying its name and contents, and waiting for
+// room first if need be. Returns 0 if it can't be queued (which is also
+// counted as a failure).
+int writer_put(struct block_writer * writer, const char * path, const uint8_t * data, size_t length);
+
+// Waits until everything queued so far has been written (or has failed).
+void writer_flush(struct block_writer * writer);
+
+// Writes out whatever is still queued and stops the writer. The failures are
+// left in `failures` (until `writer_destroy`). Returns how many there were.
+size_t writer_finish(struct block_writer * writer);
+void writer_destroy(struct block_writer * writer);
+
+#endif